@@ -3,7 +3,9 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <signal.h>
 #include <blf.h>  // Use the installed library header
+#include <blf_net.h>
 #include "blf_cli.h"
 
 static void print_usage(void) {
@@ -15,8 +17,18 @@ static void print_usage(void) {
     printf("  blf get <filename> <key>                Get a value by key\n");
     printf("  blf delete <filename> <key>             Delete a key-value pair\n");
     printf("  blf write-raw <filename> <input-file>   Write raw data from file\n");
-    printf("  blf read-raw <filename> <output-file>   Read raw data to file\n");
+    printf("  blf read-raw <filename> <output-file> [offset] [length]\n");
+    printf("                                          Read raw data (or a range of it) to file\n");
     printf("  blf list <filename>                     List all key-value pairs\n");
+    printf("  blf compact <filename>                  Rewrite the file without free space\n");
+    printf("  blf merge [--first-wins] <output> <input>...\n");
+    printf("                                          Merge files; later inputs win conflicts\n");
+    printf("  blf diff <a> <b>                        Show keys added (+), removed (-) or changed (~)\n");
+    printf("  blf clone <source> <target>             Snapshot a file, sharing extents where possible\n");
+    printf("  blf batch <filename> [script] [--binary]\n");
+    printf("                                          Run put/get/delete lines from stdin or a script\n");
+    printf("  blf serve <filename> --socket <path> [--no-sync]\n");
+    printf("                                          Serve the file over a Unix socket\n");
     printf("  blf help                                Display this help message\n");
 }
 
@@ -56,11 +68,50 @@ static bool cmd_info(int argc, char **argv) {
     printf("  KV Section Size: %lu bytes\n", file->header.kv_size);
     printf("  Raw Data Offset: %lu bytes\n", file->header.raw_offset);
     printf("  Raw Data Size: %lu bytes\n", file->header.raw_size);
+    if (file->header.index_offset != 0) {
+        printf("  Index Offset: %lu bytes\n", file->header.index_offset);
+        printf("  Index Size: %lu bytes\n", file->header.index_size);
+    } else {
+        printf("  Index: none (built on first lookup)\n");
+    }
+
+    blf_free_stats_t stats;
+    if (blf_free_stats(file, &stats) && stats.free_extents > 0) {
+        printf("  Free Space: %lu bytes in %lu extent(s), largest %lu bytes\n",
+               stats.free_bytes, stats.free_extents, stats.largest_extent);
+        printf("  Fragmentation: %.1f%%\n", stats.fragmentation * 100.0);
+    } else {
+        printf("  Free Space: none\n");
+    }
 
     blf_close(file);
     return true;
 }
 
+static bool cmd_compact(int argc, char **argv) {
+    if (argc < 1) {
+        fprintf(stderr, "Error: Filename required\n");
+        return false;
+    }
+
+    blf_file_t *file = blf_open(argv[0]);
+    if (!file) {
+        fprintf(stderr, "Error: Could not open BLF file '%s'\n", argv[0]);
+        return false;
+    }
+
+    uint64_t before = file->header.kv_size;
+    if (!blf_compact(file)) {
+        fprintf(stderr, "Error: Could not compact '%s'\n", argv[0]);
+        blf_close(file);
+        return false;
+    }
+
+    printf("Compacted KV section from %lu to %lu bytes\n", before, file->header.kv_size);
+    blf_close(file);
+    return true;
+}
+
 static bool cmd_put(int argc, char **argv) {
     if (argc < 3) {
         fprintf(stderr, "Error: Filename, key, and value required\n");
@@ -223,18 +274,22 @@ static bool cmd_read_raw(int argc, char **argv) {
         return false;
     }
 
-    // Allocate buffer
-    void *data = malloc(raw_size);
-    if (!data) {
-        fprintf(stderr, "Error: Memory allocation failed\n");
+    // Optional range within the raw section
+    uint64_t offset = argc > 2 ? strtoull(argv[2], NULL, 0) : 0;
+    uint64_t length = argc > 3 ? strtoull(argv[3], NULL, 0) : raw_size;
+    if (offset > raw_size) {
+        fprintf(stderr, "Error: Offset %lu is past the raw data (%lu bytes)\n", offset, raw_size);
         blf_close(file);
         return false;
     }
+    if (length > raw_size - offset) {
+        length = raw_size - offset;
+    }
 
-    // Read raw data
-    if (!blf_read_raw(file, data, &raw_size)) {
-        fprintf(stderr, "Error: Failed to read raw data\n");
-        free(data);
+    // Allocate buffer
+    void *data = malloc(RAW_CHUNK_SIZE);
+    if (!data) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
         blf_close(file);
         return false;
     }
@@ -247,22 +302,51 @@ static bool cmd_read_raw(int argc, char **argv) {
         return false;
     }
 
-    // Write to output file
-    if (fwrite(data, 1, raw_size, output) != raw_size) {
-        fprintf(stderr, "Error: Failed to write to output file\n");
-        fclose(output);
-        free(data);
-        blf_close(file);
-        return false;
+    blf_raw_advise(file, offset, length, BLF_ADVICE_SEQUENTIAL);
+
+    // Copy the range in chunks
+    uint64_t done = 0;
+    while (done < length) {
+        uint64_t chunk = length - done < RAW_CHUNK_SIZE ? length - done : RAW_CHUNK_SIZE;
+
+        if (!blf_read_raw_at(file, offset + done, data, &chunk) || chunk == 0) {
+            fprintf(stderr, "Error: Failed to read raw data\n");
+            fclose(output);
+            free(data);
+            blf_close(file);
+            return false;
+        }
+
+        if (fwrite(data, 1, chunk, output) != chunk) {
+            fprintf(stderr, "Error: Failed to write to output file\n");
+            fclose(output);
+            free(data);
+            blf_close(file);
+            return false;
+        }
+
+        done += chunk;
     }
 
     fclose(output);
     free(data);
-    printf("Read %lu bytes of raw data\n", raw_size);
+    printf("Read %lu bytes of raw data\n", length);
     blf_close(file);
     return true;
 }
 
+static const char *type_name(uint8_t type) {
+    switch (type) {
+    case BLF_TYPE_U64: return "u64";
+    case BLF_TYPE_F64: return "f64";
+    case BLF_TYPE_I64: return "i64";
+    case BLF_TYPE_U32: return "u32";
+    case BLF_TYPE_I32: return "i32";
+    case BLF_TYPE_F32: return "f32";
+    default: return "unknown";
+    }
+}
+
 static bool cmd_list(int argc, char **argv) {
     if (argc < 1) {
         fprintf(stderr, "Error: Filename required\n");
@@ -297,6 +381,7 @@ static bool cmd_list(int argc, char **argv) {
     
     while (current_offset < end_offset) {
         blf_kv_entry_t entry;
+        blf_kv_ext_t ext = {0};
         
         // Read entry header
         if (fread(&entry, sizeof(blf_kv_entry_t), 1, file->fp) != 1) {
@@ -306,37 +391,68 @@ static bool cmd_list(int argc, char **argv) {
         }
         
         current_offset += sizeof(blf_kv_entry_t);
+
+        // Free entries hold no key; skip the released extent
+        if (entry.key_length & BLF_KV_FLAG_FREE) {
+            if (fseek(file->fp, entry.value_length, SEEK_CUR) != 0) {
+                fprintf(stderr, "Error: Could not seek past free space\n");
+                blf_close(file);
+                return false;
+            }
+            current_offset += entry.value_length;
+            continue;
+        }
+        
+        // Read extended header of typed and aligned entries
+        if (entry.key_length & BLF_KV_FLAG_EXT) {
+            if (fread(&ext, sizeof(blf_kv_ext_t), 1, file->fp) != 1) {
+                fprintf(stderr, "Error: Could not read entry header\n");
+                blf_close(file);
+                return false;
+            }
+            current_offset += sizeof(blf_kv_ext_t);
+        }
+        
+        uint32_t key_length = entry.key_length & BLF_KV_KEY_MASK;
         
         // Read key
-        char *key = (char*)malloc(entry.key_length + 1);
+        char *key = (char*)malloc(key_length + 1);
         if (!key) {
             fprintf(stderr, "Error: Memory allocation failed\n");
             blf_close(file);
             return false;
         }
         
-        if (fread(key, 1, entry.key_length, file->fp) != entry.key_length) {
+        if (fread(key, 1, key_length, file->fp) != key_length) {
             fprintf(stderr, "Error: Could not read key\n");
             free(key);
             blf_close(file);
             return false;
         }
-        key[entry.key_length] = '\0';
+        key[key_length] = '\0';
         
-        current_offset += entry.key_length;
+        current_offset += key_length;
         
-        printf("  %s (%u bytes value)\n", key, entry.value_length);
+        if (ext.type == BLF_TYPE_U64 && ext.count == 1) {
+            printf("  %s (u64 value)\n", key);
+        } else if (ext.type == BLF_TYPE_F64 && ext.count == 1) {
+            printf("  %s (f64 value)\n", key);
+        } else if (ext.type != BLF_TYPE_BYTES) {
+            printf("  %s (%s[%u], %u-byte aligned)\n", key, type_name(ext.type), ext.count, 1u << ext.align_log2);
+        } else {
+            printf("  %s (%u bytes value)\n", key, entry.value_length);
+        }
         free(key);
         count++;
         
-        // Skip value
-        if (fseek(file->fp, entry.value_length, SEEK_CUR) != 0) {
+        // Skip padding and value
+        if (fseek(file->fp, ext.pad + entry.value_length, SEEK_CUR) != 0) {
             fprintf(stderr, "Error: Could not seek past value\n");
             blf_close(file);
             return false;
         }
         
-        current_offset += entry.value_length;
+        current_offset += ext.pad + entry.value_length;
     }
     
     printf("Total: %d key-value pair(s)\n", count);
@@ -344,6 +460,336 @@ static bool cmd_list(int argc, char **argv) {
     return true;
 }
 
+// Conflict resolution for --first-wins: keep the earliest input's value
+static int merge_first_wins(void *user, const blf_merge_value_t *values, int count) {
+    (void)user;
+    (void)values;
+    (void)count;
+    return 0;
+}
+
+static bool cmd_merge(int argc, char **argv) {
+    blf_merge_fn resolve = NULL;
+    if (argc > 0 && strcmp(argv[0], "--first-wins") == 0) {
+        resolve = merge_first_wins;
+        argc--;
+        argv++;
+    }
+
+    if (argc < 2) {
+        fprintf(stderr, "Error: Output file and at least one input file required\n");
+        return false;
+    }
+
+    if (!blf_merge(argv[0], (const char *const *)argv + 1, argc - 1, resolve, NULL)) {
+        fprintf(stderr, "Error: Could not merge into '%s'\n", argv[0]);
+        return false;
+    }
+
+    printf("Merged %d file(s) into %s\n", argc - 1, argv[0]);
+    return true;
+}
+
+static void print_diff(void *user, const char *key, uint32_t key_length, blf_diff_t change) {
+    int *count = (int*)user;
+    char mark = change == BLF_DIFF_ADDED ? '+' : change == BLF_DIFF_REMOVED ? '-' : '~';
+    printf("%c %.*s\n", mark, (int)key_length, key);
+    (*count)++;
+}
+
+static bool cmd_diff(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Error: Two BLF filenames required\n");
+        return false;
+    }
+
+    int count = 0;
+    if (!blf_diff(argv[0], argv[1], print_diff, &count)) {
+        fprintf(stderr, "Error: Could not compare '%s' and '%s'\n", argv[0], argv[1]);
+        return false;
+    }
+
+    printf("Total: %d difference(s)\n", count);
+    return true;
+}
+
+static bool cmd_clone(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Error: Source and target filenames required\n");
+        return false;
+    }
+
+    if (!blf_clone(argv[0], argv[1])) {
+        fprintf(stderr, "Error: Could not clone '%s' to '%s'\n", argv[0], argv[1]);
+        return false;
+    }
+
+    printf("Cloned %s to %s\n", argv[0], argv[1]);
+    return true;
+}
+
+// Read one line without its newline into a growing buffer; returns false
+// at end of input
+static bool read_line(FILE *input, char **line, size_t *capacity, size_t *length) {
+    *length = 0;
+    for (;;) {
+        if (*capacity - *length < 2) {
+            size_t grown_capacity = *capacity ? *capacity * 2 : 4096;
+            char *grown = (char*)realloc(*line, grown_capacity);
+            if (!grown) {
+                return false;
+            }
+            *line = grown;
+            *capacity = grown_capacity;
+        }
+        if (!fgets(*line + *length, (int)(*capacity - *length), input)) {
+            return *length > 0;
+        }
+        *length += strlen(*line + *length);
+        if ((*line)[*length - 1] == '\n') {
+            (*line)[--(*length)] = '\0';
+            return true;
+        }
+    }
+}
+
+// Print a value on one line. Binary mode frames it with its length; text
+// mode escapes backslashes, newlines and other control bytes so a value
+// cannot be mistaken for the output of the next command.
+static void print_value(const char *value, uint32_t length, bool binary) {
+    if (binary) {
+        printf("VALUE %u\n", length);
+        fwrite(value, 1, length, stdout);
+        putchar('\n');
+        return;
+    }
+    for (uint32_t i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)value[i];
+        if (c == '\\') {
+            fputs("\\\\", stdout);
+        } else if (c == '\n') {
+            fputs("\\n", stdout);
+        } else if (c == '\r') {
+            fputs("\\r", stdout);
+        } else if (c == '\t') {
+            fputs("\\t", stdout);
+        } else if (c < 0x20 || c == 0x7f) {
+            printf("\\x%02x", c);
+        } else {
+            putchar(c);
+        }
+    }
+    putchar('\n');
+}
+
+static bool cmd_batch(int argc, char **argv) {
+    if (argc < 1) {
+        fprintf(stderr, "Error: Filename required\n");
+        return false;
+    }
+
+    const char *script = NULL;
+    bool binary = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--binary") == 0) {
+            binary = true;
+        } else if (!script) {
+            script = argv[i];
+        } else {
+            fprintf(stderr, "Error: Unexpected argument '%s'\n", argv[i]);
+            return false;
+        }
+    }
+
+    FILE *input = stdin;
+    if (script && strcmp(script, "-") != 0) {
+        input = fopen(script, "rb");
+        if (!input) {
+            fprintf(stderr, "Error: Could not open script '%s'\n", script);
+            return false;
+        }
+    }
+
+    blf_file_t *file = blf_open(argv[0]);
+    if (!file) {
+        fprintf(stderr, "Error: Could not open BLF file '%s'\n", argv[0]);
+        if (input != stdin) fclose(input);
+        return false;
+    }
+
+    char *line = NULL;
+    size_t line_capacity = 0;
+    size_t line_length;
+    uint32_t value_capacity = 4096;
+    char *value = (char*)malloc(value_capacity);
+    bool dirty = false;  // Writes since the last commit
+    int failures = 0;
+    long line_number = 0;
+
+    while (value && read_line(input, &line, &line_capacity, &line_length)) {
+        line_number++;
+        if (line_length > 0 && line[line_length - 1] == '\r') {
+            line[--line_length] = '\0';
+        }
+        if (line_length == 0 || line[0] == '#') {
+            continue;
+        }
+
+        // <command> [<key> [<value>|<length>]]
+        char *command = line;
+        char *key = strchr(command, ' ');
+        char *rest = NULL;
+        if (key) {
+            *key++ = '\0';
+            rest = strchr(key, ' ');
+            if (rest) {
+                *rest++ = '\0';
+            }
+        }
+
+        bool is_write = strcmp(command, "put") == 0 || strcmp(command, "delete") == 0;
+        if (!is_write && dirty) {
+            // A run of writes ends: make it durable with one commit
+            if (!blf_commit(file)) {
+                fprintf(stderr, "Error: Commit failed before line %ld\n", line_number);
+                failures++;
+            }
+            dirty = false;
+        }
+
+        bool ok = true;
+        if (strcmp(command, "put") == 0 && key && rest) {
+            const char *data = rest;
+            uint32_t data_length = (uint32_t)strlen(rest);
+            if (binary) {
+                // The value follows as <length> raw bytes and a newline
+                char *end;
+                unsigned long length = strtoul(rest, &end, 10);
+                if (*end != '\0' || length > UINT32_MAX) {
+                    fprintf(stderr, "Error: Line %ld: invalid value length '%s'\n", line_number, rest);
+                    failures++;
+                    break;
+                }
+                if (length > value_capacity) {
+                    char *grown = (char*)realloc(value, length);
+                    if (!grown) {
+                        break;
+                    }
+                    value = grown;
+                    value_capacity = (uint32_t)length;
+                }
+                if (fread(value, 1, length, input) != length || getc(input) != '\n') {
+                    fprintf(stderr, "Error: Line %ld: truncated value\n", line_number);
+                    failures++;
+                    break;
+                }
+                data = value;
+                data_length = (uint32_t)length;
+            }
+            ok = blf_put_kv(file, key, data, data_length);
+            dirty = true;
+        } else if (strcmp(command, "delete") == 0 && key && !rest) {
+            ok = blf_delete_kv(file, key);
+            dirty = true;
+        } else if (strcmp(command, "get") == 0 && key && !rest) {
+            uint32_t value_len = value_capacity;
+            ok = blf_get_kv(file, key, value, &value_len);
+            if (!ok && value_len > value_capacity) {
+                char *grown = (char*)realloc(value, value_len);
+                if (!grown) {
+                    break;
+                }
+                value = grown;
+                value_capacity = value_len;
+                ok = blf_get_kv(file, key, value, &value_len);
+            }
+            if (ok) {
+                print_value(value, value_len, binary);
+            } else if (binary) {
+                printf("NOT_FOUND\n");
+            } else {
+                fprintf(stderr, "Error: Line %ld: key '%s' not found\n", line_number, key);
+            }
+            continue;
+        } else if (strcmp(command, "commit") == 0 && !key) {
+            continue;
+        } else {
+            fprintf(stderr, "Error: Line %ld: unknown or malformed command '%s'\n", line_number, command);
+            failures++;
+            continue;
+        }
+
+        if (!ok) {
+            fprintf(stderr, "Error: Line %ld: %s of '%s' failed\n", line_number, command, key);
+            failures++;
+        }
+    }
+
+    if (!value) {
+        fprintf(stderr, "Error: Out of memory\n");
+        failures++;
+    }
+    if (dirty && !blf_commit(file)) {
+        fprintf(stderr, "Error: Final commit failed\n");
+        failures++;
+    }
+
+    free(value);
+    free(line);
+    blf_close(file);
+    if (input != stdin) {
+        fclose(input);
+    }
+    return failures == 0;
+}
+
+static volatile int serve_stop = 0;
+
+static void stop_serving(int signal_number) {
+    (void)signal_number;
+    serve_stop = 1;
+}
+
+static bool cmd_serve(int argc, char **argv) {
+    if (argc < 1) {
+        fprintf(stderr, "Error: Filename required\n");
+        return false;
+    }
+
+    blf_serve_options_t options = { NULL, true, &serve_stop, 0 };
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+            options.socket_path = argv[++i];
+        } else if (strcmp(argv[i], "--no-sync") == 0) {
+            options.sync = false;
+        } else {
+            fprintf(stderr, "Error: Unknown option '%s'\n", argv[i]);
+            return false;
+        }
+    }
+    if (!options.socket_path) {
+        fprintf(stderr, "Error: --socket <path> required\n");
+        return false;
+    }
+
+    blf_file_t *file = blf_open(argv[0]);
+    if (!file) {
+        fprintf(stderr, "Error: Could not open file '%s'\n", argv[0]);
+        return false;
+    }
+
+    signal(SIGINT, stop_serving);
+    signal(SIGTERM, stop_serving);
+    printf("Serving %s on %s\n", argv[0], options.socket_path);
+    fflush(stdout);
+    bool success = blf_serve(file, &options);
+    if (!success) {
+        fprintf(stderr, "Error: Could not serve on '%s'\n", options.socket_path);
+    }
+    blf_close(file);
+    return success;
+}
+
 int main(int argc, char **argv) {
     // Check arguments
     if (argc < 2) {
@@ -374,6 +820,18 @@ int main(int argc, char **argv) {
         success = cmd_read_raw(argc, argv);
     } else if (strcmp(command, "list") == 0) {
         success = cmd_list(argc, argv);
+    } else if (strcmp(command, "compact") == 0) {
+        success = cmd_compact(argc, argv);
+    } else if (strcmp(command, "merge") == 0) {
+        success = cmd_merge(argc, argv);
+    } else if (strcmp(command, "diff") == 0) {
+        success = cmd_diff(argc, argv);
+    } else if (strcmp(command, "clone") == 0) {
+        success = cmd_clone(argc, argv);
+    } else if (strcmp(command, "batch") == 0) {
+        success = cmd_batch(argc, argv);
+    } else if (strcmp(command, "serve") == 0) {
+        success = cmd_serve(argc, argv);
     } else if (strcmp(command, "help") == 0) {
         print_usage();
         success = true;
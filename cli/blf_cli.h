@@ -4,6 +4,9 @@
 // Maximum size for values when reading
 #define MAX_VALUE_SIZE 1024 * 1024  // 1MB
 
+// Chunk size for streaming raw data
+#define RAW_CHUNK_SIZE (1024 * 1024)  // 1MB
+
 // Command functions
 static void print_usage(void);
 static bool cmd_create(int argc, char **argv);
@@ -14,5 +17,11 @@ static bool cmd_delete(int argc, char **argv);
 static bool cmd_write_raw(int argc, char **argv);
 static bool cmd_read_raw(int argc, char **argv);
 static bool cmd_list(int argc, char **argv);
+static bool cmd_compact(int argc, char **argv);
+static bool cmd_merge(int argc, char **argv);
+static bool cmd_diff(int argc, char **argv);
+static bool cmd_clone(int argc, char **argv);
+static bool cmd_batch(int argc, char **argv);
+static bool cmd_serve(int argc, char **argv);
 
 #endif // BLF_CLI_H
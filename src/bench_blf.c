@@ -0,0 +1,690 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "blf.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_FILE "/tmp/bench.blf"
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Key-at-a-time scan of the KV section, as lookups worked before the
+// fingerprint index
+static bool legacy_find(blf_file_t *file, const char *key, uint32_t *value_len) {
+    if (fseek(file->fp, file->header.kv_offset, SEEK_SET) != 0) {
+        return false;
+    }
+
+    uint64_t current_offset = file->header.kv_offset;
+    uint64_t end_offset = file->header.kv_offset + file->header.kv_size;
+
+    while (current_offset < end_offset) {
+        blf_kv_entry_t entry;
+        if (fread(&entry, sizeof(blf_kv_entry_t), 1, file->fp) != 1) {
+            return false;
+        }
+
+        char *current_key = (char*)malloc(entry.key_length + 1);
+        if (!current_key || fread(current_key, 1, entry.key_length, file->fp) != entry.key_length) {
+            free(current_key);
+            return false;
+        }
+        current_key[entry.key_length] = '\0';
+
+        bool match = (strcmp(current_key, key) == 0);
+        free(current_key);
+        if (match) {
+            *value_len = entry.value_length;
+            return true;
+        }
+
+        if (fseek(file->fp, entry.value_length, SEEK_CUR) != 0) {
+            return false;
+        }
+        current_offset += sizeof(blf_kv_entry_t) + entry.key_length + entry.value_length;
+    }
+
+    return false;
+}
+
+static void bench_lookup(int num_keys, int num_lookups) {
+    blf_file_t *file = blf_create(BENCH_FILE);
+    if (!file) {
+        fprintf(stderr, "Could not create %s\n", BENCH_FILE);
+        exit(EXIT_FAILURE);
+    }
+
+    char key[32];
+    char value[64];
+    for (int i = 0; i < num_keys; i++) {
+        snprintf(key, sizeof(key), "metric.%08d", i);
+        snprintf(value, sizeof(value), "value-%d", i);
+        blf_put_kv(file, key, value, strlen(value));
+    }
+    blf_close(file);
+
+    file = blf_open(BENCH_FILE);
+    srand(42);
+
+    double start = now_seconds();
+    int found = 0;
+    for (int i = 0; i < num_lookups; i++) {
+        snprintf(key, sizeof(key), "metric.%08d", rand() % num_keys);
+        uint32_t len;
+        found += legacy_find(file, key, &len);
+    }
+    double legacy = now_seconds() - start;
+
+    // The index was persisted on close; the first lookup maps it
+    start = now_seconds();
+    for (int i = 0; i < num_lookups; i++) {
+        snprintf(key, sizeof(key), "metric.%08d", rand() % num_keys);
+        uint32_t len = sizeof(value);
+        found += blf_get_kv(file, key, value, &len);
+    }
+    double fingerprint = now_seconds() - start;
+
+    printf("%8d keys, %6d lookups: key scan %9.2f us/op, fingerprint index %7.2f us/op (%.1fx), %d hits\n",
+           num_keys, num_lookups,
+           legacy * 1e6 / num_lookups, fingerprint * 1e6 / num_lookups,
+           legacy / fingerprint, found);
+
+    blf_close(file);
+    remove(BENCH_FILE);
+}
+
+// Repeated lookups of a small hot key set, with and without the value cache
+static void bench_cache(int num_keys, int hot_keys, int num_lookups) {
+    blf_file_t *file = blf_create(BENCH_FILE);
+    if (!file) {
+        fprintf(stderr, "Could not create %s\n", BENCH_FILE);
+        exit(EXIT_FAILURE);
+    }
+
+    char key[32];
+    char value[64];
+    for (int i = 0; i < num_keys; i++) {
+        snprintf(key, sizeof(key), "config.%08d", i);
+        snprintf(value, sizeof(value), "setting-%d", i);
+        blf_put_kv(file, key, value, strlen(value));
+    }
+
+    double elapsed[2];
+    for (int cached = 0; cached < 2; cached++) {
+        if (cached) {
+            blf_cache_enable(file, 1024 * 1024);
+        }
+        srand(7);
+
+        double start = now_seconds();
+        for (int i = 0; i < num_lookups; i++) {
+            snprintf(key, sizeof(key), "config.%08d", rand() % hot_keys);
+            uint32_t len = sizeof(value);
+            blf_get_kv(file, key, value, &len);
+        }
+        elapsed[cached] = now_seconds() - start;
+    }
+
+    blf_cache_stats_t stats;
+    blf_cache_stats(file, &stats);
+    printf("%8d keys, %4d hot: uncached %6.2f us/op, cached %6.3f us/op (%.1fx), %lu hits, %lu misses\n",
+           num_keys, hot_keys,
+           elapsed[0] * 1e6 / num_lookups, elapsed[1] * 1e6 / num_lookups,
+           elapsed[0] / elapsed[1], stats.hits, stats.misses);
+
+    blf_close(file);
+    remove(BENCH_FILE);
+}
+
+// Counter updates: get, parse and put versus an in-place typed increment
+static void bench_counter(int num_keys, int num_updates) {
+    blf_file_t *file = blf_create(BENCH_FILE);
+    if (!file) {
+        fprintf(stderr, "Could not create %s\n", BENCH_FILE);
+        exit(EXIT_FAILURE);
+    }
+
+    char key[32];
+    for (int i = 0; i < num_keys; i++) {
+        snprintf(key, sizeof(key), "counter.%08d", i);
+        blf_put_kv(file, key, "0", 1);
+    }
+    blf_put_kv(file, "hits.text", "0000000000", 10);
+    blf_put_u64(file, "hits.u64", 0);
+
+    double start = now_seconds();
+    for (int i = 0; i < num_updates; i++) {
+        char value[16];
+        uint32_t len = sizeof(value) - 1;
+        blf_get_kv(file, "hits.text", value, &len);
+        value[len] = '\0';
+        snprintf(value, sizeof(value), "%010lu", strtoul(value, NULL, 10) + 1);
+        blf_put_kv(file, "hits.text", value, 10);
+    }
+    double text = now_seconds() - start;
+
+    start = now_seconds();
+    for (int i = 0; i < num_updates; i++) {
+        blf_incr_u64(file, "hits.u64", 1, NULL);
+    }
+    double typed = now_seconds() - start;
+
+    printf("%8d keys: get+parse+put %6.2f us/op, blf_incr_u64 %6.2f us/op (%.1fx)\n",
+           num_keys, text * 1e6 / num_updates, typed * 1e6 / num_updates, text / typed);
+
+    blf_close(file);
+    remove(BENCH_FILE);
+}
+
+// Updates that change a value's length, reusing free space, versus the full
+// rewrite such an update used to cost (timed with blf_compact)
+static void bench_resize(int num_keys, int num_updates) {
+    blf_file_t *file = blf_create(BENCH_FILE);
+    if (!file) {
+        fprintf(stderr, "Could not create %s\n", BENCH_FILE);
+        exit(EXIT_FAILURE);
+    }
+
+    char key[32];
+    char value[128];
+    memset(value, 'v', sizeof(value));
+    for (int i = 0; i < num_keys; i++) {
+        snprintf(key, sizeof(key), "key.%08d", i);
+        blf_put_kv(file, key, value, 64);
+    }
+    uint64_t initial = file->header.kv_size;
+
+    double start = now_seconds();
+    for (int i = 0; i < num_updates; i++) {
+        snprintf(key, sizeof(key), "key.%08d", (int)((i * 7919L) % num_keys));
+        blf_put_kv(file, key, value, 32 + (i * 13) % 96);
+    }
+    double reuse = now_seconds() - start;
+
+    blf_free_stats_t stats;
+    blf_free_stats(file, &stats);
+
+    int rewrites = num_updates < 20 ? num_updates : 20;
+    start = now_seconds();
+    for (int i = 0; i < rewrites; i++) {
+        blf_compact(file);
+    }
+    double rewrite = now_seconds() - start;
+
+    printf("%8d keys: resize update %6.2f us/op, rewrite %9.2f us/op (%.0fx); "
+           "KV section %.2fx, %.0f%% free\n",
+           num_keys, reuse * 1e6 / num_updates, rewrite * 1e6 / rewrites,
+           (rewrite / rewrites) / (reuse / num_updates),
+           (double)stats.kv_size / initial, stats.free_bytes * 100.0 / stats.kv_size);
+
+    blf_close(file);
+    remove(BENCH_FILE);
+}
+
+// Small in-place updates and appends through positioned I/O versus the
+// read-write mapping
+static void bench_mapped(int num_keys, int num_updates) {
+    double elapsed[2][2];
+
+    for (int mapped = 0; mapped < 2; mapped++) {
+        blf_file_t *file = blf_create(BENCH_FILE);
+        if (!file) {
+            fprintf(stderr, "Could not create %s\n", BENCH_FILE);
+            exit(EXIT_FAILURE);
+        }
+        if (mapped) {
+            blf_map(file, 0);
+        }
+
+        char key[32];
+        char value[32];
+        double start = now_seconds();
+        for (int i = 0; i < num_keys; i++) {
+            snprintf(key, sizeof(key), "row.%08d", i);
+            snprintf(value, sizeof(value), "%016d", i);
+            blf_put_kv(file, key, value, 16);
+        }
+        elapsed[mapped][0] = now_seconds() - start;
+
+        srand(3);
+        start = now_seconds();
+        for (int i = 0; i < num_updates; i++) {
+            snprintf(key, sizeof(key), "row.%08d", rand() % num_keys);
+            snprintf(value, sizeof(value), "%016d", i);
+            blf_put_kv(file, key, value, 16);
+        }
+        blf_commit(file);
+        elapsed[mapped][1] = now_seconds() - start;
+
+        blf_close(file);
+        remove(BENCH_FILE);
+    }
+
+    printf("%8d appends: pwrite %6.2f us/op, mapped %6.2f us/op (%.1fx)\n", num_keys,
+           elapsed[0][0] * 1e6 / num_keys, elapsed[1][0] * 1e6 / num_keys, elapsed[0][0] / elapsed[1][0]);
+    printf("%8d updates: pwrite %6.2f us/op, mapped %6.2f us/op (%.1fx)\n", num_updates,
+           elapsed[0][1] * 1e6 / num_updates, elapsed[1][1] * 1e6 / num_updates, elapsed[0][1] / elapsed[1][1]);
+}
+
+// Open plus first lookup with the persisted index versus rebuilding the
+// index from the KV section
+static void bench_open(int num_keys) {
+    blf_file_t *file = blf_create(BENCH_FILE);
+    if (!file) {
+        fprintf(stderr, "Could not create %s\n", BENCH_FILE);
+        exit(EXIT_FAILURE);
+    }
+
+    char key[32];
+    char value[64];
+    blf_map(file, 0);
+    for (int i = 0; i < num_keys; i++) {
+        snprintf(key, sizeof(key), "object.%010d", i);
+        snprintf(value, sizeof(value), "metadata-%d", i);
+        blf_put_kv(file, key, value, strlen(value));
+    }
+    blf_close(file);
+
+    double elapsed[2];
+    for (int rebuild = 0; rebuild < 2; rebuild++) {
+        double start = now_seconds();
+        file = blf_open(BENCH_FILE);
+        if (rebuild) {
+            // Pretend the persisted index is stale
+            file->header.index_offset = 0;
+        }
+        snprintf(key, sizeof(key), "object.%010d", num_keys / 2);
+        uint32_t len = sizeof(value);
+        blf_get_kv(file, key, value, &len);
+        elapsed[rebuild] = now_seconds() - start;
+        blf_close(file);
+    }
+
+    printf("%8d keys: open+get with index %8.1f us, rebuilding the index %8.1f us (%.0fx)\n",
+           num_keys, elapsed[0] * 1e6, elapsed[1] * 1e6, elapsed[1] / elapsed[0]);
+    remove(BENCH_FILE);
+}
+
+// A 64 KB window out of a large raw section: whole-section read versus a
+// ranged read
+static void bench_raw_window(uint64_t raw_size, int num_reads) {
+    blf_file_t *file = blf_create(BENCH_FILE);
+    if (!file) {
+        fprintf(stderr, "Could not create %s\n", BENCH_FILE);
+        exit(EXIT_FAILURE);
+    }
+
+    char *raw = (char*)malloc(raw_size);
+    memset(raw, 'r', raw_size);
+    blf_write_raw(file, raw, raw_size);
+
+    char window[65536];
+    srand(11);
+    double start = now_seconds();
+    for (int i = 0; i < num_reads; i++) {
+        uint64_t size = raw_size;
+        blf_read_raw(file, raw, &size);
+        uint64_t offset = (uint64_t)rand() % (raw_size - sizeof(window));
+        memcpy(window, raw + offset, sizeof(window));
+    }
+    double whole = now_seconds() - start;
+
+    blf_raw_advise(file, 0, 0, BLF_ADVICE_RANDOM);
+    start = now_seconds();
+    for (int i = 0; i < num_reads; i++) {
+        uint64_t size = sizeof(window);
+        blf_read_raw_at(file, (uint64_t)rand() % (raw_size - sizeof(window)), window, &size);
+    }
+    double ranged = now_seconds() - start;
+
+    printf("%5lu MB raw, 64 KB windows: whole section %8.1f us/op, ranged %6.1f us/op (%.0fx)\n",
+           raw_size >> 20, whole * 1e6 / num_reads, ranged * 1e6 / num_reads, whole / ranged);
+
+    free(raw);
+    blf_close(file);
+    remove(BENCH_FILE);
+}
+
+// Changing 4 KB pages of a large raw section: full replacement versus patches
+static void bench_raw_patch(uint64_t raw_size, int num_updates) {
+    blf_file_t *file = blf_create(BENCH_FILE);
+    if (!file) {
+        fprintf(stderr, "Could not create %s\n", BENCH_FILE);
+        exit(EXIT_FAILURE);
+    }
+
+    char *raw = (char*)malloc(raw_size);
+    memset(raw, 'r', raw_size);
+    blf_write_raw(file, raw, raw_size);
+
+    char page[4096];
+    memset(page, 'p', sizeof(page));
+    srand(13);
+    double start = now_seconds();
+    for (int i = 0; i < num_updates; i++) {
+        memcpy(raw + (uint64_t)rand() % (raw_size - sizeof(page)), page, sizeof(page));
+        blf_write_raw(file, raw, raw_size);
+    }
+    double whole = now_seconds() - start;
+
+    start = now_seconds();
+    for (int i = 0; i < num_updates; i++) {
+        blf_write_raw_at(file, (uint64_t)rand() % (raw_size - sizeof(page)), page, sizeof(page));
+    }
+    double patched = now_seconds() - start;
+
+    printf("%5lu MB raw, 4 KB updates: whole section %8.1f us/op, patch %6.1f us/op (%.0fx)\n",
+           raw_size >> 20, whole * 1e6 / num_updates, patched * 1e6 / num_updates, whole / patched);
+
+    free(raw);
+    blf_close(file);
+    remove(BENCH_FILE);
+}
+
+// Writing and reading back a large raw section, buffered versus O_DIRECT
+static void bench_direct(uint64_t raw_size) {
+    char *raw = (char*)malloc(raw_size + 1);
+    char *check = (char*)malloc(raw_size);
+    memset(raw, 'd', raw_size + 1);
+
+    for (int direct = 0; direct < 2; direct++) {
+        blf_file_t *file = blf_create(BENCH_FILE);
+        if (!file) {
+            fprintf(stderr, "Could not create %s\n", BENCH_FILE);
+            exit(EXIT_FAILURE);
+        }
+        if (direct && !blf_direct_enable(file, 0)) {
+            printf("%5lu MB raw: O_DIRECT not supported by the file system\n", raw_size >> 20);
+            blf_close(file);
+            break;
+        }
+
+        // Offset by one byte so that direct I/O goes through the bounce buffers
+        double start = now_seconds();
+        blf_write_raw(file, raw + 1, raw_size);
+        blf_commit(file);
+        double write = now_seconds() - start;
+
+        uint64_t size = raw_size;
+        start = now_seconds();
+        blf_read_raw(file, check, &size);
+        double read = now_seconds() - start;
+
+        printf("%5lu MB raw, %-8s: write+sync %7.1f MB/s, read %7.1f MB/s\n", raw_size >> 20,
+               direct ? "O_DIRECT" : "buffered", (raw_size >> 20) / write, (raw_size >> 20) / read);
+
+        blf_close(file);
+        remove(BENCH_FILE);
+    }
+
+    free(check);
+    free(raw);
+}
+
+// Batches of keys: one blf_get_kv per key versus blf_get_many
+static void bench_get_many(int num_keys, int batch, int num_batches) {
+    blf_file_t *file = blf_create(BENCH_FILE);
+    if (!file) {
+        fprintf(stderr, "Could not create %s\n", BENCH_FILE);
+        exit(EXIT_FAILURE);
+    }
+
+    char key[32];
+    char value[64];
+    for (int i = 0; i < num_keys; i++) {
+        snprintf(key, sizeof(key), "metric.%08d", i);
+        snprintf(value, sizeof(value), "value-%d", i);
+        blf_put_kv(file, key, value, strlen(value));
+    }
+    blf_close(file);
+
+    char **keys = (char**)malloc(batch * sizeof(char*));
+    for (int i = 0; i < batch; i++) {
+        keys[i] = (char*)malloc(32);
+    }
+    blf_get_result_t *results = (blf_get_result_t*)malloc(batch * sizeof(blf_get_result_t));
+    char *arena = (char*)malloc(batch * sizeof(value));
+
+    file = blf_open(BENCH_FILE);
+    srand(17);
+    double single = 0;
+    double many = 0;
+    int found = 0;
+    for (int b = 0; b < num_batches; b++) {
+        for (int i = 0; i < batch; i++) {
+            snprintf(keys[i], 32, "metric.%08d", rand() % num_keys);
+        }
+
+        double start = now_seconds();
+        for (int i = 0; i < batch; i++) {
+            uint32_t len = sizeof(value);
+            found += blf_get_kv(file, keys[i], value, &len);
+        }
+        single += now_seconds() - start;
+
+        start = now_seconds();
+        uint64_t arena_size = batch * sizeof(value);
+        blf_get_many(file, (const char *const *)keys, batch, results, arena, &arena_size);
+        many += now_seconds() - start;
+    }
+
+    printf("%8d keys, batches of %4d: blf_get_kv %8.1f us/batch, blf_get_many %8.1f us/batch (%.1fx), %d hits\n",
+           num_keys, batch, single * 1e6 / num_batches, many * 1e6 / num_batches, single / many, found);
+
+    blf_close(file);
+    for (int i = 0; i < batch; i++) {
+        free(keys[i]);
+    }
+    free(keys);
+    free(results);
+    free(arena);
+    remove(BENCH_FILE);
+}
+
+// Combining per-worker files: one put per key versus blf_merge
+static void bench_merge(int num_inputs, int keys_per_input) {
+    char paths[8][64];
+    const char *inputs[8];
+    char key[32];
+    char value[128];
+    memset(value, 'v', sizeof(value));
+
+    for (int f = 0; f < num_inputs; f++) {
+        snprintf(paths[f], sizeof(paths[f]), "/tmp/bench_merge_%d.blf", f);
+        inputs[f] = paths[f];
+        blf_file_t *file = blf_create(paths[f]);
+        if (!file) {
+            fprintf(stderr, "Could not create %s\n", paths[f]);
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < keys_per_input; i++) {
+            // Half of the keys are shared between the workers
+            snprintf(key, sizeof(key), i % 2 ? "w%d.%08d" : "shared.%08d", i % 2 ? f : i, i);
+            blf_put_kv(file, key, value, 100);
+        }
+        blf_close(file);
+    }
+
+    // One put per key; the inputs are read in file order
+    double start = now_seconds();
+    blf_file_t *out = blf_create(BENCH_FILE);
+    for (int f = 0; f < num_inputs; f++) {
+        blf_file_t *file = blf_open(inputs[f]);
+        for (int i = 0; i < keys_per_input; i++) {
+            snprintf(key, sizeof(key), i % 2 ? "w%d.%08d" : "shared.%08d", i % 2 ? f : i, i);
+            uint32_t len = sizeof(value);
+            if (blf_get_kv(file, key, value, &len)) {
+                blf_put_kv(out, key, value, len);
+            }
+        }
+        blf_close(file);
+    }
+    blf_close(out);
+    double puts = now_seconds() - start;
+
+    start = now_seconds();
+    blf_merge(BENCH_FILE, inputs, num_inputs, NULL, NULL);
+    double merged = now_seconds() - start;
+
+    printf("%d inputs x %d keys: put per key %7.1f ms, blf_merge %6.1f ms (%.0fx)\n",
+           num_inputs, keys_per_input, puts * 1e3, merged * 1e3, puts / merged);
+
+    for (int f = 0; f < num_inputs; f++) {
+        remove(paths[f]);
+    }
+    remove(BENCH_FILE);
+}
+
+// Store two near-identical payloads: whole raw copies vs deduplicated chunks
+static void bench_dedup(uint64_t size) {
+    char *data = (char*)malloc(size + 16);
+    if (!data) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    uint64_t x = 0x2545f4914f6cdd1dULL;
+    for (uint64_t i = 0; i < size; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        data[i] = (char)x;
+    }
+
+    blf_file_t *file = blf_create(BENCH_FILE);
+    if (!file) {
+        fprintf(stderr, "Could not create %s\n", BENCH_FILE);
+        exit(EXIT_FAILURE);
+    }
+    double start = now_seconds();
+    blf_write_raw(file, data, size);
+    double raw_first = now_seconds() - start;
+    // A second version with a 16-byte insertion in the middle
+    memmove(data + size / 2 + 16, data + size / 2, size / 2);
+    memcpy(data + size / 2, "inserted-16bytes", 16);
+    start = now_seconds();
+    blf_write_raw(file, data, size + 16);
+    double raw_second = now_seconds() - start;
+    blf_close(file);
+    remove(BENCH_FILE);
+
+    memmove(data + size / 2, data + size / 2 + 16, size / 2);
+    file = blf_create(BENCH_FILE);
+    blf_dedup_stats_t first;
+    blf_dedup_stats_t second;
+    start = now_seconds();
+    blf_dedup_write(file, "v1", data, size, &first);
+    double dedup_first = now_seconds() - start;
+    memmove(data + size / 2 + 16, data + size / 2, size / 2);
+    memcpy(data + size / 2, "inserted-16bytes", 16);
+    start = now_seconds();
+    blf_dedup_write(file, "v2", data, size + 16, &second);
+    double dedup_second = now_seconds() - start;
+
+    uint64_t read_size = size + 16;
+    start = now_seconds();
+    blf_dedup_read(file, "v2", data, &read_size);
+    double dedup_read = now_seconds() - start;
+
+    printf("%6llu MB dedup: first %.0f ms (raw %.0f ms), second %.0f ms writing %.1f KB in %llu chunks "
+           "(raw %.0f ms writing %llu MB), read %.0f ms\n",
+           (unsigned long long)(size >> 20), dedup_first * 1e3, raw_first * 1e3,
+           dedup_second * 1e3, second.new_bytes / 1024.0, (unsigned long long)second.new_chunks,
+           raw_second * 1e3, (unsigned long long)(size >> 20), dedup_read * 1e3);
+
+    blf_close(file);
+    remove(BENCH_FILE);
+    free(data);
+}
+
+// Copy through a 4 KB buffer, as the rewrite path did before copying
+// between descriptors; synced like blf_clone
+static bool legacy_copy(const char *src, const char *dst) {
+    FILE *in = fopen(src, "rb");
+    FILE *out = fopen(dst, "wb");
+    bool ok = in && out;
+    char buffer[4096];
+    size_t n;
+    while (ok && (n = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+        ok = fwrite(buffer, 1, n, out) == n;
+    }
+    ok = ok && fflush(out) == 0 && fdatasync(fileno(out)) == 0;
+    if (in) fclose(in);
+    if (out && fclose(out) != 0) ok = false;
+    return ok;
+}
+
+// Snapshot and compact a file whose raw section dominates its size
+static void bench_clone(uint64_t raw_size, int num_keys) {
+    const char *copy = "/tmp/bench_clone.blf";
+    blf_file_t *file = blf_create(BENCH_FILE);
+    char *raw = (char*)malloc(raw_size);
+    if (!file || !raw) {
+        fprintf(stderr, "Could not create %s\n", BENCH_FILE);
+        exit(EXIT_FAILURE);
+    }
+    memset(raw, 'r', raw_size);
+    char key[32];
+    char value[64];
+    memset(value, 'v', sizeof(value));
+    for (int i = 0; i < num_keys; i++) {
+        snprintf(key, sizeof(key), "key.%08d", i);
+        blf_put_kv(file, key, value, sizeof(value));
+    }
+    blf_write_raw(file, raw, raw_size);
+    free(raw);
+    blf_close(file);
+
+    double start = now_seconds();
+    legacy_copy(BENCH_FILE, copy);
+    double legacy = now_seconds() - start;
+
+    start = now_seconds();
+    blf_clone(BENCH_FILE, copy);
+    double clone = now_seconds() - start;
+
+    file = blf_open(BENCH_FILE);
+    for (int i = 0; i < num_keys; i += 2) {
+        snprintf(key, sizeof(key), "key.%08d", i);
+        blf_delete_kv(file, key);
+    }
+    start = now_seconds();
+    blf_compact(file);
+    double compact = now_seconds() - start;
+    blf_close(file);
+
+    printf("%6llu MB raw: 4 KB buffer copy %.0f ms, blf_clone %.0f ms, "
+           "compact %.0f ms\n",
+           (unsigned long long)(raw_size >> 20), legacy * 1e3, clone * 1e3, compact * 1e3);
+
+    remove(copy);
+    remove(BENCH_FILE);
+}
+
+int main() {
+    printf("BLF microbenchmarks\n");
+    bench_lookup(1000, 2000);
+    bench_lookup(10000, 500);
+    bench_lookup(100000, 50);
+    bench_cache(100000, 300, 200000);
+    bench_counter(10000, 100000);
+    bench_resize(10000, 20000);
+    bench_resize(100000, 20000);
+    bench_mapped(20000, 100000);
+    bench_open(500000);
+    bench_raw_window(64 << 20, 20);
+    bench_raw_patch(64 << 20, 20);
+    bench_direct(256 << 20);
+    bench_get_many(100000, 50, 200);
+    bench_get_many(100000, 500, 200);
+    bench_merge(4, 100000);
+    bench_dedup(64 << 20);
+    bench_clone(256 << 20, 10000);
+    return 0;
+}
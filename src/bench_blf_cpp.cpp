@@ -0,0 +1,180 @@
+#include "blf.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#define BENCH_FILE "/tmp/bench_cpp.blf"
+
+static double now_seconds() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Keep results observable so lookups are not optimized away
+static volatile uint64_t sink;
+
+static void keep(uint64_t value) {
+    sink = sink + value;
+}
+
+// Hand-written wrapper as services had it: NUL-terminate the key, probe the
+// value size, then read into a buffer of that size
+static bool wrapper_get(blf_file_t *file, std::string_view key, std::string &value) {
+    std::string terminated(key);
+    uint32_t length = 0;
+    char probe;
+    if (!blf_get_kv(file, terminated.c_str(), &probe, &length) && length == 0) {
+        return false;
+    }
+    value.resize(length);
+    return blf_get_kv(file, terminated.c_str(), &value[0], &length);
+}
+
+static bool count_entry(void *user, const char *, uint32_t key_length, const void *, uint32_t value_length) {
+    *static_cast<uint64_t*>(user) += key_length + value_length;
+    return true;
+}
+
+// Lookups of keys that arrive as views into a request buffer
+static void bench_lookups(int num_keys, int rounds) {
+    blf::File file = blf::File::create(BENCH_FILE);
+    if (!file) {
+        fprintf(stderr, "Could not create %s\n", BENCH_FILE);
+        exit(EXIT_FAILURE);
+    }
+
+    std::string request;
+    std::vector<std::string_view> keys;
+    std::vector<std::string> terminated;
+    std::string value(100, 'v');
+    char key[32];
+    for (int i = 0; i < num_keys; i++) {
+        int length = snprintf(key, sizeof(key), "service.key.%08d", i);
+        request.append(key, length);
+        terminated.emplace_back(key, length);
+        file.put(terminated.back(), value);
+    }
+    for (size_t i = 0, pos = 0; i < terminated.size(); pos += terminated[i].size(), i++) {
+        keys.emplace_back(request.data() + pos, terminated[i].size());
+    }
+    long lookups = (long)num_keys * rounds;
+
+    // C API with keys that already are NUL-terminated: the baseline
+    char buffer[256];
+    double start = now_seconds();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < num_keys; i++) {
+            uint32_t length = sizeof(buffer);
+            blf_get_kv(file.handle(), terminated[i].c_str(), buffer, &length);
+            keep(length);
+        }
+    }
+    double c_api = now_seconds() - start;
+
+    start = now_seconds();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < num_keys; i++) {
+            uint32_t length = sizeof(buffer);
+            file.get(keys[i], buffer, length);
+            keep(length);
+        }
+    }
+    double cpp_buffer = now_seconds() - start;
+
+    std::string out;
+    start = now_seconds();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < num_keys; i++) {
+            file.get(keys[i], out);
+            keep(out.size());
+        }
+    }
+    double cpp_string = now_seconds() - start;
+
+    start = now_seconds();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < num_keys; i++) {
+            wrapper_get(file.handle(), keys[i], out);
+            keep(out.size());
+        }
+    }
+    double wrapper = now_seconds() - start;
+
+    file.map();
+    start = now_seconds();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < num_keys; i++) {
+            std::optional<blf::bytes_view> view = file.view(keys[i]);
+            keep(view ? view->size() : 0);
+        }
+    }
+    double cpp_view = now_seconds() - start;
+
+    start = now_seconds();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < num_keys; i++) {
+            uint32_t length = sizeof(buffer);
+            blf_get_kv(file.handle(), terminated[i].c_str(), buffer, &length);
+            keep(length);
+        }
+    }
+    double c_mapped = now_seconds() - start;
+
+    printf("%8d keys: C get %.3f us, blf::File get into buffer %.3f us, into string %.3f us, "
+           "hand-written wrapper %.3f us\n",
+           num_keys, c_api * 1e6 / lookups, cpp_buffer * 1e6 / lookups, cpp_string * 1e6 / lookups,
+           wrapper * 1e6 / lookups);
+    printf("%8d keys mapped: C get %.3f us, blf::File view %.3f us\n",
+           num_keys, c_mapped * 1e6 / lookups, cpp_view * 1e6 / lookups);
+
+    file.close();
+    remove(BENCH_FILE);
+}
+
+// Full pass over the KV entries: range-for against a blf_scan callback
+static void bench_iteration(int num_keys, int rounds) {
+    blf::File file = blf::File::create(BENCH_FILE);
+    std::string value(100, 'v');
+    char key[32];
+    for (int i = 0; i < num_keys; i++) {
+        snprintf(key, sizeof(key), "service.key.%08d", i);
+        file.put(key, value);
+    }
+
+    // Passes alternate between the two; the fastest of each counts
+    double c_scan = 1e9;
+    double cpp_iter = 1e9;
+    for (int r = 0; r < rounds; r++) {
+        double start = now_seconds();
+        uint64_t bytes = 0;
+        uint64_t cursor = 0;
+        blf_scan(file.handle(), &cursor, count_entry, &bytes);
+        keep(bytes);
+        double elapsed = now_seconds() - start;
+        c_scan = elapsed < c_scan ? elapsed : c_scan;
+
+        start = now_seconds();
+        bytes = 0;
+        for (const blf::Entry &entry : file) {
+            bytes += entry.key.size() + entry.value.size();
+        }
+        keep(bytes);
+        elapsed = now_seconds() - start;
+        cpp_iter = elapsed < cpp_iter ? elapsed : cpp_iter;
+    }
+
+    printf("%8d keys: blf_scan %.1f ns/entry, range-for %.1f ns/entry\n",
+           num_keys, c_scan * 1e9 / num_keys, cpp_iter * 1e9 / num_keys);
+
+    file.close();
+    remove(BENCH_FILE);
+}
+
+int main() {
+    printf("BLF C++ interface benchmarks\n");
+    bench_lookups(10000, 50);
+    bench_lookups(100000, 5);
+    bench_iteration(100000, 10);
+    return 0;
+}
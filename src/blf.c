@@ -1,9 +1,139 @@
-// Define _POSIX_C_SOURCE to make strdup available
-#define _POSIX_C_SOURCE 200809L
+// Define _GNU_SOURCE to make strdup, fallocate, mremap and copy_file_range
+// available
+#define _GNU_SOURCE
 
 #include "blf.h"
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// Free extents of one size class
+typedef struct {
+    blf_free_extent_t *extents;
+    size_t count;
+    size_t capacity;
+} free_list_t;
+
+#define BLF_FREE_CLASSES 40  // Class c holds extents of 2^c to 2^(c+1)-1 bytes
+#define BLF_FREE_PROBES 16   // Extents tried per class by an allocation
+#define BLF_FREE_RUN 256     // Extents per sorted run
+
+// Consecutive free extents in offset order, with the position of each in
+// its size class list
+typedef struct {
+    blf_free_extent_t extents[BLF_FREE_RUN];
+    size_t slots[BLF_FREE_RUN];
+    size_t count;
+} free_run_t;
+
+// Key index: an open-addressing hash table of BLF_INDEX_SLOTS-slot buckets,
+// probed linearly. The bucket array is also the persisted index format.
+// The free-space map of the KV section is kept and persisted with it: runs
+// sorted by offset, to find the neighbours of a released extent, and size
+// class lists, to find an extent that fits an allocation.
+struct blf_index {
+    blf_index_bucket_t *buckets;
+    uint64_t bucket_count;   // Power of two
+    uint64_t count;          // Live entries
+    uint64_t tombstones;     // Deleted slots
+    void *mapping;           // Private mapping holding the buckets, if loaded
+    size_t mapping_length;
+    free_list_t free_lists[BLF_FREE_CLASSES];
+    free_run_t **free_runs;  // All free extents, in offset order
+    size_t free_run_count;
+    size_t free_run_capacity;
+    uint64_t free_count;     // Free extents
+    uint64_t free_bytes;     // Bytes in free extents
+};
+
+#define BLF_INDEX_MIN_BUCKETS 16
+
+// Value cache: entries are spread over shards by key hash, each shard with
+// its own lock, hash chains and LRU list, and an equal share of the budget
+#define BLF_CACHE_SHARDS 16
+#define BLF_CACHE_BUCKETS 256  // Initial hash buckets per shard
+
+typedef struct blf_cache_entry {
+    struct blf_cache_entry *chain;  // Next entry in the hash bucket
+    struct blf_cache_entry *prev;   // LRU neighbour towards the head
+    struct blf_cache_entry *next;   // LRU neighbour towards the tail
+    uint64_t hash;
+    uint32_t key_length;
+    uint32_t value_length;
+    char data[];                    // Key bytes followed by value bytes
+} blf_cache_entry_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    blf_cache_entry_t **buckets;
+    size_t bucket_count;
+    blf_cache_entry_t *head;  // Most recently used
+    blf_cache_entry_t *tail;  // Least recently used
+    uint64_t bytes;
+    uint64_t budget;
+    uint64_t entries;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} blf_cache_shard_t;
+
+struct blf_cache {
+    pthread_mutex_t io_lock;  // Serializes access to the file itself
+    blf_cache_shard_t shards[BLF_CACHE_SHARDS];
+};
+
+// Location of a KV entry found in the file
+typedef struct {
+    uint64_t offset;        // Entry offset
+    uint64_t value_offset;  // Value offset
+    uint32_t flags;         // Flag bits of the key_length field
+    uint32_t key_length;
+    uint32_t value_length;
+    blf_kv_ext_t ext;       // Extended header; zeroed for plain entries
+} kv_loc_t;
+
+// Read-write mapping of the whole file. The file is preallocated in growth
+// steps beyond its data; dirty bytes are tracked for ranged msync.
+struct blf_map {
+    char *base;
+    uint64_t capacity;     // Mapped (and allocated) bytes
+    uint64_t growth;       // Growth step
+    uint64_t file_size;    // File size when mapped; close truncates no lower
+    uint64_t dirty_start;  // Dirty range not yet synced
+    uint64_t dirty_end;
+};
+
+// O_DIRECT descriptor for raw transfers and its pool of two aligned bounce
+// buffers, used alternately by the copy and the I/O of a transfer
+struct blf_direct {
+    int fd;
+    size_t buffer_size;
+    char *buffers[2];
+};
+
+// Typed values are 8-byte aligned so they can be updated in place
+#define BLF_TYPED_ALIGN_LOG2 3
+
+static void index_free(blf_file_t *file);
+static bool index_persist(blf_file_t *file);
+static bool index_invalidate(blf_file_t *file);
+static bool index_protect(blf_file_t *file, uint64_t end);
+static bool write_at(blf_file_t *file, uint64_t offset, const void *buf, size_t len);
 
 // Create a new BLF file
 blf_file_t* blf_create(const char *filename) {
@@ -18,8 +148,10 @@ blf_file_t* blf_create(const char *filename) {
         return NULL;
     }
 
-    // Initialize file header
+    // Initialize file header; the index fields stay zero until an index is
+    // persisted
     file->fp = fp;
+    memset(&file->header, 0, sizeof(blf_header_t));
     file->header.magic = BLF_MAGIC;
     file->header.version = BLF_VERSION;
     file->header.kv_offset = sizeof(blf_header_t);
@@ -29,6 +161,10 @@ blf_file_t* blf_create(const char *filename) {
     
     // Save filename
     file->filename = strdup(filename);
+    file->index = NULL;
+    file->cache = NULL;
+    file->map = NULL;
+    file->direct = NULL;
     
     // Write initial header
     if (!blf_update_header(file)) {
@@ -41,9 +177,9 @@ blf_file_t* blf_create(const char *filename) {
     return file;
 }
 
-// Open an existing BLF file
-blf_file_t* blf_open(const char *filename) {
-    FILE *fp = fopen(filename, "rb+");
+// Open an existing BLF file with an fopen mode
+static blf_file_t *open_file(const char *filename, const char *mode) {
+    FILE *fp = fopen(filename, mode);
     if (!fp) {
         return NULL;
     }
@@ -56,9 +192,14 @@ blf_file_t* blf_open(const char *filename) {
 
     file->fp = fp;
     file->filename = strdup(filename);
+    file->index = NULL;
+    file->cache = NULL;
+    file->map = NULL;
+    file->direct = NULL;
 
-    // Read file header
-    if (fread(&file->header, sizeof(blf_header_t), 1, fp) != 1) {
+    // Read file header; versions before 3 have the shorter version 1 header
+    memset(&file->header, 0, sizeof(blf_header_t));
+    if (fread(&file->header, BLF_HEADER_V1_SIZE, 1, fp) != 1) {
         fclose(fp);
         free(file->filename);
         free(file);
@@ -66,7 +207,16 @@ blf_file_t* blf_open(const char *filename) {
     }
 
     // Validate magic number and version
-    if (file->header.magic != BLF_MAGIC || file->header.version != BLF_VERSION) {
+    if (file->header.magic != BLF_MAGIC ||
+        file->header.version < BLF_VERSION_MIN || file->header.version > BLF_VERSION) {
+        fclose(fp);
+        free(file->filename);
+        free(file);
+        return NULL;
+    }
+
+    if (file->header.version >= BLF_VERSION_INDEX &&
+        fread((char*)&file->header + BLF_HEADER_V1_SIZE, sizeof(blf_header_t) - BLF_HEADER_V1_SIZE, 1, fp) != 1) {
         fclose(fp);
         free(file->filename);
         free(file);
@@ -76,36 +226,46 @@ blf_file_t* blf_open(const char *filename) {
     return file;
 }
 
-// Close BLF file
-void blf_close(blf_file_t *file) {
+// Open an existing BLF file for reading and writing
+blf_file_t* blf_open(const char *filename) {
+    return open_file(filename, "rb+");
+}
+
+// Close a handle, first persisting the key index if it is stale and persist
+// is set
+static void close_file(blf_file_t *file, bool persist) {
     if (file) {
+        if (file->fp && persist) {
+            index_persist(file);
+        }
+        blf_unmap(file);
         if (file->fp) {
             fclose(file->fp);
         }
         if (file->filename) {
             free(file->filename);
         }
+        index_free(file);
+        blf_cache_disable(file);
+        blf_direct_disable(file);
         free(file);
     }
 }
 
+// Close BLF file, persisting the key index if it is stale
+void blf_close(blf_file_t *file) {
+    close_file(file, true);
+}
+
 // Update file header
 bool blf_update_header(blf_file_t *file) {
     if (!file || !file->fp) {
         return false;
     }
 
-    // Seek to the beginning of the file
-    if (fseek(file->fp, 0, SEEK_SET) != 0) {
-        return false;
-    }
-
-    // Write header
-    if (fwrite(&file->header, sizeof(blf_header_t), 1, file->fp) != 1) {
-        return false;
-    }
-
-    return true;
+    // Write header at the beginning of the file
+    size_t size = file->header.version >= BLF_VERSION_INDEX ? sizeof(blf_header_t) : BLF_HEADER_V1_SIZE;
+    return write_at(file, 0, &file->header, size);
 }
 
 // Flush file changes to disk
@@ -116,414 +276,4169 @@ bool blf_flush(blf_file_t *file) {
     return fflush(file->fp) == 0;
 }
 
-// Helper function to find a key in the KV section
-static bool find_key(blf_file_t *file, const char *key, uint64_t *offset, uint32_t *key_len, uint32_t *value_len) {
-    if (!file || !file->fp || file->header.kv_size == 0) {
-        return false;
+// 64-bit FNV-1a hash of a key
+static uint64_t hash_key(const char *key, uint32_t key_length) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (uint32_t i = 0; i < key_length; i++) {
+        h ^= (unsigned char)key[i];
+        h *= 0x100000001b3ULL;
     }
+    return h;
+}
 
-    // Seek to the beginning of KV section
-    if (fseek(file->fp, file->header.kv_offset, SEEK_SET) != 0) {
-        return false;
-    }
+// Fingerprint of a key hash; the bucket is chosen by the low bits, so the
+// fingerprint comes from the high bits. 0 and 1 mark empty and deleted slots.
+static uint32_t hash_fingerprint(uint64_t h) {
+    uint32_t fp = (uint32_t)(h >> 32);
+    return fp < 2 ? fp + 2 : fp;
+}
 
-    uint64_t current_offset = file->header.kv_offset;
-    uint64_t end_offset = file->header.kv_offset + file->header.kv_size;
-    
-    while (current_offset < end_offset) {
-        blf_kv_entry_t entry;
-        
-        // Read entry header
-        if (fread(&entry, sizeof(blf_kv_entry_t), 1, file->fp) != 1) {
-            return false;
-        }
-        
-        current_offset += sizeof(blf_kv_entry_t);
-        
-        // Read key
-        char *current_key = (char*)malloc(entry.key_length + 1);
-        if (!current_key) {
-            return false;
-        }
-        
-        if (fread(current_key, 1, entry.key_length, file->fp) != entry.key_length) {
-            free(current_key);
-            return false;
-        }
-        current_key[entry.key_length] = '\0';
-        
-        current_offset += entry.key_length;
-        
-        // Compare keys
-        bool match = (strcmp(current_key, key) == 0);
-        free(current_key);
-        
-        if (match) {
-            // Found the key
-            if (offset) *offset = current_offset - entry.key_length - sizeof(blf_kv_entry_t);
-            if (key_len) *key_len = entry.key_length;
-            if (value_len) *value_len = entry.value_length;
-            return true;
-        }
-        
-        // Skip value
-        if (fseek(file->fp, entry.value_length, SEEK_CUR) != 0) {
-            return false;
-        }
-        
-        current_offset += entry.value_length;
-    }
-    
-    return false;
+// Fingerprint filters: return a bitmask of the slots of a bucket whose
+// fingerprint equals fp
+#if defined(__x86_64__) || defined(__i386__)
+static uint32_t fp_match_sse2(const uint32_t *fps, uint32_t fp) {
+    const __m128i needle = _mm_set1_epi32((int)fp);
+    __m128i a = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(fps)), needle);
+    __m128i b = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(fps + 4)), needle);
+    __m128i c = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(fps + 8)), needle);
+    __m128i d = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(fps + 12)), needle);
+    return (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(a))
+         | (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(b)) << 4
+         | (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(c)) << 8
+         | (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(d)) << 12;
 }
 
-// Store a key-value pair
-bool blf_put_kv(blf_file_t *file, const char *key, const void *value, uint32_t value_length) {
-    if (!file || !file->fp || !key || !value) {
-        return false;
+#if defined(__GNUC__)
+__attribute__((target("avx2")))
+static uint32_t fp_match_avx2(const uint32_t *fps, uint32_t fp) {
+    const __m256i needle = _mm256_set1_epi32((int)fp);
+    __m256i a = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*)(fps)), needle);
+    __m256i b = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*)(fps + 8)), needle);
+    return (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(a))
+         | (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(b)) << 8;
+}
+#endif
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+static uint32_t fp_match_neon(const uint32_t *fps, uint32_t fp) {
+    static const uint32_t lane_bits[4] = { 1, 2, 4, 8 };
+    const uint32x4_t needle = vdupq_n_u32(fp);
+    const uint32x4_t bits = vld1q_u32(lane_bits);
+    uint32_t mask = 0;
+    for (int i = 0; i < BLF_INDEX_SLOTS; i += 4) {
+        uint32x4_t eq = vceqq_u32(vld1q_u32(fps + i), needle);
+        mask |= vaddvq_u32(vandq_u32(eq, bits)) << i;
     }
-
-    uint32_t key_length = strlen(key);
-    uint64_t entry_offset;
-    uint32_t old_key_len, old_value_len;
-    
-    bool key_exists = find_key(file, key, &entry_offset, &old_key_len, &old_value_len);
-    
-    if (key_exists) {
-        // If the new value fits in the old space, just update it
-        if (value_length == old_value_len) {
-            // Seek to the value position
-            if (fseek(file->fp, entry_offset + sizeof(blf_kv_entry_t) + old_key_len, SEEK_SET) != 0) {
-                return false;
-            }
-            
-            // Write new value
-            if (fwrite(value, 1, value_length, file->fp) != value_length) {
-                return false;
-            }
-            
-            return blf_flush(file);
-        } else {
-            // Remove old entry and add new one
-            if (!blf_delete_kv(file, key)) {
-                return false;
-            }
-        }
+    return mask;
+}
+#else
+static uint32_t fp_match_scalar(const uint32_t *fps, uint32_t fp) {
+    uint32_t mask = 0;
+    for (int i = 0; i < BLF_INDEX_SLOTS; i++) {
+        mask |= (uint32_t)(fps[i] == fp) << i;
     }
-    
-    // Append new entry at the end of KV section
-    if (fseek(file->fp, file->header.kv_offset + file->header.kv_size, SEEK_SET) != 0) {
-        return false;
+    return mask;
+}
+#endif
+
+typedef uint32_t (*fp_match_fn)(const uint32_t *fps, uint32_t fp);
+
+// Pick the widest filter the CPU supports
+static fp_match_fn fp_match_select(void) {
+#if defined(__x86_64__) || defined(__i386__)
+#if defined(__GNUC__)
+    if (__builtin_cpu_supports("avx2")) {
+        return fp_match_avx2;
     }
-    
-    // Prepare entry header
-    blf_kv_entry_t entry;
-    entry.key_length = key_length;
-    entry.value_length = value_length;
-    
-    // Write entry header
-    if (fwrite(&entry, sizeof(blf_kv_entry_t), 1, file->fp) != 1) {
-        return false;
+#endif
+    return fp_match_sse2;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    return fp_match_neon;
+#else
+    return fp_match_scalar;
+#endif
+}
+
+static fp_match_fn fp_match_impl;
+static pthread_once_t fp_match_once = PTHREAD_ONCE_INIT;
+
+static void fp_match_init(void) {
+    fp_match_impl = fp_match_select();
+}
+
+static uint32_t fp_match(const uint32_t *fps, uint32_t fp) {
+    pthread_once(&fp_match_once, fp_match_init);
+    return fp_match_impl(fps, fp);
+}
+
+static void index_destroy(blf_index_t *index) {
+    if (index->mapping) {
+        munmap(index->mapping, index->mapping_length);
+    } else {
+        free(index->buckets);
     }
-    
-    // Write key
-    if (fwrite(key, 1, key_length, file->fp) != key_length) {
-        return false;
+    for (int c = 0; c < BLF_FREE_CLASSES; c++) {
+        free(index->free_lists[c].extents);
     }
-    
-    // Write value
-    if (fwrite(value, 1, value_length, file->fp) != value_length) {
-        return false;
+    for (size_t r = 0; r < index->free_run_count; r++) {
+        free(index->free_runs[r]);
     }
-    
-    // Update header
-    file->header.kv_size += sizeof(blf_kv_entry_t) + key_length + value_length;
-    file->header.raw_offset = file->header.kv_offset + file->header.kv_size;
-    
-    return blf_update_header(file) && blf_flush(file);
+    free(index->free_runs);
+    free(index);
 }
 
-// Get value for a key
-bool blf_get_kv(blf_file_t *file, const char *key, void *value, uint32_t *value_length) {
-    if (!file || !file->fp || !key || !value_length) {
-        return false;
+// Release the key index; it is loaded or rebuilt on the next lookup
+static void index_free(blf_file_t *file) {
+    if (file->index) {
+        index_destroy(file->index);
+        file->index = NULL;
     }
+}
 
-    uint64_t entry_offset;
-    uint32_t key_len, val_len;
-    
-    if (!find_key(file, key, &entry_offset, &key_len, &val_len)) {
-        return false;
+static blf_index_t *index_new(uint64_t bucket_count) {
+    blf_index_t *index = (blf_index_t*)calloc(1, sizeof(blf_index_t));
+    if (!index) {
+        return NULL;
     }
-    
-    // Check buffer size
-    if (*value_length < val_len) {
-        *value_length = val_len;
-        return false;
+    index->buckets = (blf_index_bucket_t*)calloc(bucket_count, sizeof(blf_index_bucket_t));
+    if (!index->buckets) {
+        free(index);
+        return NULL;
     }
-    
-    // Seek to value position
-    if (fseek(file->fp, entry_offset + sizeof(blf_kv_entry_t) + key_len, SEEK_SET) != 0) {
-        return false;
+    index->bucket_count = bucket_count;
+    return index;
+}
+
+// Place an entry in the first free slot of its probe sequence
+static void index_place(blf_index_t *index, uint64_t h, uint64_t offset) {
+    uint64_t mask = index->bucket_count - 1;
+    for (uint64_t b = h & mask;; b = (b + 1) & mask) {
+        blf_index_bucket_t *bucket = &index->buckets[b];
+        uint32_t free_slots = fp_match(bucket->fps, 0) | fp_match(bucket->fps, 1);
+        if (free_slots) {
+            int slot = __builtin_ctz(free_slots);
+            if (bucket->fps[slot] == 1) {
+                index->tombstones--;
+            }
+            bucket->fps[slot] = hash_fingerprint(h);
+            bucket->hash_lo[slot] = (uint32_t)h;
+            bucket->offsets[slot] = offset;
+            index->count++;
+            return;
+        }
     }
-    
-    // Read value
-    if (fread(value, 1, val_len, file->fp) != val_len) {
+}
+
+// Copy an index that lives in a private mapping of the file to the heap, so
+// that later writes to that region of the file cannot show through
+static bool index_detach(blf_index_t *index) {
+    if (!index->mapping) {
+        return true;
+    }
+
+    size_t size = index->bucket_count * sizeof(blf_index_bucket_t);
+    blf_index_bucket_t *buckets = (blf_index_bucket_t*)malloc(size);
+    if (!buckets) {
         return false;
     }
-    
-    *value_length = val_len;
+    memcpy(buckets, index->buckets, size);
+    munmap(index->mapping, index->mapping_length);
+
+    index->buckets = buckets;
+    index->mapping = NULL;
+    index->mapping_length = 0;
     return true;
 }
 
-// Delete a key-value pair
-bool blf_delete_kv(blf_file_t *file, const char *key) {
-    if (!file || !file->fp || !key) {
+// Rehash into a table of bucket_count buckets, dropping tombstones
+static bool index_resize(blf_index_t *index, uint64_t bucket_count) {
+    blf_index_t *resized = index_new(bucket_count);
+    if (!resized) {
         return false;
     }
 
-    // This is a simplified implementation that reconstructs the entire file
-    // A more efficient implementation would mark entries as deleted and compact periodically
-    
-    FILE *temp = tmpfile();
-    if (!temp) {
-        return false;
+    for (uint64_t b = 0; b < index->bucket_count; b++) {
+        const blf_index_bucket_t *bucket = &index->buckets[b];
+        for (int slot = 0; slot < BLF_INDEX_SLOTS; slot++) {
+            if (bucket->fps[slot] < 2) {
+                continue;
+            }
+            index_place(resized, ((uint64_t)bucket->fps[slot] << 32) | bucket->hash_lo[slot],
+                        bucket->offsets[slot]);
+        }
     }
-    
-    // Copy header to temporary file
-    blf_header_t new_header = file->header;
-    new_header.kv_size = 0;
-    
-    if (fwrite(&new_header, sizeof(blf_header_t), 1, temp) != 1) {
-        fclose(temp);
-        return false;
+
+    if (index->mapping) {
+        munmap(index->mapping, index->mapping_length);
+    } else {
+        free(index->buckets);
     }
-    
-    // Copy all KV entries except the one to delete
-    if (fseek(file->fp, file->header.kv_offset, SEEK_SET) != 0) {
-        fclose(temp);
+    index->buckets = resized->buckets;
+    index->bucket_count = resized->bucket_count;
+    index->tombstones = 0;
+    index->mapping = NULL;
+    index->mapping_length = 0;
+    free(resized);
+    return true;
+}
+
+// Add an entry, growing the table beyond 75% occupancy
+static bool index_insert(blf_index_t *index, uint64_t h, uint64_t offset) {
+    uint64_t capacity = index->bucket_count * BLF_INDEX_SLOTS;
+    if ((index->count + index->tombstones + 1) * 4 > capacity * 3) {
+        uint64_t bucket_count = index->bucket_count;
+        if ((index->count + 1) * 2 > capacity) {
+            bucket_count *= 2;
+        }
+        if (!index_resize(index, bucket_count)) {
+            return false;
+        }
+    }
+    if (!index_detach(index)) {
         return false;
     }
-    
-    uint64_t current_offset = file->header.kv_offset;
-    uint64_t end_offset = file->header.kv_offset + file->header.kv_size;
-    
-    while (current_offset < end_offset) {
-        blf_kv_entry_t entry;
-        
-        // Read entry header
-        if (fread(&entry, sizeof(blf_kv_entry_t), 1, file->fp) != 1) {
-            fclose(temp);
-            return false;
+
+    index_place(index, h, offset);
+    return true;
+}
+
+// Turn an entry's slot into a tombstone
+static void index_remove(blf_index_t *index, uint64_t h, uint64_t offset) {
+    uint64_t mask = index->bucket_count - 1;
+    uint32_t fp = hash_fingerprint(h);
+    for (uint64_t b = h & mask, probes = 0; probes <= mask; b = (b + 1) & mask, probes++) {
+        blf_index_bucket_t *bucket = &index->buckets[b];
+        uint32_t matches = fp_match(bucket->fps, fp);
+        while (matches) {
+            int slot = __builtin_ctz(matches);
+            matches &= matches - 1;
+            if (bucket->offsets[slot] == offset) {
+                bucket->fps[slot] = 1;
+                index->count--;
+                index->tombstones++;
+                return;
+            }
         }
-        
-        current_offset += sizeof(blf_kv_entry_t);
-        
-        // Read key
-        char *current_key = (char*)malloc(entry.key_length + 1);
-        if (!current_key) {
-            fclose(temp);
-            return false;
+        if (fp_match(bucket->fps, 0)) {
+            return;
         }
-        
-        if (fread(current_key, 1, entry.key_length, file->fp) != entry.key_length) {
-            free(current_key);
-            fclose(temp);
-            return false;
+    }
+}
+
+// Size class of a free extent
+static int free_class(uint64_t size) {
+    int c = 63 - __builtin_clzll(size);
+    return c < BLF_FREE_CLASSES ? c : BLF_FREE_CLASSES - 1;
+}
+
+// Locate the first free extent at or after offset: position p of run r.
+// r is the run count if there is none.
+static void free_search(const blf_index_t *index, uint64_t offset, size_t *r, size_t *p) {
+    size_t low = 0;
+    size_t high = index->free_run_count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        const free_run_t *run = index->free_runs[mid];
+        if (run->extents[run->count - 1].offset < offset) {
+            low = mid + 1;
+        } else {
+            high = mid;
         }
-        current_key[entry.key_length] = '\0';
-        
-        current_offset += entry.key_length;
-        
-        // Read value
-        void *current_value = malloc(entry.value_length);
-        if (!current_value) {
-            free(current_key);
-            fclose(temp);
-            return false;
+    }
+    *r = low;
+    *p = 0;
+    if (low == index->free_run_count) {
+        return;
+    }
+
+    const free_run_t *run = index->free_runs[low];
+    high = run->count - 1;
+    low = 0;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (run->extents[mid].offset < offset) {
+            low = mid + 1;
+        } else {
+            high = mid;
         }
-        
-        if (fread(current_value, 1, entry.value_length, file->fp) != entry.value_length) {
-            free(current_key);
-            free(current_value);
-            fclose(temp);
+    }
+    *p = low;
+}
+
+// Insert an empty run at position r
+static bool free_run_insert(blf_index_t *index, size_t r) {
+    if (index->free_run_count == index->free_run_capacity) {
+        size_t capacity = index->free_run_capacity ? index->free_run_capacity * 2 : 16;
+        free_run_t **runs = (free_run_t**)realloc(index->free_runs, capacity * sizeof(free_run_t*));
+        if (!runs) {
             return false;
         }
-        
-        current_offset += entry.value_length;
-        
-        // If not the key we want to delete, copy to temp file
-        if (strcmp(current_key, key) != 0) {
-            // Write entry header
-            if (fwrite(&entry, sizeof(blf_kv_entry_t), 1, temp) != 1) {
-                free(current_key);
-                free(current_value);
-                fclose(temp);
-                return false;
-            }
-            
-            // Write key
-            if (fwrite(current_key, 1, entry.key_length, temp) != entry.key_length) {
-                free(current_key);
-                free(current_value);
-                fclose(temp);
-                return false;
-            }
-            
-            // Write value
-            if (fwrite(current_value, 1, entry.value_length, temp) != entry.value_length) {
-                free(current_key);
-                free(current_value);
-                fclose(temp);
+        index->free_runs = runs;
+        index->free_run_capacity = capacity;
+    }
+    free_run_t *run = (free_run_t*)malloc(sizeof(free_run_t));
+    if (!run) {
+        return false;
+    }
+    run->count = 0;
+    memmove(index->free_runs + r + 1, index->free_runs + r, (index->free_run_count - r) * sizeof(free_run_t*));
+    index->free_runs[r] = run;
+    index->free_run_count++;
+    return true;
+}
+
+// Place an extent in offset order; a full run is split in two
+static bool free_insert_sorted(blf_index_t *index, uint64_t offset, uint64_t size, size_t slot) {
+    size_t r = index->free_run_count;
+    size_t p = 0;
+    // Extents are mostly added in offset order, as the file is scanned or
+    // the persisted map is loaded
+    const free_run_t *last = r > 0 ? index->free_runs[r - 1] : NULL;
+    if (!last || last->extents[last->count - 1].offset >= offset) {
+        free_search(index, offset, &r, &p);
+    }
+    if (r == index->free_run_count) {
+        if (r == 0 || index->free_runs[r - 1]->count == BLF_FREE_RUN) {
+            if (!free_run_insert(index, r)) {
                 return false;
             }
-            
-            new_header.kv_size += sizeof(blf_kv_entry_t) + entry.key_length + entry.value_length;
+        } else {
+            r--;
+            p = index->free_runs[r]->count;
         }
-        
-        free(current_key);
-        free(current_value);
     }
-    
-    // Copy raw data
-    void *raw_data = NULL;
-    if (file->header.raw_size > 0) {
-        raw_data = malloc(file->header.raw_size);
-        if (!raw_data) {
-            fclose(temp);
+
+    free_run_t *run = index->free_runs[r];
+    if (run->count == BLF_FREE_RUN) {
+        if (!free_run_insert(index, r + 1)) {
             return false;
         }
-        
-        if (fseek(file->fp, file->header.raw_offset, SEEK_SET) != 0) {
-            free(raw_data);
-            fclose(temp);
-            return false;
+        free_run_t *upper = index->free_runs[r + 1];
+        size_t half = BLF_FREE_RUN / 2;
+        memcpy(upper->extents, run->extents + half, (BLF_FREE_RUN - half) * sizeof(blf_free_extent_t));
+        memcpy(upper->slots, run->slots + half, (BLF_FREE_RUN - half) * sizeof(size_t));
+        upper->count = BLF_FREE_RUN - half;
+        run->count = half;
+        if (p > half) {
+            run = upper;
+            p -= half;
         }
-        
-        if (fread(raw_data, 1, file->header.raw_size, file->fp) != file->header.raw_size) {
-            free(raw_data);
-            fclose(temp);
+    }
+
+    memmove(run->extents + p + 1, run->extents + p, (run->count - p) * sizeof(blf_free_extent_t));
+    memmove(run->slots + p + 1, run->slots + p, (run->count - p) * sizeof(size_t));
+    run->extents[p].offset = offset;
+    run->extents[p].size = size;
+    run->slots[p] = slot;
+    run->count++;
+    return true;
+}
+
+// Drop position p of run r from the sorted extents
+static void free_erase_sorted(blf_index_t *index, size_t r, size_t p) {
+    free_run_t *run = index->free_runs[r];
+    run->count--;
+    memmove(run->extents + p, run->extents + p + 1, (run->count - p) * sizeof(blf_free_extent_t));
+    memmove(run->slots + p, run->slots + p + 1, (run->count - p) * sizeof(size_t));
+    if (run->count == 0) {
+        free(run);
+        index->free_run_count--;
+        memmove(index->free_runs + r, index->free_runs + r + 1, (index->free_run_count - r) * sizeof(free_run_t*));
+    }
+}
+
+// Add an extent to the free-space map
+static bool free_add(blf_index_t *index, uint64_t offset, uint64_t size) {
+    free_list_t *list = &index->free_lists[free_class(size)];
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 16;
+        blf_free_extent_t *grown = (blf_free_extent_t*)realloc(list->extents, capacity * sizeof(blf_free_extent_t));
+        if (!grown) {
             return false;
         }
+        list->extents = grown;
+        list->capacity = capacity;
     }
-    
-    // Update header and write raw data
-    new_header.raw_offset = sizeof(blf_header_t) + new_header.kv_size;
-    
-    // Seek to beginning of temp file and write updated header
-    if (fseek(temp, 0, SEEK_SET) != 0) {
-        if (raw_data) free(raw_data);
-        fclose(temp);
+    if (!free_insert_sorted(index, offset, size, list->count)) {
         return false;
     }
-    
-    if (fwrite(&new_header, sizeof(blf_header_t), 1, temp) != 1) {
-        if (raw_data) free(raw_data);
-        fclose(temp);
-        return false;
+
+    list->extents[list->count].offset = offset;
+    list->extents[list->count].size = size;
+    list->count++;
+    index->free_count++;
+    index->free_bytes += size;
+    return true;
+}
+
+// Remove and return extent i of size class c
+static blf_free_extent_t free_remove(blf_index_t *index, int c, size_t i) {
+    free_list_t *list = &index->free_lists[c];
+    blf_free_extent_t extent = list->extents[i];
+    size_t r;
+    size_t p;
+    list->extents[i] = list->extents[--list->count];
+    if (i < list->count) {
+        free_search(index, list->extents[i].offset, &r, &p);
+        index->free_runs[r]->slots[p] = i;
     }
-    
-    // Write raw data to temp file
-    if (file->header.raw_size > 0) {
-        if (fseek(temp, new_header.raw_offset, SEEK_SET) != 0) {
-            free(raw_data);
-            fclose(temp);
-            return false;
+
+    free_search(index, extent.offset, &r, &p);
+    free_erase_sorted(index, r, p);
+    index->free_count--;
+    index->free_bytes -= extent.size;
+    return extent;
+}
+
+// Remove and return the extent at position p of run r
+static blf_free_extent_t free_remove_sorted(blf_index_t *index, size_t r, size_t p) {
+    const free_run_t *run = index->free_runs[r];
+    return free_remove(index, free_class(run->extents[p].size), run->slots[p]);
+}
+
+// Positioned read that stops early only at end of file; returns the number
+// of bytes read or -1 on error
+static ssize_t pread_full(int fd, void *buf, size_t len, uint64_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, (char*)buf + done, len - done, (off_t)(offset + done));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
         }
-        
-        if (fwrite(raw_data, 1, file->header.raw_size, temp) != file->header.raw_size) {
-            free(raw_data);
-            fclose(temp);
-            return false;
+        if (n == 0) {
+            break;
         }
-        
-        free(raw_data);
+        done += (size_t)n;
     }
-    
-    // Close original file and temp file
-    fclose(file->fp);
-    
-    // Reopen original file and overwrite with temp file contents
-    file->fp = fopen(file->filename, "wb+");
-    if (!file->fp) {
-        fclose(temp);
+    return (ssize_t)done;
+}
+
+// End of the sections described by the header
+static uint64_t data_end(const blf_file_t *file) {
+    uint64_t kv_end = file->header.kv_offset + file->header.kv_size;
+    uint64_t raw_end = file->header.raw_offset + file->header.raw_size;
+    uint64_t index_end = file->header.index_offset + file->header.index_size;
+    uint64_t end = kv_end > raw_end ? kv_end : raw_end;
+    return end > index_end ? end : index_end;
+}
+
+static uint64_t align_up(uint64_t value, uint64_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+// Allocate file space up to size, falling back to extending the file
+static bool preallocate(int fd, uint64_t from, uint64_t size) {
+    if (fallocate(fd, 0, (off_t)from, (off_t)(size - from)) == 0) {
+        return true;
+    }
+    return ftruncate(fd, (off_t)size) == 0;
+}
+
+// Grow the mapping so that it covers end
+static bool map_reserve(blf_file_t *file, uint64_t end) {
+    blf_map_t *map = file->map;
+    if (end <= map->capacity) {
+        return true;
+    }
+
+    uint64_t capacity = (end + map->growth - 1) / map->growth * map->growth;
+    if (!preallocate(fileno(file->fp), map->capacity, capacity)) {
         return false;
     }
-    
-    // Copy temp file to original file
-    if (fseek(temp, 0, SEEK_SET) != 0) {
-        fclose(temp);
+
+    void *base = mremap(map->base, map->capacity, capacity, MREMAP_MAYMOVE);
+    if (base == MAP_FAILED) {
         return false;
     }
-    
-    char buffer[4096];
-    size_t bytes_read;
-    
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), temp)) > 0) {
-        if (fwrite(buffer, 1, bytes_read, file->fp) != bytes_read) {
-            fclose(temp);
-            return false;
-        }
+
+    map->base = (char*)base;
+    map->capacity = capacity;
+    return true;
+}
+
+static void map_dirty(blf_map_t *map, uint64_t offset, uint64_t len) {
+    if (map->dirty_start >= map->dirty_end) {
+        map->dirty_start = offset;
+        map->dirty_end = offset + len;
+        return;
     }
-    
-    fclose(temp);
-    
-    // Update file header in memory
-    file->header = new_header;
-    
-    return blf_flush(file);
+    if (offset < map->dirty_start) map->dirty_start = offset;
+    if (offset + len > map->dirty_end) map->dirty_end = offset + len;
 }
 
-// Write raw data (replaces existing raw data)
-bool blf_write_raw(blf_file_t *file, const void *data, uint64_t size) {
-    if (!file || !file->fp || !data) {
+// Read up to len bytes at offset, stopping early only at the end of the
+// file (or mapping); returns the number of bytes read or -1 on error
+static ssize_t read_some_at(blf_file_t *file, uint64_t offset, void *buf, size_t len) {
+    if (file->map) {
+        if (offset >= file->map->capacity) {
+            return 0;
+        }
+        if (len > file->map->capacity - offset) {
+            len = (size_t)(file->map->capacity - offset);
+        }
+        memcpy(buf, file->map->base + offset, len);
+        return (ssize_t)len;
+    }
+    return pread_full(fileno(file->fp), buf, len, offset);
+}
+
+// Read exactly len bytes at offset
+static bool read_at(blf_file_t *file, uint64_t offset, void *buf, size_t len) {
+    return read_some_at(file, offset, buf, len) == (ssize_t)len;
+}
+
+// Write exactly len bytes at offset
+static bool write_at(blf_file_t *file, uint64_t offset, const void *buf, size_t len) {
+    if (file->map) {
+        if (!map_reserve(file, offset + len)) {
+            return false;
+        }
+        memcpy(file->map->base + offset, buf, len);
+        map_dirty(file->map, offset, len);
+        return true;
+    }
+
+    int fd = fileno(file->fp);
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(fd, (const char*)buf + done, len - done, (off_t)(offset + done));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        done += (size_t)n;
+    }
+    return true;
+}
+
+// Copy length bytes between descriptors without going through user space
+// where possible. Block-aligned ranges are cloned on file systems with
+// reflinks (btrfs, XFS), so the data is shared rather than copied; the rest
+// goes through copy_file_range, then read and write. The ranges must not
+// overlap.
+static bool copy_range(int src_fd, uint64_t src_offset, int dst_fd, uint64_t dst_offset, uint64_t length) {
+    uint64_t done = 0;
+#ifdef FICLONERANGE
+    if (length > 0 && src_offset % BLF_RAW_ALIGN == 0 && dst_offset % BLF_RAW_ALIGN == 0) {
+        // An unaligned length is only accepted when it ends at the source's EOF
+        struct file_clone_range range = { src_fd, src_offset, length, dst_offset };
+        if (ioctl(dst_fd, FICLONERANGE, &range) == 0) {
+            return true;
+        }
+        range.src_length = length / BLF_RAW_ALIGN * BLF_RAW_ALIGN;
+        if (errno == EINVAL && range.src_length > 0 && ioctl(dst_fd, FICLONERANGE, &range) == 0) {
+            done = range.src_length;
+        }
+    }
+#endif
+
+    while (done < length) {
+        loff_t in = (loff_t)(src_offset + done);
+        loff_t out = (loff_t)(dst_offset + done);
+        uint64_t chunk = length - done < (1ULL << 30) ? length - done : 1ULL << 30;
+        ssize_t n = copy_file_range(src_fd, &in, dst_fd, &out, (size_t)chunk, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;  // Unsupported here (EXDEV, ENOSYS, ...) or a short source
+        }
+        done += (uint64_t)n;
+    }
+
+    char buffer[64 * 1024];
+    while (done < length) {
+        size_t chunk = length - done < sizeof(buffer) ? (size_t)(length - done) : sizeof(buffer);
+        if (pread_full(src_fd, buffer, chunk, src_offset + done) != (ssize_t)chunk) {
+            return false;
+        }
+        for (size_t written = 0; written < chunk; ) {
+            ssize_t n = pwrite(dst_fd, buffer + written, chunk - written, (off_t)(dst_offset + done + written));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                return false;
+            }
+            written += (size_t)n;
+        }
+        done += chunk;
+    }
+    return true;
+}
+
+// Map the file read-write, preallocating it in growth_step increments
+bool blf_map(blf_file_t *file, uint64_t growth_step) {
+    if (!file || !file->fp || file->map || fflush(file->fp) != 0) {
         return false;
     }
-    
-    // Seek to the raw data section
-    if (fseek(file->fp, file->header.raw_offset, SEEK_SET) != 0) {
+
+    int fd = fileno(file->fp);
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
         return false;
     }
-    
-    // Write raw data
-    if (fwrite(data, 1, size, file->fp) != size) {
+
+    blf_map_t *map = (blf_map_t*)calloc(1, sizeof(blf_map_t));
+    if (!map) {
         return false;
     }
-    
-    // Update header
-    file->header.raw_size = size;
-    
-    return blf_update_header(file) && blf_flush(file);
+
+    long page_size = sysconf(_SC_PAGESIZE);
+    map->growth = growth_step ? growth_step : BLF_MAP_GROWTH;
+    map->growth = (map->growth + page_size - 1) / page_size * page_size;
+    map->file_size = (uint64_t)st.st_size;
+
+    uint64_t end = map->file_size > data_end(file) ? map->file_size : data_end(file);
+    map->capacity = (end + map->growth - 1) / map->growth * map->growth;
+    if (map->capacity == 0) {
+        map->capacity = map->growth;
+    }
+
+    if (!preallocate(fd, map->file_size, map->capacity)) {
+        free(map);
+        return false;
+    }
+
+    void *base = mmap(NULL, map->capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        free(map);
+        return false;
+    }
+
+    map->base = (char*)base;
+    file->map = map;
+    return true;
 }
 
-// Read raw data
-bool blf_read_raw(blf_file_t *file, void *data, uint64_t *size) {
-    if (!file || !file->fp || !data || !size) {
+// Leave mapped mode, persisting the key index if it is stale and trimming
+// the preallocated space past the data
+bool blf_unmap(blf_file_t *file) {
+    if (!file || !file->map) {
         return false;
     }
-    
-    // Check buffer size
-    if (*size < file->header.raw_size) {
-        *size = file->header.raw_size;
+
+    blf_map_t *map = file->map;
+    bool ok = index_persist(file);
+    ok = munmap(map->base, map->capacity) == 0 && ok;
+
+    uint64_t size = map->file_size > data_end(file) ? map->file_size : data_end(file);
+    if (size < map->capacity && ftruncate(fileno(file->fp), (off_t)size) != 0) {
+        ok = false;
+    }
+
+    free(map);
+    file->map = NULL;
+    return ok;
+}
+
+// Make changes durable: msync the dirty range when mapped, fsync otherwise.
+// The key index is not written here, so a commit costs the data it covers
+// rather than the size of the index; it is persisted by blf_unmap and
+// blf_close, and a file committed with a stale index rebuilds it on open.
+bool blf_commit(blf_file_t *file) {
+    if (!file || !file->fp) {
         return false;
     }
-    
-    // If there's no raw data
-    if (file->header.raw_size == 0) {
-        *size = 0;
+
+    if (!file->map) {
+        return fflush(file->fp) == 0 && fdatasync(fileno(file->fp)) == 0;
+    }
+
+    blf_map_t *map = file->map;
+    if (map->dirty_start >= map->dirty_end) {
         return true;
     }
-    
-    // Seek to raw data section
-    if (fseek(file->fp, file->header.raw_offset, SEEK_SET) != 0) {
+
+    uint64_t page_size = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t start = map->dirty_start / page_size * page_size;
+    if (msync(map->base + start, map->dirty_end - start, MS_SYNC) != 0) {
         return false;
     }
-    
-    // Read raw data
-    if (fread(data, 1, file->header.raw_size, file->fp) != file->header.raw_size) {
+
+    map->dirty_start = map->dirty_end = 0;
+    return true;
+}
+
+// Sequential reader over a file range, refilled with large positioned reads
+typedef struct {
+    blf_file_t *file;
+    uint64_t offset;   // File offset of buffer[0]
+    uint64_t end;      // End of the range
+    char *buffer;
+    size_t length;     // Valid bytes in buffer
+    size_t pos;        // Next unread byte in buffer
+} reader_t;
+
+#define BLF_READER_SIZE (64 * 1024)
+
+static bool reader_init(reader_t *r, blf_file_t *file, uint64_t offset, uint64_t end) {
+    r->file = file;
+    r->offset = offset;
+    r->end = end;
+    r->length = 0;
+    r->pos = 0;
+    r->buffer = (char*)malloc(BLF_READER_SIZE);
+    return r->buffer != NULL;
+}
+
+static void reader_free(reader_t *r) {
+    free(r->buffer);
+    r->buffer = NULL;
+}
+
+static uint64_t reader_tell(const reader_t *r) {
+    return r->offset + r->pos;
+}
+
+static bool reader_read(reader_t *r, void *dst, size_t len) {
+    char *out = (char*)dst;
+    while (len > 0) {
+        if (r->pos == r->length) {
+            r->offset += r->length;
+            r->pos = 0;
+            uint64_t left = r->end > r->offset ? r->end - r->offset : 0;
+            size_t want = left < BLF_READER_SIZE ? (size_t)left : BLF_READER_SIZE;
+            ssize_t n = want ? read_some_at(r->file, r->offset, r->buffer, want) : 0;
+            if (n <= 0) {
+                r->length = 0;
+                return false;
+            }
+            r->length = (size_t)n;
+        }
+
+        size_t chunk = r->length - r->pos < len ? r->length - r->pos : len;
+        memcpy(out, r->buffer + r->pos, chunk);
+        r->pos += chunk;
+        out += chunk;
+        len -= chunk;
+    }
+    return true;
+}
+
+static void reader_skip(reader_t *r, uint64_t len) {
+    if (len <= r->length - r->pos) {
+        r->pos += len;
+    } else {
+        r->offset = reader_tell(r) + len;
+        r->length = 0;
+        r->pos = 0;
+    }
+}
+
+// Size of the entry header, plus the extended header if the flags say so
+static uint64_t entry_header_size(uint32_t key_length_field) {
+    return sizeof(blf_kv_entry_t) + ((key_length_field & BLF_KV_FLAG_EXT) ? sizeof(blf_kv_ext_t) : 0);
+}
+
+// Padding needed to align a value starting at value_start
+static uint16_t value_pad(uint64_t value_start, uint8_t align_log2) {
+    uint64_t mask = ((uint64_t)1 << align_log2) - 1;
+    return (uint16_t)((mask + 1 - (value_start & mask)) & mask);
+}
+
+// Read the next entry's headers and key from a reader, leaving it
+// positioned at the value
+static bool reader_next_entry(reader_t *r, kv_loc_t *loc, char **key, uint32_t *key_capacity) {
+    blf_kv_entry_t entry;
+
+    loc->offset = reader_tell(r);
+    if (!reader_read(r, &entry, sizeof(blf_kv_entry_t))) {
         return false;
     }
-    
-    *size = file->header.raw_size;
+
+    memset(&loc->ext, 0, sizeof(blf_kv_ext_t));
+    if ((entry.key_length & BLF_KV_FLAG_EXT) && !reader_read(r, &loc->ext, sizeof(blf_kv_ext_t))) {
+        return false;
+    }
+
+    loc->flags = entry.key_length & ~BLF_KV_KEY_MASK;
+    loc->key_length = entry.key_length & BLF_KV_KEY_MASK;
+    loc->value_length = entry.value_length;
+
+    if (loc->key_length > *key_capacity) {
+        char *grown = (char*)realloc(*key, loc->key_length);
+        if (!grown) {
+            return false;
+        }
+        *key = grown;
+        *key_capacity = loc->key_length;
+    }
+
+    if (!reader_read(r, *key, loc->key_length)) {
+        return false;
+    }
+
+    reader_skip(r, loc->ext.pad);
+    loc->value_offset = reader_tell(r);
+    return true;
+}
+
+// Encode an entry header, extended header, key and value padding for an
+// entry written at offset; ext is NULL for plain entries. Returns the length.
+static size_t encode_entry(char *buf, uint64_t offset, const char *key, uint32_t key_length,
+                           uint32_t value_length, const blf_kv_ext_t *ext) {
+    blf_kv_entry_t entry;
+    entry.key_length = key_length | (ext ? BLF_KV_FLAG_EXT : 0);
+    entry.value_length = value_length;
+
+    size_t len = 0;
+    memcpy(buf, &entry, sizeof(blf_kv_entry_t));
+    len += sizeof(blf_kv_entry_t);
+
+    blf_kv_ext_t header;
+    if (ext) {
+        header = *ext;
+        header.pad = value_pad(offset + len + sizeof(blf_kv_ext_t) + key_length, header.align_log2);
+        memcpy(buf + len, &header, sizeof(blf_kv_ext_t));
+        len += sizeof(blf_kv_ext_t);
+    }
+
+    memcpy(buf + len, key, key_length);
+    len += key_length;
+
+    if (ext) {
+        memset(buf + len, 0, header.pad);
+        len += header.pad;
+    }
+    return len;
+}
+
+// Largest encode_entry() result for a key
+static size_t encoded_entry_max(uint32_t key_length, const blf_kv_ext_t *ext) {
+    return sizeof(blf_kv_entry_t) + sizeof(blf_kv_ext_t) + key_length +
+           (ext ? ((size_t)1 << ext->align_log2) : 0);
+}
+
+// Build the key index with a single pass over the KV section
+static bool index_build(blf_file_t *file) {
+    blf_index_t *index = index_new(BLF_INDEX_MIN_BUCKETS);
+    if (!index) {
+        return false;
+    }
+    file->index = index;
+
+    if (file->header.kv_size == 0) {
+        return true;
+    }
+
+    uint64_t end_offset = file->header.kv_offset + file->header.kv_size;
+    reader_t reader;
+    if (!reader_init(&reader, file, file->header.kv_offset, end_offset)) {
+        index_free(file);
+        return false;
+    }
+
+    char *key = NULL;
+    uint32_t key_capacity = 0;
+    bool ok = true;
+    uint64_t free_offset = 0;  // Run of adjacent free entries, mapped as one extent
+    uint64_t free_size = 0;
+
+    while (reader_tell(&reader) < end_offset) {
+        kv_loc_t loc;
+        if (!reader_next_entry(&reader, &loc, &key, &key_capacity)) {
+            ok = false;
+            break;
+        }
+
+        if (loc.flags & BLF_KV_FLAG_FREE) {
+            if (free_size == 0) {
+                free_offset = loc.offset;
+            }
+            free_size += loc.value_offset + loc.value_length - loc.offset;
+        } else {
+            if ((free_size > 0 && !free_add(index, free_offset, free_size)) ||
+                !index_insert(index, hash_key(key, loc.key_length), loc.offset)) {
+                ok = false;
+                break;
+            }
+            free_size = 0;
+        }
+
+        // Skip value
+        reader_skip(&reader, loc.value_length);
+    }
+
+    if (ok && free_size > 0 && !free_add(index, free_offset, free_size)) {
+        ok = false;
+    }
+
+    free(key);
+    reader_free(&reader);
+
+    if (!ok) {
+        index_free(file);
+    }
+    return ok;
+}
+
+// Use the persisted index section if it is present and matches the KV
+// section. Its buckets are mapped privately, so opening stays cheap and a
+// lookup only faults in the bucket it probes.
+static bool index_load(blf_file_t *file) {
+    uint64_t offset = file->header.index_offset;
+    uint64_t size = file->header.index_size;
+    blf_index_header_t header;
+
+    if (offset == 0 || size < sizeof(blf_index_header_t) ||
+        !read_at(file, offset, &header, sizeof(blf_index_header_t))) {
+        return false;
+    }
+
+    if (header.magic != BLF_INDEX_MAGIC || header.slots != BLF_INDEX_SLOTS ||
+        header.bucket_count == 0 || (header.bucket_count & (header.bucket_count - 1)) != 0 ||
+        header.kv_offset != file->header.kv_offset || header.kv_size != file->header.kv_size ||
+        size != sizeof(blf_index_header_t) + header.bucket_count * sizeof(blf_index_bucket_t) +
+                header.free_count * sizeof(blf_free_extent_t)) {
+        return false;
+    }
+
+    struct stat st;
+    int fd = fileno(file->fp);
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < offset + size) {
+        return false;
+    }
+
+    uint64_t page_size = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t start = offset / page_size * page_size;
+    size_t length = (size_t)(offset + size - start);
+    void *mapping = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, (off_t)start);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+
+    blf_index_t *index = (blf_index_t*)calloc(1, sizeof(blf_index_t));
+    if (!index) {
+        munmap(mapping, length);
+        return false;
+    }
+
+    index->buckets = (blf_index_bucket_t*)((char*)mapping + (offset - start) + sizeof(blf_index_header_t));
+    index->bucket_count = header.bucket_count;
+    index->count = header.count;
+    index->tombstones = header.tombstones;
+    index->mapping = mapping;
+    index->mapping_length = length;
+    file->index = index;
+
+    // The free-space map is small; it is copied into its size classes. It is
+    // persisted in offset order, so each extent is appended.
+    const blf_free_extent_t *extents = (const blf_free_extent_t*)(index->buckets + header.bucket_count);
+    for (uint64_t i = 0; i < header.free_count; i++) {
+        if (!free_add(index, extents[i].offset, extents[i].size)) {
+            index_free(file);
+            return false;
+        }
+    }
     return true;
 }
+
+// Mark the persisted index stale. Called before the KV section changes or
+// before a write could reach the index section, which follows the data.
+static bool index_invalidate(blf_file_t *file) {
+    if (file->header.index_offset == 0) {
+        return true;
+    }
+
+    if (file->index && !index_detach(file->index)) {
+        index_free(file);
+    }
+
+    file->header.index_offset = 0;
+    file->header.index_size = 0;
+    return blf_update_header(file);
+}
+
+// Invalidate the persisted index if a write up to end would overlap it
+static bool index_protect(blf_file_t *file, uint64_t end) {
+    if (file->header.index_offset == 0 || end <= file->header.index_offset) {
+        return true;
+    }
+    return index_invalidate(file);
+}
+
+// Write the key index after the data and record it in the header
+static bool index_persist(blf_file_t *file) {
+    if (file->header.version < BLF_VERSION_INDEX || file->header.index_offset != 0 ||
+        file->header.kv_size == 0) {
+        return true;
+    }
+
+    if (!file->index && !index_build(file)) {
+        return false;
+    }
+
+    blf_index_t *index = file->index;
+    blf_index_header_t header;
+    memset(&header, 0, sizeof(blf_index_header_t));
+    header.magic = BLF_INDEX_MAGIC;
+    header.slots = BLF_INDEX_SLOTS;
+    header.bucket_count = index->bucket_count;
+    header.count = index->count;
+    header.tombstones = index->tombstones;
+    header.kv_offset = file->header.kv_offset;
+    header.kv_size = file->header.kv_size;
+    header.free_count = index->free_count;
+
+    uint64_t offset = (data_end(file) + 7) / 8 * 8;
+    uint64_t buckets_size = index->bucket_count * sizeof(blf_index_bucket_t);
+
+    // Buckets and free extents first, so that a valid index header is never
+    // followed by a partially written table
+    uint64_t pos = offset + sizeof(blf_index_header_t);
+    if (!write_at(file, pos, index->buckets, buckets_size)) {
+        return false;
+    }
+    pos += buckets_size;
+    for (size_t r = 0; r < index->free_run_count; r++) {
+        const free_run_t *run = index->free_runs[r];
+        if (!write_at(file, pos, run->extents, run->count * sizeof(blf_free_extent_t))) {
+            return false;
+        }
+        pos += run->count * sizeof(blf_free_extent_t);
+    }
+    if (!write_at(file, offset, &header, sizeof(blf_index_header_t))) {
+        return false;
+    }
+
+    file->header.index_offset = offset;
+    file->header.index_size = pos - offset;
+    return blf_update_header(file);
+}
+
+// Helper function to find a key in the KV section. The key's hash picks a
+// bucket whose fingerprints are matched at once; keys are only read back
+// and compared on a fingerprint hit.
+static bool find_key(blf_file_t *file, const char *key, uint32_t key_length, kv_loc_t *loc) {
+    if (!file || !file->fp || file->header.kv_size == 0) {
+        return false;
+    }
+
+    if (!file->index && !index_load(file) && !index_build(file)) {
+        return false;
+    }
+
+    blf_index_t *index = file->index;
+    uint64_t h = hash_key(key, key_length);
+    uint32_t fp = hash_fingerprint(h);
+    uint64_t mask = index->bucket_count - 1;
+    size_t want = sizeof(blf_kv_entry_t) + sizeof(blf_kv_ext_t) + key_length;
+    char *buf = NULL;
+    bool found = false;
+
+    for (uint64_t b = h & mask, probes = 0; !found && probes <= mask; b = (b + 1) & mask, probes++) {
+        const blf_index_bucket_t *bucket = &index->buckets[b];
+        uint32_t matches = fp_match(bucket->fps, fp);
+
+        while (matches) {
+            int slot = __builtin_ctz(matches);
+            matches &= matches - 1;
+
+            // Entry header, extended header and key in one read
+            if (!buf) {
+                buf = (char*)malloc(want);
+                if (!buf) {
+                    return false;
+                }
+            }
+
+            ssize_t got = read_some_at(file, bucket->offsets[slot], buf, want);
+            if (got < (ssize_t)sizeof(blf_kv_entry_t)) {
+                continue;
+            }
+
+            blf_kv_entry_t entry;
+            memcpy(&entry, buf, sizeof(blf_kv_entry_t));
+            uint64_t header_size = entry_header_size(entry.key_length);
+            if ((entry.key_length & BLF_KV_KEY_MASK) != key_length ||
+                (uint64_t)got < header_size + key_length ||
+                memcmp(buf + header_size, key, key_length) != 0) {
+                continue;
+            }
+
+            loc->offset = bucket->offsets[slot];
+            loc->flags = entry.key_length & ~BLF_KV_KEY_MASK;
+            loc->key_length = key_length;
+            loc->value_length = entry.value_length;
+            memset(&loc->ext, 0, sizeof(blf_kv_ext_t));
+            if (entry.key_length & BLF_KV_FLAG_EXT) {
+                memcpy(&loc->ext, buf + sizeof(blf_kv_entry_t), sizeof(blf_kv_ext_t));
+            }
+            loc->value_offset = loc->offset + header_size + key_length + loc->ext.pad;
+            found = true;
+            break;
+        }
+
+        if (fp_match(bucket->fps, 0)) {
+            break;
+        }
+    }
+
+    free(buf);
+    return found;
+}
+
+// Size of an entry written at offset, from its header to the end of its value
+static uint64_t entry_size_at(uint64_t offset, uint32_t key_length, uint32_t value_length,
+                              const blf_kv_ext_t *ext) {
+    uint64_t prefix = sizeof(blf_kv_entry_t) + (ext ? sizeof(blf_kv_ext_t) : 0) + key_length;
+    return prefix + (ext ? value_pad(offset + prefix, ext->align_log2) : 0) + value_length;
+}
+
+// Cover size bytes at offset with free entries; one entry spans at most
+// 4 GiB, so larger extents are written as a chain
+static bool write_free_entries(blf_file_t *file, uint64_t offset, uint64_t size) {
+    const uint64_t max = sizeof(blf_kv_entry_t) + UINT32_MAX;
+    while (size > 0) {
+        uint64_t chunk = size < max ? size : max;
+        if (size - chunk > 0 && size - chunk < sizeof(blf_kv_entry_t)) {
+            chunk -= sizeof(blf_kv_entry_t);
+        }
+
+        blf_kv_entry_t entry;
+        entry.key_length = BLF_KV_FLAG_FREE;
+        entry.value_length = (uint32_t)(chunk - sizeof(blf_kv_entry_t));
+        if (!write_at(file, offset, &entry, sizeof(blf_kv_entry_t))) {
+            return false;
+        }
+        offset += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+// Release the extent of an entry that is no longer referenced. The free
+// extents right before and after it are absorbed; at the end of the KV
+// section the section shrinks instead. The persisted index must already be
+// invalidated.
+static bool free_release(blf_file_t *file, uint64_t offset, uint64_t size) {
+    blf_index_t *index = file->index;
+    uint64_t kv_end = file->header.kv_offset + file->header.kv_size;
+
+    size_t r;
+    size_t p;
+    free_search(index, offset, &r, &p);
+    if (r < index->free_run_count && index->free_runs[r]->extents[p].offset == offset + size) {
+        size += free_remove_sorted(index, r, p).size;
+        free_search(index, offset, &r, &p);
+    }
+    if (p > 0 || r > 0) {
+        r = p > 0 ? r : r - 1;
+        p = p > 0 ? p - 1 : index->free_runs[r]->count - 1;
+        const blf_free_extent_t *before = &index->free_runs[r]->extents[p];
+        if (before->offset + before->size == offset) {
+            offset = before->offset;
+            size += free_remove_sorted(index, r, p).size;
+        }
+    }
+
+    if (offset + size == kv_end) {
+        file->header.kv_size -= size;
+        if (file->header.raw_size == 0) {
+            file->header.raw_offset = offset;
+        }
+        return true;
+    }
+
+    if (file->header.version < BLF_VERSION_FREE) {
+        file->header.version = BLF_VERSION_FREE;
+    }
+    return write_free_entries(file, offset, size) && free_add(index, offset, size);
+}
+
+// Take a free extent for an entry: the best fit among the most recently
+// freed extents of its size class, else of the next larger class that has
+// one. An extent fits if the entry fills it or leaves room for a free entry.
+static bool free_take(blf_file_t *file, uint32_t key_length, uint32_t value_length,
+                      const blf_kv_ext_t *ext, blf_free_extent_t *extent, uint64_t *size) {
+    blf_index_t *index = file->index;
+    if (!index || index->free_count == 0) {
+        return false;
+    }
+
+    uint64_t smallest = sizeof(blf_kv_entry_t) + (ext ? sizeof(blf_kv_ext_t) : 0) + key_length + value_length;
+    for (int c = free_class(smallest); c < BLF_FREE_CLASSES; c++) {
+        free_list_t *list = &index->free_lists[c];
+        size_t probes = list->count < BLF_FREE_PROBES ? list->count : BLF_FREE_PROBES;
+        size_t best = 0;
+        uint64_t best_needed = 0;
+        uint64_t best_rest = UINT64_MAX;
+        for (size_t k = 0; k < probes && best_rest > 0; k++) {
+            size_t i = list->count - 1 - k;
+            const blf_free_extent_t *candidate = &list->extents[i];
+            uint64_t needed = entry_size_at(candidate->offset, key_length, value_length, ext);
+            if ((candidate->size == needed || candidate->size >= needed + sizeof(blf_kv_entry_t)) &&
+                candidate->size - needed < best_rest) {
+                best = i;
+                best_needed = needed;
+                best_rest = candidate->size - needed;
+            }
+        }
+        if (best_rest != UINT64_MAX) {
+            *extent = free_remove(index, c, best);
+            *size = best_needed;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Move the raw section to a new (higher) offset, copying from the end so
+// that overlapping ranges are handled
+static bool move_raw(blf_file_t *file, uint64_t new_offset) {
+    new_offset = align_up(new_offset, BLF_RAW_ALIGN);
+    if (!index_protect(file, new_offset + file->header.raw_size)) {
+        return false;
+    }
+
+    uint64_t raw_offset = file->header.raw_offset;
+    uint64_t raw_size = file->header.raw_size;
+    if (!file->map) {
+        // Pieces no longer than the shift never overlap their destination,
+        // and start at aligned offsets so that they can be cloned
+        uint64_t shift = new_offset - raw_offset;
+        int fd = fileno(file->fp);
+        if (fflush(file->fp) != 0) {
+            return false;
+        }
+        for (uint64_t i = (raw_size + shift - 1) / shift; i-- > 0; ) {
+            uint64_t start = i * shift;
+            uint64_t length = raw_size - start < shift ? raw_size - start : shift;
+            if (!copy_range(fd, raw_offset + start, fd, new_offset + start, length)) {
+                return false;
+            }
+        }
+        file->header.raw_offset = new_offset;
+        return true;
+    }
+
+    char buffer[4096];
+    uint64_t remaining = raw_size;
+
+    while (remaining > 0) {
+        size_t chunk = remaining < sizeof(buffer) ? (size_t)remaining : sizeof(buffer);
+        remaining -= chunk;
+
+        if (!read_at(file, raw_offset + remaining, buffer, chunk) ||
+            !write_at(file, new_offset + remaining, buffer, chunk)) {
+            return false;
+        }
+    }
+
+    file->header.raw_offset = new_offset;
+    return true;
+}
+
+static bool delete_kv(blf_file_t *file, const char *key, uint32_t key_length);
+
+static uint64_t cache_charge(uint32_t key_length, uint32_t value_length) {
+    return sizeof(blf_cache_entry_t) + key_length + value_length;
+}
+
+static blf_cache_shard_t *cache_shard(blf_cache_t *cache, uint64_t hash) {
+    return &cache->shards[hash % BLF_CACHE_SHARDS];
+}
+
+static void cache_unlink(blf_cache_shard_t *shard, blf_cache_entry_t *entry) {
+    if (entry->prev) entry->prev->next = entry->next; else shard->head = entry->next;
+    if (entry->next) entry->next->prev = entry->prev; else shard->tail = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+static void cache_push_front(blf_cache_shard_t *shard, blf_cache_entry_t *entry) {
+    entry->prev = NULL;
+    entry->next = shard->head;
+    if (shard->head) shard->head->prev = entry; else shard->tail = entry;
+    shard->head = entry;
+}
+
+// Find an entry; returns the link that points at it so it can be removed
+static blf_cache_entry_t **cache_lookup(blf_cache_shard_t *shard, uint64_t hash, const char *key, uint32_t key_length) {
+    blf_cache_entry_t **link = &shard->buckets[(hash / BLF_CACHE_SHARDS) & (shard->bucket_count - 1)];
+    while (*link) {
+        blf_cache_entry_t *entry = *link;
+        if (entry->hash == hash && entry->key_length == key_length &&
+            memcmp(entry->data, key, key_length) == 0) {
+            return link;
+        }
+        link = &entry->chain;
+    }
+    return link;
+}
+
+static void cache_remove(blf_cache_shard_t *shard, blf_cache_entry_t **link) {
+    blf_cache_entry_t *entry = *link;
+    *link = entry->chain;
+    cache_unlink(shard, entry);
+    shard->bytes -= cache_charge(entry->key_length, entry->value_length);
+    shard->entries--;
+    free(entry);
+}
+
+// Double the bucket array once chains get long; failure just keeps them long
+static void cache_grow(blf_cache_shard_t *shard) {
+    size_t bucket_count = shard->bucket_count * 2;
+    blf_cache_entry_t **buckets = (blf_cache_entry_t**)calloc(bucket_count, sizeof(blf_cache_entry_t*));
+    if (!buckets) {
+        return;
+    }
+
+    for (size_t i = 0; i < shard->bucket_count; i++) {
+        blf_cache_entry_t *entry = shard->buckets[i];
+        while (entry) {
+            blf_cache_entry_t *chain = entry->chain;
+            size_t b = (entry->hash / BLF_CACHE_SHARDS) & (bucket_count - 1);
+            entry->chain = buckets[b];
+            buckets[b] = entry;
+            entry = chain;
+        }
+    }
+
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->bucket_count = bucket_count;
+}
+
+// Cache a value, evicting least recently used entries to stay in budget
+static void cache_insert(blf_cache_t *cache, uint64_t hash, const char *key, uint32_t key_length,
+                         const void *value, uint32_t value_length) {
+    blf_cache_shard_t *shard = cache_shard(cache, hash);
+    uint64_t charge = cache_charge(key_length, value_length);
+
+    pthread_mutex_lock(&shard->lock);
+
+    blf_cache_entry_t **link = cache_lookup(shard, hash, key, key_length);
+    if (*link) {
+        cache_remove(shard, link);
+    }
+
+    if (charge > shard->budget) {
+        pthread_mutex_unlock(&shard->lock);
+        return;
+    }
+
+    while (shard->bytes + charge > shard->budget && shard->tail) {
+        blf_cache_entry_t *victim = shard->tail;
+        cache_remove(shard, cache_lookup(shard, victim->hash, victim->data, victim->key_length));
+        shard->evictions++;
+    }
+
+    blf_cache_entry_t *entry = (blf_cache_entry_t*)malloc(charge);
+    if (entry) {
+        if (shard->entries >= shard->bucket_count * 2) {
+            cache_grow(shard);
+        }
+
+        entry->hash = hash;
+        entry->key_length = key_length;
+        entry->value_length = value_length;
+        memcpy(entry->data, key, key_length);
+        memcpy(entry->data + key_length, value, value_length);
+
+        link = &shard->buckets[(hash / BLF_CACHE_SHARDS) & (shard->bucket_count - 1)];
+        entry->chain = *link;
+        *link = entry;
+        cache_push_front(shard, entry);
+        shard->bytes += charge;
+        shard->entries++;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+}
+
+static void cache_invalidate(blf_cache_t *cache, uint64_t hash, const char *key, uint32_t key_length) {
+    blf_cache_shard_t *shard = cache_shard(cache, hash);
+
+    pthread_mutex_lock(&shard->lock);
+    blf_cache_entry_t **link = cache_lookup(shard, hash, key, key_length);
+    if (*link) {
+        cache_remove(shard, link);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// Enable the value cache with the given byte budget
+bool blf_cache_enable(blf_file_t *file, uint64_t budget_bytes) {
+    if (!file || file->cache || budget_bytes == 0) {
+        return false;
+    }
+
+    blf_cache_t *cache = (blf_cache_t*)calloc(1, sizeof(blf_cache_t));
+    if (!cache) {
+        return false;
+    }
+
+    pthread_mutex_init(&cache->io_lock, NULL);
+    for (int i = 0; i < BLF_CACHE_SHARDS; i++) {
+        blf_cache_shard_t *shard = &cache->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->budget = budget_bytes / BLF_CACHE_SHARDS;
+        shard->bucket_count = BLF_CACHE_BUCKETS;
+        shard->buckets = (blf_cache_entry_t**)calloc(BLF_CACHE_BUCKETS, sizeof(blf_cache_entry_t*));
+        if (!shard->buckets) {
+            file->cache = cache;
+            blf_cache_disable(file);
+            return false;
+        }
+    }
+
+    file->cache = cache;
+    return true;
+}
+
+// Disable the value cache and release everything it holds
+void blf_cache_disable(blf_file_t *file) {
+    if (!file || !file->cache) {
+        return;
+    }
+
+    blf_cache_t *cache = file->cache;
+    for (int i = 0; i < BLF_CACHE_SHARDS; i++) {
+        blf_cache_shard_t *shard = &cache->shards[i];
+        blf_cache_entry_t *entry = shard->head;
+        while (entry) {
+            blf_cache_entry_t *next = entry->next;
+            free(entry);
+            entry = next;
+        }
+        free(shard->buckets);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    pthread_mutex_destroy(&cache->io_lock);
+    free(cache);
+    file->cache = NULL;
+}
+
+// Get value cache counters
+bool blf_cache_stats(blf_file_t *file, blf_cache_stats_t *stats) {
+    if (!file || !file->cache || !stats) {
+        return false;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    for (int i = 0; i < BLF_CACHE_SHARDS; i++) {
+        blf_cache_shard_t *shard = &file->cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->evictions += shard->evictions;
+        stats->entries += shard->entries;
+        stats->bytes += shard->bytes;
+        stats->budget += shard->budget;
+        pthread_mutex_unlock(&shard->lock);
+    }
+    return true;
+}
+
+// Write an entry into a free extent that fits it; the rest of the extent
+// stays free. The value and the remainder's free entry are written before
+// the entry header, which replaces the extent's free entry.
+static bool reuse_entry(blf_file_t *file, const char *key, uint32_t key_length, const void *value,
+                        uint32_t value_length, const blf_kv_ext_t *ext, char *prefix,
+                        const blf_free_extent_t *extent, uint64_t size) {
+    size_t prefix_length = encode_entry(prefix, extent->offset, key, key_length, value_length, ext);
+    uint64_t rest = extent->size - size;
+    if (!write_at(file, extent->offset + prefix_length, value, value_length) ||
+        (rest > 0 && !write_free_entries(file, extent->offset + size, rest)) ||
+        !write_at(file, extent->offset, prefix, prefix_length)) {
+        return false;
+    }
+
+    if (rest > 0 && !free_add(file->index, extent->offset + size, rest)) {
+        index_free(file);
+    }
+    if (file->index && !index_insert(file->index, hash_key(key, key_length), extent->offset)) {
+        index_free(file);
+    }
+    return blf_update_header(file) && blf_flush(file);
+}
+
+// Add an entry, reusing free space or appending it at the end of the KV
+// section; ext is NULL for plain entries
+static bool add_entry(blf_file_t *file, const char *key, uint32_t key_length,
+                      const void *value, uint32_t value_length, const blf_kv_ext_t *ext) {
+    char *prefix = (char*)malloc(encoded_entry_max(key_length, ext));
+    if (!prefix) {
+        return false;
+    }
+
+    if (!index_invalidate(file)) {
+        free(prefix);
+        return false;
+    }
+
+    blf_free_extent_t extent;
+    uint64_t size;
+    if (free_take(file, key_length, value_length, ext, &extent, &size)) {
+        bool ok = reuse_entry(file, key, key_length, value, value_length, ext, prefix, &extent, size);
+        free(prefix);
+        return ok;
+    }
+
+    uint64_t append_offset = file->header.kv_offset + file->header.kv_size;
+    size_t prefix_length = encode_entry(prefix, append_offset, key, key_length, value_length, ext);
+    uint64_t entry_size = prefix_length + value_length;
+
+    // Make room for the new entry if it would overlap the raw section. The
+    // gap left after it grows with the KV section, so that appends move the
+    // raw section a logarithmic number of times rather than every page.
+    if (file->header.raw_size > 0 && append_offset + entry_size > file->header.raw_offset) {
+        uint64_t gap = file->header.kv_size / 2 > BLF_RAW_ALIGN ? file->header.kv_size / 2 : BLF_RAW_ALIGN;
+        if (!move_raw(file, append_offset + entry_size + gap)) {
+            free(prefix);
+            return false;
+        }
+    }
+
+    // Write entry header, key and padding, then the value
+    bool ok = write_at(file, append_offset, prefix, prefix_length) &&
+              write_at(file, append_offset + prefix_length, value, value_length);
+    free(prefix);
+    if (!ok) {
+        return false;
+    }
+
+    if (file->index && !index_insert(file->index, hash_key(key, key_length), append_offset)) {
+        index_free(file);
+    }
+
+    // Update header; extended entries need format version 2
+    if (ext && file->header.version < 2) {
+        file->header.version = 2;
+    }
+    file->header.kv_size += entry_size;
+    if (file->header.raw_size == 0) {
+        file->header.raw_offset = file->header.kv_offset + file->header.kv_size;
+    }
+
+    return blf_update_header(file) && blf_flush(file);
+}
+
+// Drop an entry found by find_key and release its extent
+static bool release_entry(blf_file_t *file, const char *key, uint32_t key_length, const kv_loc_t *loc) {
+    if (!index_invalidate(file) || (!file->index && !index_build(file))) {
+        return false;
+    }
+
+    index_remove(file->index, hash_key(key, key_length), loc->offset);
+    return free_release(file, loc->offset, loc->value_offset + loc->value_length - loc->offset) &&
+           blf_update_header(file) && blf_flush(file);
+}
+
+// Store a shorter value in an entry's own extent and release the rest of it.
+// An extended header keeps its type, alignment and padding but takes the new
+// element count. Returns 1 once stored, 0 without writing anything if the
+// value is longer or the rest is too small to hold a free entry, or -1 on
+// error. After an error the rest may already be in the free-space map, so
+// the entry must not be released again.
+static int shrink_entry(blf_file_t *file, const kv_loc_t *loc, const void *value, uint32_t value_length,
+                        const blf_kv_ext_t *ext) {
+    if (value_length > loc->value_length || loc->value_length - value_length < sizeof(blf_kv_entry_t)) {
+        return 0;
+    }
+    uint64_t end = loc->value_offset + loc->value_length;
+    uint64_t rest = loc->value_length - value_length;
+    if (!index_invalidate(file) || (!file->index && !index_build(file))) {
+        return -1;
+    }
+
+    char header[sizeof(blf_kv_entry_t) + sizeof(blf_kv_ext_t)];
+    size_t header_length = sizeof(blf_kv_entry_t);
+    blf_kv_entry_t entry;
+    entry.key_length = loc->key_length | loc->flags;
+    entry.value_length = value_length;
+    memcpy(header, &entry, sizeof(blf_kv_entry_t));
+    if (loc->flags & BLF_KV_FLAG_EXT) {
+        blf_kv_ext_t shrunk = loc->ext;
+        shrunk.count = ext ? ext->count : value_length;
+        memcpy(header + header_length, &shrunk, sizeof(blf_kv_ext_t));
+        header_length += sizeof(blf_kv_ext_t);
+    }
+    bool ok = write_at(file, loc->value_offset, value, value_length) &&
+              free_release(file, end - rest, rest) &&
+              write_at(file, loc->offset, header, header_length) &&
+              blf_update_header(file) && blf_flush(file);
+    return ok ? 1 : -1;
+}
+
+// Store a value, in place if an entry of the same type and length exists
+static bool put_kv(blf_file_t *file, const char *key, uint32_t key_length,
+                   const void *value, uint32_t value_length, const blf_kv_ext_t *ext) {
+    kv_loc_t loc;
+    uint8_t type = ext ? ext->type : BLF_TYPE_BYTES;
+
+    if (find_key(file, key, key_length, &loc)) {
+        // If the new value fits in the old space (at no weaker alignment),
+        // just update it
+        if (value_length == loc.value_length && type == loc.ext.type &&
+            (!ext || loc.ext.align_log2 >= ext->align_log2)) {
+            return write_at(file, loc.value_offset, value, value_length) && blf_flush(file);
+        }
+
+        // Files with the short header cannot take free entries; they are
+        // rewritten (and upgraded) without the old entry first
+        if (file->header.version < BLF_VERSION_INDEX) {
+            if (!delete_kv(file, key, key_length)) {
+                return false;
+            }
+        } else {
+            int shrunk = 0;
+            if (type == loc.ext.type && (!ext || loc.ext.align_log2 >= ext->align_log2)) {
+                shrunk = shrink_entry(file, &loc, value, value_length, ext);
+            }
+            if (shrunk != 0) {
+                return shrunk > 0;
+            }
+            // The new entry is written before the old one is released
+            return add_entry(file, key, key_length, value, value_length, ext) &&
+                   release_entry(file, key, key_length, &loc);
+        }
+    }
+
+    return add_entry(file, key, key_length, value, value_length, ext);
+}
+
+// Get value for a key
+static bool get_kv(blf_file_t *file, const char *key, uint32_t key_length, void *value, uint32_t *value_length) {
+    kv_loc_t loc;
+
+    if (!find_key(file, key, key_length, &loc)) {
+        return false;
+    }
+
+    // Check buffer size
+    if (*value_length < loc.value_length) {
+        *value_length = loc.value_length;
+        return false;
+    }
+
+    // Read value
+    if (!read_at(file, loc.value_offset, value, loc.value_length)) {
+        return false;
+    }
+
+    *value_length = loc.value_length;
+    return true;
+}
+
+// Anonymous temporary file in the same directory as path, so that ranges
+// can be cloned between the two; falls back to tmpfile()
+static FILE *temp_beside(const char *path) {
+    size_t length = strlen(path);
+    char *name = (char*)malloc(length + sizeof(".XXXXXX"));
+    if (!name) {
+        return tmpfile();
+    }
+    memcpy(name, path, length);
+    memcpy(name + length, ".XXXXXX", sizeof(".XXXXXX"));
+
+    int fd = mkstemp(name);
+    if (fd >= 0) {
+        unlink(name);
+    }
+    free(name);
+    FILE *temp = fd >= 0 ? fdopen(fd, "wb+") : NULL;
+    if (!temp) {
+        if (fd >= 0) close(fd);
+        return tmpfile();
+    }
+    return temp;
+}
+
+// Rewrite the file without free space, leaving out the entry at skip_offset
+// (UINT64_MAX for none)
+static bool rewrite_kv(blf_file_t *file, uint64_t skip_offset) {
+    FILE *temp = temp_beside(file->filename);
+    if (!temp) {
+        return false;
+    }
+
+    // Copy header to temporary file; files of older versions are upgraded
+    blf_header_t new_header = file->header;
+    new_header.version = BLF_VERSION;
+    new_header.kv_offset = sizeof(blf_header_t);
+    new_header.kv_size = 0;
+    new_header.index_offset = 0;
+    new_header.index_size = 0;
+
+    if (fwrite(&new_header, sizeof(blf_header_t), 1, temp) != 1) {
+        fclose(temp);
+        return false;
+    }
+
+    // Copy all KV entries except the one to delete, re-padding aligned values
+    // for their new offsets
+    uint64_t end_offset = file->header.kv_offset + file->header.kv_size;
+    reader_t reader;
+    if (!reader_init(&reader, file, file->header.kv_offset, end_offset)) {
+        fclose(temp);
+        return false;
+    }
+
+    char *current_key = NULL;
+    uint32_t key_capacity = 0;
+    char *prefix = NULL;
+    void *current_value = NULL;
+    uint32_t value_capacity = 0;
+    bool ok = true;
+
+    while (ok && reader_tell(&reader) < end_offset) {
+        kv_loc_t loc;
+        if (!reader_next_entry(&reader, &loc, &current_key, &key_capacity)) {
+            ok = false;
+            break;
+        }
+
+        if (loc.offset == skip_offset || (loc.flags & BLF_KV_FLAG_FREE)) {
+            reader_skip(&reader, loc.value_length);
+            continue;
+        }
+
+        // Read value
+        if (loc.value_length > value_capacity) {
+            void *grown = realloc(current_value, loc.value_length);
+            if (!grown) {
+                ok = false;
+                break;
+            }
+            current_value = grown;
+            value_capacity = loc.value_length;
+        }
+
+        if (!reader_read(&reader, current_value, loc.value_length)) {
+            ok = false;
+            break;
+        }
+
+        const blf_kv_ext_t *ext = (loc.flags & BLF_KV_FLAG_EXT) ? &loc.ext : NULL;
+        char *grown = (char*)realloc(prefix, encoded_entry_max(loc.key_length, ext));
+        if (!grown) {
+            ok = false;
+            break;
+        }
+        prefix = grown;
+
+        // Write entry header, key and padding, then the value
+        size_t prefix_length = encode_entry(prefix, new_header.kv_offset + new_header.kv_size,
+                                            current_key, loc.key_length, loc.value_length, ext);
+        if (fwrite(prefix, 1, prefix_length, temp) != prefix_length ||
+            fwrite(current_value, 1, loc.value_length, temp) != loc.value_length) {
+            ok = false;
+            break;
+        }
+
+        new_header.kv_size += prefix_length + loc.value_length;
+    }
+
+    free(current_key);
+    free(current_value);
+    free(prefix);
+    reader_free(&reader);
+
+    if (!ok) {
+        fclose(temp);
+        return false;
+    }
+
+    // Update header, then clone the raw data into place
+    new_header.raw_offset = sizeof(blf_header_t) + new_header.kv_size;
+    if (new_header.raw_size > 0) {
+        new_header.raw_offset = align_up(new_header.raw_offset, BLF_RAW_ALIGN);
+    }
+
+    // Seek to beginning of temp file and write updated header
+    if (fseek(temp, 0, SEEK_SET) != 0 ||
+        fwrite(&new_header, sizeof(blf_header_t), 1, temp) != 1 ||
+        fflush(temp) != 0 || fflush(file->fp) != 0) {
+        fclose(temp);
+        return false;
+    }
+
+    if (!copy_range(fileno(file->fp), file->header.raw_offset, fileno(temp),
+                    new_header.raw_offset, new_header.raw_size)) {
+        fclose(temp);
+        return false;
+    }
+    uint64_t new_size = new_header.raw_size > 0 ? new_header.raw_offset + new_header.raw_size
+                                                : sizeof(blf_header_t) + new_header.kv_size;
+
+    // Every entry moves, so the key index is rebuilt on the next lookup
+    index_free(file);
+
+    // The mapping cannot survive the file being truncated
+    uint64_t map_growth = file->map ? file->map->growth : 0;
+    if (file->map) {
+        munmap(file->map->base, file->map->capacity);
+        free(file->map);
+        file->map = NULL;
+    }
+
+    // Close original file
+    fclose(file->fp);
+
+    // Reopen original file and overwrite with temp file contents
+    file->fp = fopen(file->filename, "wb+");
+    if (!file->fp) {
+        fclose(temp);
+        return false;
+    }
+
+    // Copy temp file to original file; on file systems with reflinks this
+    // only shares its extents
+    bool copied = copy_range(fileno(temp), 0, fileno(file->fp), 0, new_size);
+    fclose(temp);
+    if (!copied) {
+        return false;
+    }
+
+    // Update file header in memory
+    file->header = new_header;
+
+    if (!blf_flush(file)) {
+        return false;
+    }
+    return map_growth == 0 || blf_map(file, map_growth);
+}
+
+// Delete a key-value pair; its extent becomes free space
+static bool delete_kv(blf_file_t *file, const char *key, uint32_t key_length) {
+    kv_loc_t target;
+    if (!find_key(file, key, key_length, &target)) {
+        return true;
+    }
+
+    // Files with the short header are rewritten, which upgrades them
+    if (file->header.version < BLF_VERSION_INDEX) {
+        return rewrite_kv(file, target.offset);
+    }
+    return release_entry(file, key, key_length, &target);
+}
+
+// With the value cache enabled, file access is serialized
+static void io_lock(blf_file_t *file) {
+    if (file->cache) {
+        pthread_mutex_lock(&file->cache->io_lock);
+    }
+}
+
+static void io_unlock(blf_file_t *file) {
+    if (file->cache) {
+        pthread_mutex_unlock(&file->cache->io_lock);
+    }
+}
+
+// Drop a key's cached value before it is changed
+static void cache_drop(blf_file_t *file, const char *key, uint32_t key_length) {
+    if (file->cache) {
+        cache_invalidate(file->cache, hash_key(key, key_length), key, key_length);
+    }
+}
+
+// Public KV operations; with the value cache enabled, file access is
+// serialized and puts and deletes invalidate the cached value
+bool blf_put_kv(blf_file_t *file, const char *key, const void *value, uint32_t value_length) {
+    return key && blf_put_kv_n(file, key, (uint32_t)strlen(key), value, value_length);
+}
+
+bool blf_put_kv_n(blf_file_t *file, const char *key, uint32_t key_length,
+                  const void *value, uint32_t value_length) {
+    // Longer keys would run into the entry flags
+    if (!file || !file->fp || !key || !value || key_length > BLF_KV_KEY_MASK) {
+        return false;
+    }
+
+    io_lock(file);
+    cache_drop(file, key, key_length);
+    bool result = put_kv(file, key, key_length, value, value_length, NULL);
+    io_unlock(file);
+    return result;
+}
+
+bool blf_get_kv(blf_file_t *file, const char *key, void *value, uint32_t *value_length) {
+    return key && blf_get_kv_n(file, key, (uint32_t)strlen(key), value, value_length);
+}
+
+bool blf_get_kv_n(blf_file_t *file, const char *key, uint32_t key_length,
+                  void *value, uint32_t *value_length) {
+    if (!file || !file->fp || !key || !value_length) {
+        return false;
+    }
+
+    if (!file->cache) {
+        return get_kv(file, key, key_length, value, value_length);
+    }
+
+    uint64_t hash = hash_key(key, key_length);
+    blf_cache_shard_t *shard = cache_shard(file->cache, hash);
+
+    pthread_mutex_lock(&shard->lock);
+    blf_cache_entry_t *entry = *cache_lookup(shard, hash, key, key_length);
+    if (entry) {
+        shard->hits++;
+        cache_unlink(shard, entry);
+        cache_push_front(shard, entry);
+
+        bool fits = *value_length >= entry->value_length;
+        if (fits && entry->value_length > 0) {
+            memcpy(value, entry->data + key_length, entry->value_length);
+        }
+        *value_length = entry->value_length;
+        pthread_mutex_unlock(&shard->lock);
+        return fits;
+    }
+    shard->misses++;
+    pthread_mutex_unlock(&shard->lock);
+
+    // Holding the I/O lock until the value is cached keeps a concurrent put
+    // from being overtaken by a stale insert
+    pthread_mutex_lock(&file->cache->io_lock);
+    bool result = get_kv(file, key, key_length, value, value_length);
+    if (result) {
+        cache_insert(file->cache, hash, key, key_length, value, *value_length);
+    }
+    pthread_mutex_unlock(&file->cache->io_lock);
+    return result;
+}
+
+// Requested key of a multi-get. Duplicate keys point at the first
+// request for the same key, which is the only one looked up.
+typedef struct {
+    const char *key;
+    uint32_t key_length;
+    uint64_t hash;
+    size_t primary;
+} many_request_t;
+
+// Candidate entry for a request, from an index fingerprint match
+typedef struct {
+    uint64_t offset;
+    size_t request;
+} many_candidate_t;
+
+typedef struct {
+    blf_file_t *file;
+    many_request_t *requests;
+    blf_get_result_t *results;
+    size_t *table;       // Open-addressing table of unique requests
+    size_t table_mask;
+    size_t remaining;    // Unique keys not found yet
+    char *arena;
+    uint64_t capacity;
+    uint64_t used;       // Arena bytes used, or needed once it overflowed
+} many_t;
+
+#define BLF_MANY_EMPTY ((size_t)-1)
+#define BLF_MANY_GAP 4096   // Largest gap between entries read together
+#define BLF_MANY_TAIL 512   // Bytes read for the last entry of a run
+
+// Find the unique request for a key
+static size_t many_lookup(const many_t *m, uint64_t hash, const char *key, uint32_t key_length) {
+    for (size_t slot = hash & m->table_mask; m->table[slot] != BLF_MANY_EMPTY; slot = (slot + 1) & m->table_mask) {
+        const many_request_t *req = &m->requests[m->table[slot]];
+        if (req->hash == hash && req->key_length == key_length && memcmp(req->key, key, key_length) == 0) {
+            return m->table[slot];
+        }
+    }
+    return BLF_MANY_EMPTY;
+}
+
+// Reserve arena space for a found value; returns NULL once the arena is full
+static char *many_claim(many_t *m, size_t request, uint32_t length) {
+    blf_get_result_t *result = &m->results[request];
+    result->found = true;
+    result->offset = m->used;
+    result->length = length;
+    m->remaining--;
+
+    bool fits = m->used <= m->capacity && length <= m->capacity - m->used;
+    m->used += length;
+    return fits ? m->arena + result->offset : NULL;
+}
+
+static int compare_candidate(const void *a, const void *b) {
+    const many_candidate_t *ca = (const many_candidate_t*)a;
+    const many_candidate_t *cb = (const many_candidate_t*)b;
+    if (ca->offset != cb->offset) {
+        return ca->offset < cb->offset ? -1 : 1;
+    }
+    return ca->request < cb->request ? -1 : ca->request > cb->request;
+}
+
+// Parse an entry's headers and key from buf; false if buf does not hold them
+static bool parse_entry(const char *buf, size_t avail, uint64_t offset, kv_loc_t *loc, const char **key) {
+    blf_kv_entry_t entry;
+    if (avail < sizeof(blf_kv_entry_t)) {
+        return false;
+    }
+    memcpy(&entry, buf, sizeof(blf_kv_entry_t));
+
+    uint64_t header_size = entry_header_size(entry.key_length);
+    loc->offset = offset;
+    loc->flags = entry.key_length & ~BLF_KV_KEY_MASK;
+    loc->key_length = entry.key_length & BLF_KV_KEY_MASK;
+    loc->value_length = entry.value_length;
+    if (avail < header_size + loc->key_length) {
+        return false;
+    }
+
+    memset(&loc->ext, 0, sizeof(blf_kv_ext_t));
+    if (entry.key_length & BLF_KV_FLAG_EXT) {
+        memcpy(&loc->ext, buf + sizeof(blf_kv_entry_t), sizeof(blf_kv_ext_t));
+    }
+    *key = buf + header_size;
+    loc->value_offset = offset + header_size + loc->key_length + loc->ext.pad;
+    return true;
+}
+
+// Indexed multi-get: collect the fingerprint matches of all keys, sort them
+// by offset and read runs of nearby entries with one positioned read each
+static bool many_indexed(many_t *m, size_t n) {
+    blf_index_t *index = m->file->index;
+    uint64_t mask = index->bucket_count - 1;
+
+    size_t count = 0;
+    size_t capacity = n;
+    uint32_t max_key_length = 0;
+    many_candidate_t *candidates = (many_candidate_t*)malloc(capacity * sizeof(many_candidate_t));
+    if (!candidates) {
+        return false;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (m->requests[i].primary != i) {
+            continue;
+        }
+        if (m->requests[i].key_length > max_key_length) {
+            max_key_length = m->requests[i].key_length;
+        }
+        uint64_t h = m->requests[i].hash;
+        uint32_t fp = hash_fingerprint(h);
+        for (uint64_t b = h & mask, probes = 0; probes <= mask; b = (b + 1) & mask, probes++) {
+            const blf_index_bucket_t *bucket = &index->buckets[b];
+            for (uint32_t matches = fp_match(bucket->fps, fp); matches; matches &= matches - 1) {
+                if (count == capacity) {
+                    capacity *= 2;
+                    many_candidate_t *grown = (many_candidate_t*)realloc(candidates, capacity * sizeof(many_candidate_t));
+                    if (!grown) {
+                        free(candidates);
+                        return false;
+                    }
+                    candidates = grown;
+                }
+                candidates[count].offset = bucket->offsets[__builtin_ctz(matches)];
+                candidates[count].request = i;
+                count++;
+            }
+            if (fp_match(bucket->fps, 0)) {
+                break;
+            }
+        }
+    }
+
+    qsort(candidates, count, sizeof(many_candidate_t), compare_candidate);
+
+    char *window = (char*)malloc(BLF_READER_SIZE);
+    char *header = (char*)malloc(sizeof(blf_kv_entry_t) + sizeof(blf_kv_ext_t) + max_key_length);
+    bool ok = window && header;
+    uint64_t kv_end = m->file->header.kv_offset + m->file->header.kv_size;
+
+    for (size_t i = 0; ok && i < count; ) {
+        // A run of nearby candidates, read together up to a guess of the
+        // last entry's size
+        uint64_t start = candidates[i].offset;
+        size_t j = i + 1;
+        while (j < count && candidates[j].offset - candidates[j - 1].offset <= BLF_MANY_GAP &&
+               candidates[j].offset - start <= BLF_READER_SIZE - BLF_MANY_TAIL) {
+            j++;
+        }
+        uint64_t end = candidates[j - 1].offset + BLF_MANY_TAIL;
+        if (end > kv_end) {
+            end = kv_end;
+        }
+
+        ssize_t got = start < end ? read_some_at(m->file, start, window, (size_t)(end - start)) : 0;
+        if (got < 0) {
+            ok = false;
+            break;
+        }
+
+        for (; ok && i < j; i++) {
+            const many_candidate_t *cand = &candidates[i];
+            const many_request_t *req = &m->requests[cand->request];
+            if (m->results[cand->request].found) {
+                continue;
+            }
+
+            kv_loc_t loc;
+            const char *key;
+            uint64_t at = cand->offset - start;
+            if (at >= (uint64_t)got || !parse_entry(window + at, (size_t)(got - at), cand->offset, &loc, &key)) {
+                // The entry runs past the window
+                size_t want = sizeof(blf_kv_entry_t) + sizeof(blf_kv_ext_t) + req->key_length;
+                ssize_t got_header = read_some_at(m->file, cand->offset, header, want);
+                if (got_header < 0 || !parse_entry(header, (size_t)got_header, cand->offset, &loc, &key)) {
+                    continue;
+                }
+            }
+            if (loc.key_length != req->key_length || memcmp(key, req->key, req->key_length) != 0) {
+                continue;
+            }
+
+            char *dst = many_claim(m, cand->request, loc.value_length);
+            if (!dst) {
+                continue;
+            }
+
+            // Copy what the window holds and read the rest
+            uint64_t value_at = loc.value_offset - start;
+            uint64_t copied = 0;
+            if (value_at < (uint64_t)got) {
+                copied = (uint64_t)got - value_at < loc.value_length ? (uint64_t)got - value_at : loc.value_length;
+                memcpy(dst, window + value_at, copied);
+            }
+            if (copied < loc.value_length) {
+                ok = read_at(m->file, loc.value_offset + copied, dst + copied, loc.value_length - copied);
+            }
+        }
+    }
+
+    free(header);
+    free(window);
+    free(candidates);
+    return ok;
+}
+
+// Unindexed multi-get: one sequential pass over the KV section, matching
+// every entry against the hashed request set
+static bool many_scan(many_t *m) {
+    blf_file_t *file = m->file;
+    uint64_t end_offset = file->header.kv_offset + file->header.kv_size;
+    reader_t reader;
+    if (!reader_init(&reader, file, file->header.kv_offset, end_offset)) {
+        return false;
+    }
+
+    char *key = NULL;
+    uint32_t key_capacity = 0;
+    bool ok = true;
+
+    while (m->remaining > 0 && reader_tell(&reader) < end_offset) {
+        kv_loc_t loc;
+        if (!reader_next_entry(&reader, &loc, &key, &key_capacity)) {
+            ok = false;
+            break;
+        }
+
+        size_t request = loc.flags & BLF_KV_FLAG_FREE
+            ? BLF_MANY_EMPTY : many_lookup(m, hash_key(key, loc.key_length), key, loc.key_length);
+        char *dst = request == BLF_MANY_EMPTY || m->results[request].found
+            ? NULL : many_claim(m, request, loc.value_length);
+        if (dst) {
+            if (!reader_read(&reader, dst, loc.value_length)) {
+                ok = false;
+                break;
+            }
+        } else {
+            reader_skip(&reader, loc.value_length);
+        }
+    }
+
+    free(key);
+    reader_free(&reader);
+    return ok;
+}
+
+// Look up many keys with a single pass. Without key_lengths, the keys are
+// NUL-terminated.
+static bool get_many(blf_file_t *file, const char *const keys[], const uint32_t key_lengths[], size_t n,
+                     blf_get_result_t results[], void *arena, uint64_t *arena_size) {
+    if (!file || !file->fp || (n > 0 && (!keys || !results)) || !arena_size || (!arena && *arena_size > 0)) {
+        return false;
+    }
+
+    many_t m;
+    memset(&m, 0, sizeof(many_t));
+    m.file = file;
+    m.results = results;
+    m.arena = (char*)arena;
+    m.capacity = *arena_size;
+
+    size_t table_size = 16;
+    while (table_size < n * 2) {
+        table_size *= 2;
+    }
+    m.table_mask = table_size - 1;
+    m.requests = (many_request_t*)malloc((n ? n : 1) * sizeof(many_request_t));
+    m.table = (size_t*)malloc(table_size * sizeof(size_t));
+    if (!m.requests || !m.table) {
+        free(m.requests);
+        free(m.table);
+        return false;
+    }
+
+    // Hash the request set
+    memset(m.table, 0xFF, table_size * sizeof(size_t));
+    bool ok = true;
+    for (size_t i = 0; i < n; i++) {
+        memset(&results[i], 0, sizeof(blf_get_result_t));
+        if (!keys[i]) {
+            ok = false;
+            break;
+        }
+
+        size_t key_length = key_lengths ? key_lengths[i] : strlen(keys[i]);
+        if (key_length > BLF_KV_KEY_MASK) {
+            ok = false;
+            break;
+        }
+
+        many_request_t *req = &m.requests[i];
+        req->key = keys[i];
+        req->key_length = (uint32_t)key_length;
+        req->hash = hash_key(req->key, req->key_length);
+        req->primary = many_lookup(&m, req->hash, req->key, req->key_length);
+        if (req->primary == BLF_MANY_EMPTY) {
+            req->primary = i;
+            size_t slot = req->hash & m.table_mask;
+            while (m.table[slot] != BLF_MANY_EMPTY) {
+                slot = (slot + 1) & m.table_mask;
+            }
+            m.table[slot] = i;
+            m.remaining++;
+        }
+    }
+
+    if (ok && file->header.kv_size > 0) {
+        io_lock(file);
+        if (file->index || index_load(file)) {
+            ok = many_indexed(&m, n);
+        } else {
+            ok = many_scan(&m);
+        }
+        io_unlock(file);
+    }
+
+    // Duplicate keys share the value of the first request
+    for (size_t i = 0; ok && i < n; i++) {
+        if (m.requests[i].primary != i) {
+            results[i] = results[m.requests[i].primary];
+        }
+    }
+
+    free(m.requests);
+    free(m.table);
+
+    if (!ok) {
+        return false;
+    }
+    bool fits = m.used <= m.capacity;
+    *arena_size = m.used;
+    return fits;
+}
+
+bool blf_get_many(blf_file_t *file, const char *const keys[], size_t n,
+                  blf_get_result_t results[], void *arena, uint64_t *arena_size) {
+    return get_many(file, keys, NULL, n, results, arena, arena_size);
+}
+
+bool blf_get_many_n(blf_file_t *file, const char *const keys[], const uint32_t key_lengths[], size_t n,
+                    blf_get_result_t results[], void *arena, uint64_t *arena_size) {
+    return (n == 0 || key_lengths) && get_many(file, keys, key_lengths, n, results, arena, arena_size);
+}
+
+bool blf_delete_kv(blf_file_t *file, const char *key) {
+    return key && blf_delete_kv_n(file, key, (uint32_t)strlen(key));
+}
+
+bool blf_delete_kv_n(blf_file_t *file, const char *key, uint32_t key_length) {
+    if (!file || !file->fp || !key) {
+        return false;
+    }
+
+    io_lock(file);
+    cache_drop(file, key, key_length);
+    bool result = delete_kv(file, key, key_length);
+    io_unlock(file);
+    return result;
+}
+
+// Point at a value in the mapping instead of copying it out
+bool blf_get_kv_view(blf_file_t *file, const char *key, uint32_t key_length,
+                     const void **value, uint32_t *value_length) {
+    if (!file || !file->fp || !file->map || !key || !value || !value_length) {
+        return false;
+    }
+
+    kv_loc_t loc;
+    io_lock(file);
+    bool result = find_key(file, key, key_length, &loc);
+    if (result) {
+        *value = file->map->base + loc.value_offset;
+        *value_length = loc.value_length;
+    }
+    io_unlock(file);
+    return result;
+}
+
+// Report the free space of the KV section
+bool blf_free_stats(blf_file_t *file, blf_free_stats_t *stats) {
+    if (!file || !file->fp || !stats) {
+        return false;
+    }
+
+    io_lock(file);
+    memset(stats, 0, sizeof(blf_free_stats_t));
+    stats->kv_size = file->header.kv_size;
+    bool ok = file->header.kv_size == 0 || file->index || index_load(file) || index_build(file);
+    if (ok && file->index) {
+        const blf_index_t *index = file->index;
+        stats->free_bytes = index->free_bytes;
+        stats->free_extents = index->free_count;
+        for (int c = BLF_FREE_CLASSES - 1; c >= 0 && stats->largest_extent == 0; c--) {
+            const free_list_t *list = &index->free_lists[c];
+            for (size_t i = 0; i < list->count; i++) {
+                if (list->extents[i].size > stats->largest_extent) {
+                    stats->largest_extent = list->extents[i].size;
+                }
+            }
+        }
+        if (stats->free_bytes > 0) {
+            stats->fragmentation = 1.0 - (double)stats->largest_extent / (double)stats->free_bytes;
+        }
+    }
+    io_unlock(file);
+    return ok;
+}
+
+// Rewrite the file without its free space
+bool blf_compact(blf_file_t *file) {
+    if (!file || !file->fp) {
+        return false;
+    }
+
+    io_lock(file);
+    bool result = rewrite_kv(file, UINT64_MAX);
+    io_unlock(file);
+    return result;
+}
+
+// Copy src to dst, sharing extents where the file system supports reflinks
+bool blf_clone(const char *src, const char *dst) {
+    if (!src || !dst) {
+        return false;
+    }
+
+    int in = open(src, O_RDONLY | O_CLOEXEC);
+    struct stat src_st;
+    if (in < 0 || fstat(in, &src_st) != 0) {
+        if (in >= 0) close(in);
+        return false;
+    }
+
+    // Truncate only once dst is known not to be src itself
+    int out = open(dst, O_WRONLY | O_CREAT | O_CLOEXEC, src_st.st_mode & 0777);
+    struct stat dst_st;
+    bool ok = out >= 0 && fstat(out, &dst_st) == 0 &&
+              (dst_st.st_dev != src_st.st_dev || dst_st.st_ino != src_st.st_ino) &&
+              ftruncate(out, 0) == 0;
+    if (ok) {
+#ifdef FICLONE
+        bool cloned = ioctl(out, FICLONE, in) == 0;
+#else
+        bool cloned = false;
+#endif
+        ok = (cloned || copy_range(in, 0, out, 0, (uint64_t)src_st.st_size)) && fdatasync(out) == 0;
+    }
+
+    if (out >= 0 && close(out) != 0) {
+        ok = false;
+    }
+    close(in);
+    return ok;
+}
+
+// Visit entries in file order from a cursor
+bool blf_scan(blf_file_t *file, uint64_t *cursor, blf_scan_fn fn, void *user) {
+    if (!file || !file->fp || !cursor || !fn) {
+        return false;
+    }
+    if (*cursor == BLF_SCAN_END) {
+        return true;
+    }
+    if (*cursor > file->header.kv_size) {
+        return false;
+    }
+
+    io_lock(file);
+    uint64_t end_offset = file->header.kv_offset + file->header.kv_size;
+    reader_t reader;
+    if (!reader_init(&reader, file, file->header.kv_offset + *cursor, end_offset)) {
+        io_unlock(file);
+        return false;
+    }
+
+    char *key = NULL;
+    uint32_t key_capacity = 0;
+    char *value = NULL;
+    uint32_t value_capacity = 0;
+    bool ok = true;
+    uint64_t next = BLF_SCAN_END;
+
+    while (reader_tell(&reader) < end_offset) {
+        kv_loc_t loc;
+        if (!reader_next_entry(&reader, &loc, &key, &key_capacity)) {
+            ok = false;
+            break;
+        }
+        if (loc.flags & BLF_KV_FLAG_FREE) {
+            reader_skip(&reader, loc.value_length);
+            continue;
+        }
+
+        if (loc.value_length > value_capacity) {
+            char *grown = (char*)realloc(value, loc.value_length);
+            if (!grown) {
+                ok = false;
+                break;
+            }
+            value = grown;
+            value_capacity = loc.value_length;
+        }
+        if (!reader_read(&reader, value, loc.value_length)) {
+            ok = false;
+            break;
+        }
+
+        if (!fn(user, key, loc.key_length, value, loc.value_length)) {
+            next = reader_tell(&reader) - file->header.kv_offset;
+            break;
+        }
+    }
+
+    free(key);
+    free(value);
+    reader_free(&reader);
+    io_unlock(file);
+
+    if (ok) {
+        *cursor = next;
+    }
+    return ok;
+}
+
+// Copy entries into the arena until max_entries, the arena or the KV
+// section runs out
+bool blf_scan_batch(blf_file_t *file, uint64_t *cursor, blf_scan_entry_t entries[], size_t max_entries,
+                    size_t *count, void *arena, uint64_t *arena_size) {
+    if (!file || !file->fp || !cursor || !count || (max_entries > 0 && !entries) ||
+        !arena_size || (!arena && *arena_size > 0)) {
+        return false;
+    }
+    *count = 0;
+    if (*cursor == BLF_SCAN_END) {
+        *arena_size = 0;
+        return true;
+    }
+    if (*cursor > file->header.kv_size) {
+        return false;
+    }
+
+    io_lock(file);
+    uint64_t end_offset = file->header.kv_offset + file->header.kv_size;
+    reader_t reader;
+    if (!reader_init(&reader, file, file->header.kv_offset + *cursor, end_offset)) {
+        io_unlock(file);
+        return false;
+    }
+
+    char *key = NULL;
+    uint32_t key_capacity = 0;
+    char *out = (char*)arena;
+    uint64_t used = 0;
+    uint64_t needed = 0;  // Size of a first entry that does not fit
+    bool ok = true;
+    uint64_t next = BLF_SCAN_END;
+
+    while (reader_tell(&reader) < end_offset) {
+        if (*count == max_entries) {
+            next = reader_tell(&reader) - file->header.kv_offset;
+            break;
+        }
+
+        kv_loc_t loc;
+        if (!reader_next_entry(&reader, &loc, &key, &key_capacity)) {
+            ok = false;
+            break;
+        }
+        if (loc.flags & BLF_KV_FLAG_FREE) {
+            reader_skip(&reader, loc.value_length);
+            continue;
+        }
+
+        // The value is read straight into the arena
+        uint64_t size = (uint64_t)loc.key_length + loc.value_length;
+        if (size > *arena_size - used) {
+            next = loc.offset - file->header.kv_offset;
+            needed = *count == 0 ? size : 0;
+            break;
+        }
+        memcpy(out + used, key, loc.key_length);
+        if (!reader_read(&reader, out + used + loc.key_length, loc.value_length)) {
+            ok = false;
+            break;
+        }
+
+        entries[*count].offset = used;
+        entries[*count].key_length = loc.key_length;
+        entries[*count].value_length = loc.value_length;
+        (*count)++;
+        used += size;
+    }
+
+    free(key);
+    reader_free(&reader);
+    io_unlock(file);
+
+    if (!ok) {
+        *count = 0;
+        return false;
+    }
+    if (needed > 0) {
+        *arena_size = needed;
+        return false;
+    }
+    *cursor = next;
+    *arena_size = used;
+    return true;
+}
+
+// Length of a NUL-terminated key; false if it would run into the entry flags
+static bool key_length_of(const char *key, uint32_t *key_length) {
+    size_t length = strlen(key);
+    *key_length = (uint32_t)length;
+    return length <= BLF_KV_KEY_MASK;
+}
+
+// Store an 8-byte typed value
+static bool put_typed(blf_file_t *file, const char *key, blf_type_t type, const void *value) {
+    uint32_t key_length;
+    if (!file || !file->fp || !key || !key_length_of(key, &key_length)) {
+        return false;
+    }
+
+    blf_kv_ext_t ext = { (uint8_t)type, BLF_TYPED_ALIGN_LOG2, 0, 1 };
+
+    io_lock(file);
+    cache_drop(file, key, key_length);
+    bool result = put_kv(file, key, key_length, value, 8, &ext);
+    io_unlock(file);
+    return result;
+}
+
+// Read an 8-byte typed value
+static bool get_typed(blf_file_t *file, const char *key, blf_type_t type, void *value) {
+    uint32_t key_length;
+    if (!file || !file->fp || !key || !value || !key_length_of(key, &key_length)) {
+        return false;
+    }
+
+    kv_loc_t loc;
+
+    io_lock(file);
+    bool result = find_key(file, key, key_length, &loc) && loc.ext.type == type &&
+                  loc.value_length == 8 && read_at(file, loc.value_offset, value, 8);
+    io_unlock(file);
+    return result;
+}
+
+bool blf_put_u64(blf_file_t *file, const char *key, uint64_t value) {
+    return put_typed(file, key, BLF_TYPE_U64, &value);
+}
+
+bool blf_put_f64(blf_file_t *file, const char *key, double value) {
+    return put_typed(file, key, BLF_TYPE_F64, &value);
+}
+
+bool blf_get_u64(blf_file_t *file, const char *key, uint64_t *value) {
+    return get_typed(file, key, BLF_TYPE_U64, value);
+}
+
+bool blf_get_f64(blf_file_t *file, const char *key, double *value) {
+    return get_typed(file, key, BLF_TYPE_F64, value);
+}
+
+// Element size of a value type; 0 for untyped bytes and unknown types
+size_t blf_type_size(blf_type_t type) {
+    switch (type) {
+    case BLF_TYPE_U64:
+    case BLF_TYPE_F64:
+    case BLF_TYPE_I64:
+        return 8;
+    case BLF_TYPE_U32:
+    case BLF_TYPE_I32:
+    case BLF_TYPE_F32:
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+// Store a typed array with an aligned first element
+bool blf_put_array(blf_file_t *file, const char *key, blf_type_t type,
+                   const void *data, uint32_t count, uint32_t alignment) {
+    size_t size = blf_type_size(type);
+    uint32_t key_length;
+    if (!file || !file->fp || !key || !key_length_of(key, &key_length) || size == 0 ||
+        (!data && count > 0) || (uint64_t)count * size > UINT32_MAX) {
+        return false;
+    }
+
+    uint8_t align_log2 = BLF_TYPED_ALIGN_LOG2;
+    if (alignment != 0) {
+        if (alignment < 8 || alignment > 64 || (alignment & (alignment - 1)) != 0) {
+            return false;
+        }
+        align_log2 = (uint8_t)__builtin_ctz(alignment);
+    }
+
+    blf_kv_ext_t ext = { (uint8_t)type, align_log2, 0, count };
+
+    io_lock(file);
+    cache_drop(file, key, key_length);
+    bool result = put_kv(file, key, key_length, data, (uint32_t)(count * size), &ext);
+    io_unlock(file);
+    return result;
+}
+
+// Locate a typed array (or typed scalar, an array of one)
+bool blf_get_array(blf_file_t *file, const char *key, blf_array_t *array) {
+    uint32_t key_length;
+    if (!file || !file->fp || !key || !array || !key_length_of(key, &key_length)) {
+        return false;
+    }
+
+    kv_loc_t loc;
+
+    io_lock(file);
+    bool result = find_key(file, key, key_length, &loc) && (loc.flags & BLF_KV_FLAG_EXT) &&
+                  blf_type_size((blf_type_t)loc.ext.type) != 0;
+    if (result) {
+        array->type = (blf_type_t)loc.ext.type;
+        array->count = loc.ext.count;
+        array->alignment = 1u << loc.ext.align_log2;
+        array->offset = loc.value_offset;
+        array->data = file->map ? file->map->base + loc.value_offset : NULL;
+    }
+    io_unlock(file);
+    return result;
+}
+
+// Add delta to a u64 counter, creating it if it does not exist. An existing
+// counter is updated with a single 8-byte positioned write.
+bool blf_incr_u64(blf_file_t *file, const char *key, uint64_t delta, uint64_t *result) {
+    uint32_t key_length;
+    if (!file || !file->fp || !key || !key_length_of(key, &key_length)) {
+        return false;
+    }
+
+    kv_loc_t loc;
+    uint64_t value = delta;
+    bool ok;
+
+    io_lock(file);
+    cache_drop(file, key, key_length);
+    if (find_key(file, key, key_length, &loc)) {
+        ok = loc.ext.type == BLF_TYPE_U64 && loc.value_length == 8;
+        if (ok && file->map && loc.value_offset % 8 == 0) {
+            // Atomic on the shared mapping, so other processes mapping the
+            // file see consistent counts
+            uint64_t *counter = (uint64_t*)(file->map->base + loc.value_offset);
+            value = __atomic_add_fetch(counter, delta, __ATOMIC_SEQ_CST);
+            map_dirty(file->map, loc.value_offset, 8);
+        } else if (ok && read_at(file, loc.value_offset, &value, 8)) {
+            value += delta;
+            ok = write_at(file, loc.value_offset, &value, 8);
+        }
+    } else {
+        blf_kv_ext_t ext = { BLF_TYPE_U64, BLF_TYPED_ALIGN_LOG2, 0, 1 };
+        ok = add_entry(file, key, key_length, &value, 8, &ext);
+    }
+    io_unlock(file);
+
+    if (ok && result) {
+        *result = value;
+    }
+    return ok;
+}
+
+// Enable O_DIRECT transfers for the raw section
+bool blf_direct_enable(blf_file_t *file, size_t buffer_size) {
+    if (!file || !file->fp || file->direct) {
+        return false;
+    }
+
+    blf_direct_t *direct = (blf_direct_t*)calloc(1, sizeof(blf_direct_t));
+    if (!direct) {
+        return false;
+    }
+
+    direct->buffer_size = align_up(buffer_size ? buffer_size : BLF_DIRECT_BUFFER, BLF_RAW_ALIGN);
+    direct->fd = open(file->filename, O_RDWR | O_DIRECT | O_CLOEXEC);
+    if (direct->fd < 0) {
+        free(direct);
+        return false;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (posix_memalign((void**)&direct->buffers[i], BLF_RAW_ALIGN, direct->buffer_size) != 0) {
+            direct->buffers[i] = NULL;
+            file->direct = direct;
+            blf_direct_disable(file);
+            return false;
+        }
+    }
+
+    file->direct = direct;
+    return true;
+}
+
+// Go back to buffered raw transfers
+void blf_direct_disable(blf_file_t *file) {
+    if (!file || !file->direct) {
+        return;
+    }
+
+    close(file->direct->fd);
+    free(file->direct->buffers[0]);
+    free(file->direct->buffers[1]);
+    free(file->direct);
+    file->direct = NULL;
+}
+
+// Transfer len bytes at offset on an O_DIRECT descriptor; returns 0 or an
+// errno value
+static int direct_io(int fd, bool write, char *buf, uint64_t len, uint64_t offset) {
+    uint64_t done = 0;
+    while (done < len) {
+        size_t chunk = len - done < (1ULL << 30) ? (size_t)(len - done) : (size_t)1 << 30;
+        ssize_t n = write ? pwrite(fd, buf + done, chunk, (off_t)(offset + done))
+                          : pread(fd, buf + done, chunk, (off_t)(offset + done));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        if (n == 0) {
+            return EIO;
+        }
+        done += (uint64_t)n;
+    }
+    return 0;
+}
+
+// Double-buffered transfer: an I/O thread works on one bounce buffer while
+// the caller copies into (or out of) the other
+typedef struct {
+    int fd;
+    bool write;
+    char *buffers[2];
+    uint64_t offsets[2];
+    uint64_t lengths[2];
+    uint64_t submitted;  // Chunks handed to the I/O thread
+    uint64_t completed;  // Chunks it has finished
+    bool stop;
+    int error;           // First failure
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} direct_pipe_t;
+
+static void *direct_worker(void *arg) {
+    direct_pipe_t *pipe = (direct_pipe_t*)arg;
+
+    pthread_mutex_lock(&pipe->lock);
+    for (;;) {
+        while (pipe->completed == pipe->submitted && !pipe->stop) {
+            pthread_cond_wait(&pipe->cond, &pipe->lock);
+        }
+        if (pipe->completed == pipe->submitted) {
+            break;
+        }
+
+        int slot = (int)(pipe->completed % 2);
+        bool skip = pipe->error != 0;
+        pthread_mutex_unlock(&pipe->lock);
+
+        int error = skip ? 0 : direct_io(pipe->fd, pipe->write, pipe->buffers[slot],
+                                         pipe->lengths[slot], pipe->offsets[slot]);
+
+        pthread_mutex_lock(&pipe->lock);
+        if (error && !pipe->error) {
+            pipe->error = error;
+        }
+        pipe->completed++;
+        pthread_cond_broadcast(&pipe->cond);
+    }
+    pthread_mutex_unlock(&pipe->lock);
+    return NULL;
+}
+
+static int direct_pipeline(blf_direct_t *direct, bool write, char *data, uint64_t offset, uint64_t len) {
+    direct_pipe_t pipe;
+    memset(&pipe, 0, sizeof(pipe));
+    pipe.fd = direct->fd;
+    pipe.write = write;
+    pipe.buffers[0] = direct->buffers[0];
+    pipe.buffers[1] = direct->buffers[1];
+    pthread_mutex_init(&pipe.lock, NULL);
+    pthread_cond_init(&pipe.cond, NULL);
+
+    pthread_t worker;
+    if (pthread_create(&worker, NULL, direct_worker, &pipe) != 0) {
+        pthread_cond_destroy(&pipe.cond);
+        pthread_mutex_destroy(&pipe.lock);
+        return EAGAIN;
+    }
+
+    uint64_t chunk = direct->buffer_size;
+    uint64_t chunks = (len + chunk - 1) / chunk;
+
+    pthread_mutex_lock(&pipe.lock);
+    if (write) {
+        for (uint64_t i = 0; i < chunks && !pipe.error; i++) {
+            // Wait for the buffer written two chunks ago
+            while (pipe.submitted - pipe.completed >= 2 && !pipe.error) {
+                pthread_cond_wait(&pipe.cond, &pipe.lock);
+            }
+            if (pipe.error) {
+                break;
+            }
+            pthread_mutex_unlock(&pipe.lock);
+
+            int slot = (int)(i % 2);
+            uint64_t length = len - i * chunk < chunk ? len - i * chunk : chunk;
+            memcpy(pipe.buffers[slot], data + i * chunk, length);
+            pipe.offsets[slot] = offset + i * chunk;
+            pipe.lengths[slot] = length;
+
+            pthread_mutex_lock(&pipe.lock);
+            pipe.submitted++;
+            pthread_cond_broadcast(&pipe.cond);
+        }
+    } else {
+        uint64_t copied = 0;
+        while (copied < chunks && !pipe.error) {
+            // Keep both buffers in flight
+            while (pipe.submitted < chunks && pipe.submitted - copied < 2) {
+                uint64_t i = pipe.submitted;
+                int slot = (int)(i % 2);
+                pipe.offsets[slot] = offset + i * chunk;
+                pipe.lengths[slot] = len - i * chunk < chunk ? len - i * chunk : chunk;
+                pipe.submitted++;
+                pthread_cond_broadcast(&pipe.cond);
+            }
+
+            while (pipe.completed <= copied && !pipe.error) {
+                pthread_cond_wait(&pipe.cond, &pipe.lock);
+            }
+            if (pipe.error) {
+                break;
+            }
+            pthread_mutex_unlock(&pipe.lock);
+
+            int slot = (int)(copied % 2);
+            memcpy(data + copied * chunk, pipe.buffers[slot], pipe.lengths[slot]);
+
+            pthread_mutex_lock(&pipe.lock);
+            copied++;
+        }
+    }
+    pipe.stop = true;
+    pthread_cond_broadcast(&pipe.cond);
+    pthread_mutex_unlock(&pipe.lock);
+
+    pthread_join(worker, NULL);
+    pthread_cond_destroy(&pipe.cond);
+    pthread_mutex_destroy(&pipe.lock);
+    return pipe.error;
+}
+
+// Move raw data between the file and memory. With direct I/O enabled, the
+// block-aligned middle of large transfers bypasses the page cache (straight
+// from the caller's memory when it is aligned, double-buffered otherwise);
+// unaligned edges and small transfers use buffered I/O.
+static bool raw_transfer(blf_file_t *file, bool write, uint64_t offset, void *data, uint64_t len) {
+    blf_direct_t *direct = file->direct;
+    uint64_t start = align_up(offset, BLF_RAW_ALIGN);
+    uint64_t end = (offset + len) / BLF_RAW_ALIGN * BLF_RAW_ALIGN;
+
+    if (!direct || file->map || end <= start || end - start < direct->buffer_size) {
+        return write ? write_at(file, offset, data, len) : read_at(file, offset, data, len);
+    }
+
+    if (fflush(file->fp) != 0) {
+        return false;
+    }
+
+    char *middle = (char*)data + (start - offset);
+    int error = (uintptr_t)middle % BLF_RAW_ALIGN == 0
+        ? direct_io(direct->fd, write, middle, end - start, start)
+        : direct_pipeline(direct, write, middle, start, end - start);
+
+    if (error == EINVAL) {
+        // The file system rejected O_DIRECT after all; stay buffered
+        blf_direct_disable(file);
+        return write ? write_at(file, offset, data, len) : read_at(file, offset, data, len);
+    }
+    if (error) {
+        return false;
+    }
+
+    uint64_t tail = offset + len - end;
+    if (write) {
+        return write_at(file, offset, data, start - offset) &&
+               write_at(file, end, middle + (end - start), tail);
+    }
+    return read_at(file, offset, data, start - offset) &&
+           read_at(file, end, middle + (end - start), tail);
+}
+
+// Write raw data (replaces existing raw data)
+bool blf_write_raw(blf_file_t *file, const void *data, uint64_t size) {
+    if (!file || !file->fp || !data) {
+        return false;
+    }
+    
+    // The section starts aligned after the KV section so that it can be
+    // transferred with direct I/O
+    uint64_t raw_offset = align_up(file->header.kv_offset + file->header.kv_size, BLF_RAW_ALIGN);
+    if (!index_protect(file, raw_offset + size)) {
+        return false;
+    }
+    
+    // Write raw data
+    if (!raw_transfer(file, true, raw_offset, (void*)data, size)) {
+        return false;
+    }
+    
+    // Update header
+    file->header.raw_offset = raw_offset;
+    file->header.raw_size = size;
+    
+    return blf_update_header(file) && blf_flush(file);
+}
+
+// Read raw data
+bool blf_read_raw(blf_file_t *file, void *data, uint64_t *size) {
+    if (!file || !file->fp || !data || !size) {
+        return false;
+    }
+    
+    // Check buffer size
+    if (*size < file->header.raw_size) {
+        *size = file->header.raw_size;
+        return false;
+    }
+    
+    // If there's no raw data
+    if (file->header.raw_size == 0) {
+        *size = 0;
+        return true;
+    }
+    
+    // Read raw data
+    if (!raw_transfer(file, false, file->header.raw_offset, data, file->header.raw_size)) {
+        return false;
+    }
+    
+    *size = file->header.raw_size;
+    return true;
+}
+
+// Clamp a read of *size bytes at offset to the raw section
+static bool raw_clamp(const blf_file_t *file, uint64_t offset, uint64_t *size) {
+    if (offset > file->header.raw_size) {
+        return false;
+    }
+    if (*size > file->header.raw_size - offset) {
+        *size = file->header.raw_size - offset;
+    }
+    return true;
+}
+
+// Read part of the raw section
+bool blf_read_raw_at(blf_file_t *file, uint64_t offset, void *data, uint64_t *size) {
+    if (!file || !file->fp || !data || !size) {
+        return false;
+    }
+
+    if (!raw_clamp(file, offset, size)) {
+        return false;
+    }
+
+    return *size == 0 || raw_transfer(file, false, file->header.raw_offset + offset, data, *size);
+}
+
+// Scatter read: segments that are contiguous in the file are read with a
+// single preadv
+bool blf_readv_raw(blf_file_t *file, blf_raw_iovec_t *iov, int count) {
+    if (!file || !file->fp || (!iov && count > 0)) {
+        return false;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (!iov[i].data || !raw_clamp(file, iov[i].offset, &iov[i].size)) {
+            return false;
+        }
+    }
+
+    struct iovec vec[64];
+    int i = 0;
+    while (i < count) {
+        uint64_t start = iov[i].offset;
+        uint64_t end = start;
+        int run = 0;
+
+        while (i + run < count && run < (int)(sizeof(vec) / sizeof(vec[0])) &&
+               iov[i + run].offset == end && iov[i + run].size <= SSIZE_MAX) {
+            vec[run].iov_base = iov[i + run].data;
+            vec[run].iov_len = (size_t)iov[i + run].size;
+            end += iov[i + run].size;
+            run++;
+        }
+
+        if (run <= 1 || file->map) {
+            // Single segments and mapped files are plain copies
+            run = run ? run : 1;
+            for (int j = 0; j < run; j++) {
+                if (iov[i + j].size > 0 &&
+                    !read_at(file, file->header.raw_offset + iov[i + j].offset, iov[i + j].data, iov[i + j].size)) {
+                    return false;
+                }
+            }
+        } else {
+            ssize_t n = preadv(fileno(file->fp), vec, run, (off_t)(file->header.raw_offset + start));
+            if (n < 0) {
+                return false;
+            }
+
+            // Finish a short read segment by segment
+            uint64_t done = (uint64_t)n;
+            for (int j = 0; j < run && done < end - start; j++) {
+                uint64_t seg_start = iov[i + j].offset - start;
+                uint64_t seg_end = seg_start + iov[i + j].size;
+                if (done >= seg_end) {
+                    continue;
+                }
+                uint64_t skip = done > seg_start ? done - seg_start : 0;
+                if (!read_at(file, file->header.raw_offset + iov[i + j].offset + skip,
+                             (char*)iov[i + j].data + skip, iov[i + j].size - skip)) {
+                    return false;
+                }
+                done = seg_end;
+            }
+        }
+
+        i += run;
+    }
+
+    return true;
+}
+
+// Pass an access pattern hint for part of the raw section to the kernel
+bool blf_raw_advise(blf_file_t *file, uint64_t offset, uint64_t length, blf_advice_t advice) {
+    if (!file || !file->fp || offset > file->header.raw_size) {
+        return false;
+    }
+
+    if (length == 0 || length > file->header.raw_size - offset) {
+        length = file->header.raw_size - offset;
+    }
+    if (length == 0) {
+        return true;
+    }
+
+    int fadvice;
+    int madvice;
+    switch (advice) {
+    case BLF_ADVICE_SEQUENTIAL: fadvice = POSIX_FADV_SEQUENTIAL; madvice = MADV_SEQUENTIAL; break;
+    case BLF_ADVICE_RANDOM:     fadvice = POSIX_FADV_RANDOM;     madvice = MADV_RANDOM;     break;
+    case BLF_ADVICE_WILLNEED:   fadvice = POSIX_FADV_WILLNEED;   madvice = MADV_WILLNEED;   break;
+    case BLF_ADVICE_DONTNEED:   fadvice = POSIX_FADV_DONTNEED;   madvice = MADV_NORMAL;     break;
+    default:                    fadvice = POSIX_FADV_NORMAL;     madvice = MADV_NORMAL;     break;
+    }
+
+    uint64_t start = file->header.raw_offset + offset;
+    if (file->map) {
+        // madvise needs a page-aligned start
+        uint64_t page_size = (uint64_t)sysconf(_SC_PAGESIZE);
+        uint64_t aligned = start / page_size * page_size;
+        if (madvise(file->map->base + aligned, length + (start - aligned), madvice) != 0) {
+            return false;
+        }
+    }
+
+    return posix_fadvise(fileno(file->fp), (off_t)start, (off_t)length, fadvice) == 0;
+}
+
+static int compare_patch(const void *a, const void *b) {
+    const blf_raw_patch_t *pa = *(const blf_raw_patch_t * const *)a;
+    const blf_raw_patch_t *pb = *(const blf_raw_patch_t * const *)b;
+    return pa->offset < pb->offset ? -1 : pa->offset > pb->offset;
+}
+
+// Write a run of file-contiguous patches with one pwritev
+static bool write_run(blf_file_t *file, uint64_t offset, const blf_raw_patch_t **run, int count) {
+    struct iovec vec[64];
+    uint64_t total = 0;
+    for (int i = 0; i < count; i++) {
+        vec[i].iov_base = (void*)run[i]->data;
+        vec[i].iov_len = (size_t)run[i]->size;
+        total += run[i]->size;
+    }
+
+    ssize_t n;
+    do {
+        n = pwritev(fileno(file->fp), vec, count, (off_t)offset);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        return false;
+    }
+
+    // Finish a short write segment by segment
+    uint64_t done = (uint64_t)n;
+    uint64_t seg_start = 0;
+    for (int i = 0; i < count && done < total; i++) {
+        uint64_t seg_end = seg_start + run[i]->size;
+        if (done < seg_end) {
+            uint64_t skip = done > seg_start ? done - seg_start : 0;
+            if (!write_at(file, offset + seg_start + skip, (const char*)run[i]->data + skip, run[i]->size - skip)) {
+                return false;
+            }
+            done = seg_end;
+        }
+        seg_start = seg_end;
+    }
+    return true;
+}
+
+// Make patched data durable. A mapped file msyncs the pages covering each
+// run of patches that share pages; otherwise the file is fdatasync'ed, since
+// sync_file_range would flush neither the file size nor the disk cache.
+static bool sync_patches(blf_file_t *file, uint64_t base, const blf_raw_patch_t **sorted, int count) {
+    if (!file->map) {
+        return fflush(file->fp) == 0 && fdatasync(fileno(file->fp)) == 0;
+    }
+
+    uint64_t page_size = (uint64_t)sysconf(_SC_PAGESIZE);
+    for (int i = 0; i < count; ) {
+        uint64_t start = (base + sorted[i]->offset) / page_size * page_size;
+        uint64_t stop = base + sorted[i]->offset + sorted[i]->size;
+        i++;
+        while (i < count && (base + sorted[i]->offset) / page_size * page_size <= stop) {
+            stop = base + sorted[i]->offset + sorted[i]->size;
+            i++;
+        }
+        if (stop > start && msync(file->map->base + start, stop - start, MS_SYNC) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Apply patches to the raw section in one sorted pass
+bool blf_patch_raw(blf_file_t *file, const blf_raw_patch_t *patches, int count) {
+    if (!file || !file->fp || count < 0 || (!patches && count > 0)) {
+        return false;
+    }
+    if (count == 0) {
+        return true;
+    }
+
+    const blf_raw_patch_t **sorted = (const blf_raw_patch_t**)malloc(count * sizeof(blf_raw_patch_t*));
+    if (!sorted) {
+        return false;
+    }
+    for (int i = 0; i < count; i++) {
+        sorted[i] = &patches[i];
+    }
+    qsort(sorted, count, sizeof(blf_raw_patch_t*), compare_patch);
+
+    // Reject overlaps and gaps past the end of the section
+    uint64_t raw_size = file->header.raw_size;
+    uint64_t end = 0;
+    for (int i = 0; i < count; i++) {
+        if ((!sorted[i]->data && sorted[i]->size > 0) || sorted[i]->size > SSIZE_MAX ||
+            sorted[i]->offset < end || sorted[i]->offset > raw_size) {
+            free(sorted);
+            return false;
+        }
+        end = sorted[i]->offset + sorted[i]->size;
+        if (end > raw_size) {
+            raw_size = end;
+        }
+    }
+
+    // An empty section is placed aligned after the KV section. The header
+    // only takes the new offset and size once the data is written.
+    uint64_t base = file->header.raw_offset;
+    if (file->header.raw_size == 0 && raw_size > 0) {
+        base = align_up(file->header.kv_offset + file->header.kv_size, BLF_RAW_ALIGN);
+    }
+
+    if (!index_protect(file, base + raw_size)) {
+        free(sorted);
+        return false;
+    }
+
+    // Write runs of adjacent patches
+    bool ok = true;
+    for (int i = 0; ok && i < count; ) {
+        int run = 1;
+        uint64_t run_end = sorted[i]->offset + sorted[i]->size;
+        while (i + run < count && run < 64 && sorted[i + run]->offset == run_end) {
+            run_end += sorted[i + run]->size;
+            run++;
+        }
+
+        if (file->map || run == 1) {
+            for (int j = 0; ok && j < run; j++) {
+                ok = sorted[i + j]->size == 0 ||
+                     write_at(file, base + sorted[i + j]->offset, sorted[i + j]->data, sorted[i + j]->size);
+            }
+        } else {
+            ok = write_run(file, base + sorted[i]->offset, sorted + i, run);
+        }
+        i += run;
+    }
+
+    // The data is durable before a header that covers it is written
+    ok = ok && sync_patches(file, base, sorted, count);
+    free(sorted);
+
+    if (ok && (raw_size != file->header.raw_size || base != file->header.raw_offset)) {
+        uint64_t old_offset = file->header.raw_offset;
+        uint64_t old_size = file->header.raw_size;
+        file->header.raw_offset = base;
+        file->header.raw_size = raw_size;
+        ok = blf_update_header(file) &&
+             (file->map ? msync(file->map->base, sizeof(blf_header_t), MS_SYNC) == 0
+                        : fdatasync(fileno(file->fp)) == 0);
+        if (!ok) {
+            file->header.raw_offset = old_offset;
+            file->header.raw_size = old_size;
+        }
+    }
+    return ok;
+}
+
+// Overwrite (or extend) part of the raw section
+bool blf_write_raw_at(blf_file_t *file, uint64_t offset, const void *data, uint64_t size) {
+    blf_raw_patch_t patch = { offset, data, size };
+    return blf_patch_raw(file, &patch, 1);
+}
+
+#define BLF_MERGE_CHUNK (4 * 1024 * 1024)  // Output bytes encoded per task
+#define BLF_MERGE_MAX_THREADS 8
+#define BLF_MERGE_INLINE_KEY 16            // Keys up to this length are kept in memory
+#define BLF_MERGE_RUN 262144               // Entries sorted in memory at a time
+#define BLF_MERGE_BLOCK 1024               // Entries of a run held in memory
+#define BLF_MERGE_BATCH 262144             // Output entries laid out per write
+
+// Entry of a merge or diff input
+typedef struct {
+    uint64_t hash;
+    uint64_t offset;        // Entry offset in the input
+    uint64_t value_offset;  // Value offset in the input
+    uint64_t out_offset;    // Entry offset in the output
+    uint32_t input;
+    uint32_t flags;
+    uint32_t key_length;
+    uint32_t value_length;
+    blf_kv_ext_t ext;
+    char key[BLF_MERGE_INLINE_KEY];  // Short keys, compared without reading them back
+} merge_entry_t;
+
+// Run of an input's entries sorted by key hash. Only one block of it is in
+// memory; the rest waits in the input's spill file.
+typedef struct {
+    uint32_t input;
+    merge_entry_t *entries;  // Current block
+    size_t length;
+    size_t pos;              // Next entry of the block
+    uint64_t spill_offset;   // Next block in the spill file
+    uint64_t remaining;      // Entries left in the spill file
+} merge_run_t;
+
+// Input files and the sorted runs of their entries. The files are also
+// mapped read-only, when possible, so that scattered entries are copied
+// without a read each.
+typedef struct {
+    blf_file_t **files;
+    const char **maps;
+    uint64_t *map_sizes;
+    FILE **spills;  // Temporary file of each input's spilled runs
+    int count;
+    merge_run_t *runs;
+    size_t run_count;
+    size_t run_capacity;
+    int next;       // Next input to decode
+    bool failed;
+    pthread_mutex_t lock;
+} merge_inputs_t;
+
+static int compare_merge_entry(const void *a, const void *b) {
+    const merge_entry_t *ea = (const merge_entry_t*)a;
+    const merge_entry_t *eb = (const merge_entry_t*)b;
+    if (ea->hash != eb->hash) {
+        return ea->hash < eb->hash ? -1 : 1;
+    }
+    return ea->offset < eb->offset ? -1 : ea->offset > eb->offset;
+}
+
+// Threads to use for a number of independent tasks
+static int merge_threads(size_t tasks) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t threads = cpus < 1 ? 1 : cpus > BLF_MERGE_MAX_THREADS ? BLF_MERGE_MAX_THREADS : (size_t)cpus;
+    return (int)(tasks < threads ? (tasks ? tasks : 1) : threads);
+}
+
+static bool write_full(int fd, const void *buf, uint64_t len) {
+    const char *p = (const char*)buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len < (1ULL << 30) ? (size_t)len : (size_t)1 << 30);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += n;
+        len -= (uint64_t)n;
+    }
+    return true;
+}
+
+// Add a sorted run of an input: its first block stays in memory and the
+// rest is appended to the input's spill file. Only the thread decoding the
+// input writes to that file.
+static bool merge_add_run(merge_inputs_t *in, uint32_t input, const merge_entry_t *entries, size_t length) {
+    merge_run_t run;
+    memset(&run, 0, sizeof(merge_run_t));
+    run.input = input;
+    run.length = length < BLF_MERGE_BLOCK ? length : BLF_MERGE_BLOCK;
+    run.remaining = length - run.length;
+    run.entries = (merge_entry_t*)malloc(run.length * sizeof(merge_entry_t));
+    if (!run.entries) {
+        return false;
+    }
+    memcpy(run.entries, entries, run.length * sizeof(merge_entry_t));
+
+    if (run.remaining > 0) {
+        if (!in->spills[input] && !(in->spills[input] = tmpfile())) {
+            free(run.entries);
+            return false;
+        }
+        int fd = fileno(in->spills[input]);
+        off_t end = lseek(fd, 0, SEEK_END);
+        if (end < 0 || !write_full(fd, entries + run.length, run.remaining * sizeof(merge_entry_t))) {
+            free(run.entries);
+            return false;
+        }
+        run.spill_offset = (uint64_t)end;
+    }
+
+    pthread_mutex_lock(&in->lock);
+    bool ok = true;
+    if (in->run_count == in->run_capacity) {
+        size_t capacity = in->run_capacity ? in->run_capacity * 2 : 16;
+        merge_run_t *grown = (merge_run_t*)realloc(in->runs, capacity * sizeof(merge_run_t));
+        ok = grown != NULL;
+        if (ok) {
+            in->runs = grown;
+            in->run_capacity = capacity;
+        }
+    }
+    if (ok) {
+        in->runs[in->run_count++] = run;
+    }
+    pthread_mutex_unlock(&in->lock);
+
+    if (!ok) {
+        free(run.entries);
+    }
+    return ok;
+}
+
+// Read the next block of a run back from the spill file
+static bool merge_run_refill(merge_inputs_t *in, merge_run_t *run) {
+    size_t block = run->remaining < BLF_MERGE_BLOCK ? (size_t)run->remaining : BLF_MERGE_BLOCK;
+    size_t size = block * sizeof(merge_entry_t);
+    if (pread_full(fileno(in->spills[run->input]), run->entries, size, run->spill_offset) != (ssize_t)size) {
+        return false;
+    }
+    run->spill_offset += size;
+    run->remaining -= block;
+    run->length = block;
+    run->pos = 0;
+    return true;
+}
+
+// Scan one input sequentially, sorting its entries by key hash in runs of
+// BLF_MERGE_RUN entries
+static bool merge_decode(merge_inputs_t *in, uint32_t input) {
+    blf_file_t *file = in->files[input];
+    uint64_t end_offset = file->header.kv_offset + file->header.kv_size;
+    reader_t reader;
+    if (!reader_init(&reader, file, file->header.kv_offset, end_offset)) {
+        return false;
+    }
+
+    merge_entry_t *entries = NULL;
+    size_t length = 0;
+    size_t capacity = 0;
+    char *key = NULL;
+    uint32_t key_capacity = 0;
+    bool ok = true;
+
+    while (reader_tell(&reader) < end_offset) {
+        kv_loc_t loc;
+        if (!reader_next_entry(&reader, &loc, &key, &key_capacity)) {
+            ok = false;
+            break;
+        }
+        reader_skip(&reader, loc.value_length);
+        if (loc.flags & BLF_KV_FLAG_FREE) {
+            continue;
+        }
+
+        if (length == BLF_MERGE_RUN) {
+            qsort(entries, length, sizeof(merge_entry_t), compare_merge_entry);
+            if (!merge_add_run(in, input, entries, length)) {
+                ok = false;
+                break;
+            }
+            length = 0;
+        }
+        if (length == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            merge_entry_t *grown = (merge_entry_t*)realloc(entries, capacity * sizeof(merge_entry_t));
+            if (!grown) {
+                ok = false;
+                break;
+            }
+            entries = grown;
+        }
+
+        merge_entry_t *entry = &entries[length++];
+        entry->hash = hash_key(key, loc.key_length);
+        entry->offset = loc.offset;
+        entry->value_offset = loc.value_offset;
+        entry->out_offset = 0;
+        entry->input = input;
+        entry->flags = loc.flags;
+        entry->key_length = loc.key_length;
+        entry->value_length = loc.value_length;
+        entry->ext = loc.ext;
+        if (loc.key_length <= BLF_MERGE_INLINE_KEY) {
+            memcpy(entry->key, key, loc.key_length);
+        }
+    }
+
+    if (ok && length > 0) {
+        qsort(entries, length, sizeof(merge_entry_t), compare_merge_entry);
+        ok = merge_add_run(in, input, entries, length);
+    }
+
+    free(key);
+    free(entries);
+    reader_free(&reader);
+    return ok;
+}
+
+static void *merge_decode_worker(void *arg) {
+    merge_inputs_t *in = (merge_inputs_t*)arg;
+    for (;;) {
+        pthread_mutex_lock(&in->lock);
+        int i = in->next++;
+        pthread_mutex_unlock(&in->lock);
+        if (i >= in->count) {
+            break;
+        }
+
+        if (!merge_decode(in, (uint32_t)i)) {
+            pthread_mutex_lock(&in->lock);
+            in->failed = true;
+            pthread_mutex_unlock(&in->lock);
+        }
+    }
+    return NULL;
+}
+
+static void merge_close(merge_inputs_t *in) {
+    for (int i = 0; i < in->count; i++) {
+        if (in->maps && in->maps[i]) munmap((void*)in->maps[i], in->map_sizes[i]);
+        if (in->files) close_file(in->files[i], false);
+        if (in->spills && in->spills[i]) fclose(in->spills[i]);
+    }
+    for (size_t i = 0; i < in->run_count; i++) {
+        free(in->runs[i].entries);
+    }
+    free(in->maps);
+    free(in->map_sizes);
+    free(in->files);
+    free(in->spills);
+    free(in->runs);
+    pthread_mutex_destroy(&in->lock);
+}
+
+// Open the inputs read-only and decode them in parallel
+static bool merge_open(merge_inputs_t *in, const char *const paths[], int count) {
+    memset(in, 0, sizeof(merge_inputs_t));
+    pthread_mutex_init(&in->lock, NULL);
+    in->files = (blf_file_t**)calloc(count, sizeof(blf_file_t*));
+    in->spills = (FILE**)calloc(count, sizeof(FILE*));
+    in->maps = (const char**)calloc(count, sizeof(char*));
+    in->map_sizes = (uint64_t*)calloc(count, sizeof(uint64_t));
+    if (!in->files || !in->spills || !in->maps || !in->map_sizes) {
+        merge_close(in);
+        return false;
+    }
+
+    for (int i = 0; i < count; i++) {
+        in->files[i] = paths[i] ? open_file(paths[i], "rb") : NULL;
+        if (!in->files[i]) {
+            merge_close(in);
+            return false;
+        }
+        in->count = i + 1;
+
+        struct stat st;
+        int fd = fileno(in->files[i]->fp);
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (map != MAP_FAILED) {
+                in->maps[i] = (const char*)map;
+                in->map_sizes[i] = (uint64_t)st.st_size;
+            }
+        }
+    }
+
+    pthread_t threads[BLF_MERGE_MAX_THREADS];
+    int started = 0;
+    for (int i = merge_threads((size_t)count); started < i; started++) {
+        if (pthread_create(&threads[started], NULL, merge_decode_worker, in) != 0) {
+            break;
+        }
+    }
+    if (started == 0) {
+        merge_decode_worker(in);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    if (in->failed) {
+        merge_close(in);
+        return false;
+    }
+    return true;
+}
+
+// K-way merge over the sorted runs, yielding the entries of one key at a
+// time in input order
+typedef struct {
+    merge_inputs_t *in;
+    bool want_keys;         // Read keys even when a hash is unique
+    size_t *heap;           // Runs by the hash of their next entry
+    size_t heap_size;
+    merge_entry_t *group;   // Entries sharing a hash
+    char **keys;            // Their keys
+    uint32_t *key_capacity;
+    bool *taken;
+    size_t group_length;
+    size_t group_capacity;
+    merge_entry_t *set;     // Entries of the current key
+} merge_iter_t;
+
+static const merge_entry_t *run_head(const merge_iter_t *it, size_t run) {
+    const merge_run_t *r = &it->in->runs[run];
+    return &r->entries[r->pos];
+}
+
+static bool heap_less(const merge_iter_t *it, size_t a, size_t b) {
+    const merge_entry_t *ea = run_head(it, a);
+    const merge_entry_t *eb = run_head(it, b);
+    if (ea->hash != eb->hash) {
+        return ea->hash < eb->hash;
+    }
+    return ea->input != eb->input ? ea->input < eb->input : ea->offset < eb->offset;
+}
+
+static void heap_down(merge_iter_t *it, size_t i) {
+    for (;;) {
+        size_t smallest = i;
+        size_t left = 2 * i + 1;
+        size_t right = left + 1;
+        if (left < it->heap_size && heap_less(it, it->heap[left], it->heap[smallest])) smallest = left;
+        if (right < it->heap_size && heap_less(it, it->heap[right], it->heap[smallest])) smallest = right;
+        if (smallest == i) {
+            return;
+        }
+        size_t tmp = it->heap[i];
+        it->heap[i] = it->heap[smallest];
+        it->heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+static void merge_iter_free(merge_iter_t *it) {
+    for (size_t i = 0; i < it->group_capacity; i++) {
+        free(it->keys[i]);
+    }
+    free(it->keys);
+    free(it->key_capacity);
+    free(it->taken);
+    free(it->group);
+    free(it->set);
+    free(it->heap);
+}
+
+static bool merge_iter_init(merge_iter_t *it, merge_inputs_t *in, bool want_keys) {
+    memset(it, 0, sizeof(merge_iter_t));
+    it->in = in;
+    it->want_keys = want_keys;
+    it->heap = (size_t*)calloc(in->run_count ? in->run_count : 1, sizeof(size_t));
+    it->set = (merge_entry_t*)malloc(in->count * sizeof(merge_entry_t));
+    if (!it->heap || !it->set) {
+        merge_iter_free(it);
+        return false;
+    }
+
+    for (size_t i = 0; i < in->run_count; i++) {
+        if (in->runs[i].length > 0) {
+            it->heap[it->heap_size++] = i;
+        }
+    }
+    for (size_t i = it->heap_size / 2; i-- > 0; ) {
+        heap_down(it, i);
+    }
+    return true;
+}
+
+// Pop the entries sharing the smallest hash and read their keys if needed
+static bool merge_fill_group(merge_iter_t *it) {
+    it->group_length = 0;
+    uint64_t hash = run_head(it, it->heap[0])->hash;
+
+    while (it->heap_size > 0) {
+        merge_run_t *run = &it->in->runs[it->heap[0]];
+        const merge_entry_t *entry = &run->entries[run->pos];
+        if (entry->hash != hash) {
+            break;
+        }
+
+        if (it->group_length == it->group_capacity) {
+            size_t capacity = it->group_capacity ? it->group_capacity * 2 : 8;
+            merge_entry_t *group = (merge_entry_t*)realloc(it->group, capacity * sizeof(merge_entry_t));
+            char **keys = group ? (char**)realloc(it->keys, capacity * sizeof(char*)) : NULL;
+            uint32_t *key_capacity = keys ? (uint32_t*)realloc(it->key_capacity, capacity * sizeof(uint32_t)) : NULL;
+            bool *taken = key_capacity ? (bool*)realloc(it->taken, capacity * sizeof(bool)) : NULL;
+            if (group) it->group = group;
+            if (keys) it->keys = keys;
+            if (key_capacity) it->key_capacity = key_capacity;
+            if (taken) it->taken = taken;
+            if (!taken) {
+                return false;
+            }
+            for (size_t i = it->group_capacity; i < capacity; i++) {
+                it->keys[i] = NULL;
+                it->key_capacity[i] = 0;
+            }
+            it->group_capacity = capacity;
+        }
+
+        it->taken[it->group_length] = false;
+        it->group[it->group_length++] = *entry;
+
+        if (++run->pos == run->length) {
+            if (run->remaining > 0) {
+                if (!merge_run_refill(it->in, run)) {
+                    return false;
+                }
+            } else {
+                it->heap[0] = it->heap[--it->heap_size];
+            }
+        }
+        heap_down(it, 0);
+    }
+
+    if (it->group_length == 1 && !it->want_keys) {
+        return true;
+    }
+
+    for (size_t i = 0; i < it->group_length; i++) {
+        const merge_entry_t *entry = &it->group[i];
+        if (entry->key_length + 1 > it->key_capacity[i]) {
+            char *key = (char*)realloc(it->keys[i], entry->key_length + 1);
+            if (!key) {
+                return false;
+            }
+            it->keys[i] = key;
+            it->key_capacity[i] = entry->key_length + 1;
+        }
+        if (entry->key_length <= BLF_MERGE_INLINE_KEY) {
+            memcpy(it->keys[i], entry->key, entry->key_length);
+        } else if (!read_at(it->in->files[entry->input], entry->offset + entry_header_size(entry->flags),
+                            it->keys[i], entry->key_length)) {
+            return false;
+        }
+        it->keys[i][entry->key_length] = '\0';
+    }
+    return true;
+}
+
+// Next key: returns the number of entries (one per input holding the key),
+// 0 at the end or -1 on error. *key is NULL for unique hashes unless keys
+// were asked for.
+static int merge_next(merge_iter_t *it, const char **key) {
+    for (;;) {
+        for (size_t i = 0; i < it->group_length; i++) {
+            if (it->taken[i]) {
+                continue;
+            }
+
+            const merge_entry_t *first = &it->group[i];
+            bool have_keys = it->group_length > 1 || it->want_keys;
+            int count = 0;
+            for (size_t j = i; j < it->group_length && count < it->in->count; j++) {
+                if (!it->taken[j] && (j == i || (it->group[j].key_length == first->key_length &&
+                                                 memcmp(it->keys[j], it->keys[i], first->key_length) == 0))) {
+                    it->taken[j] = true;
+                    it->set[count++] = it->group[j];
+                }
+            }
+            *key = have_keys ? it->keys[i] : NULL;
+            return count;
+        }
+
+        if (it->heap_size == 0) {
+            return 0;
+        }
+        if (!merge_fill_group(it)) {
+            return -1;
+        }
+    }
+}
+
+// Output size of an entry written at offset
+static uint64_t merge_entry_size(const merge_entry_t *entry, uint64_t offset) {
+    uint64_t header = entry_header_size(entry->flags);
+    uint16_t pad = (entry->flags & BLF_KV_FLAG_EXT)
+        ? value_pad(offset + header + entry->key_length, entry->ext.align_log2) : 0;
+    return header + entry->key_length + pad + entry->value_length;
+}
+
+// Parallel encoding of the output KV section in chunks, written in order
+typedef struct {
+    merge_inputs_t *in;
+    merge_entry_t *winners;
+    size_t *chunk_starts;  // First winner of each chunk, plus the end
+    size_t chunk_count;
+    uint64_t kv_end;
+    int slots;
+    char *buffers[2 * BLF_MERGE_MAX_THREADS];
+    uint64_t capacities[2 * BLF_MERGE_MAX_THREADS];
+    bool ready[2 * BLF_MERGE_MAX_THREADS];
+    size_t next_chunk;     // Next chunk to encode
+    size_t written;        // Chunks written
+    bool failed;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} merge_output_t;
+
+static uint64_t chunk_end(const merge_output_t *out, size_t chunk) {
+    size_t end = out->chunk_starts[chunk + 1];
+    return end < out->chunk_starts[out->chunk_count] ? out->winners[end].out_offset : out->kv_end;
+}
+
+// Bytes of an input entry: in the input's mapping, or read into scratch
+static const char *merge_entry_bytes(merge_inputs_t *in, const merge_entry_t *entry,
+                                     char **scratch, uint64_t *scratch_capacity) {
+    uint64_t size = entry->value_offset + entry->value_length - entry->offset;
+    if (in->maps[entry->input] && entry->offset + size <= in->map_sizes[entry->input]) {
+        return in->maps[entry->input] + entry->offset;
+    }
+
+    if (size > *scratch_capacity) {
+        char *grown = (char*)realloc(*scratch, size);
+        if (!grown) {
+            return NULL;
+        }
+        *scratch = grown;
+        *scratch_capacity = size;
+    }
+    return read_at(in->files[entry->input], entry->offset, *scratch, size) ? *scratch : NULL;
+}
+
+static bool merge_encode_chunk(merge_output_t *out, size_t chunk, char *buf, char **scratch, uint64_t *scratch_capacity) {
+    uint64_t base = out->winners[out->chunk_starts[chunk]].out_offset;
+    for (size_t i = out->chunk_starts[chunk]; i < out->chunk_starts[chunk + 1]; i++) {
+        const merge_entry_t *entry = &out->winners[i];
+        const char *bytes = merge_entry_bytes(out->in, entry, scratch, scratch_capacity);
+        if (!bytes) {
+            return false;
+        }
+
+        char *dst = buf + (entry->out_offset - base);
+        const blf_kv_ext_t *ext = (entry->flags & BLF_KV_FLAG_EXT) ? &entry->ext : NULL;
+        size_t prefix = encode_entry(dst, entry->out_offset, bytes + entry_header_size(entry->flags),
+                                     entry->key_length, entry->value_length, ext);
+        memcpy(dst + prefix, bytes + (entry->value_offset - entry->offset), entry->value_length);
+    }
+    return true;
+}
+
+static void *merge_encode_worker(void *arg) {
+    merge_output_t *out = (merge_output_t*)arg;
+    char *scratch = NULL;
+    uint64_t scratch_capacity = 0;
+
+    pthread_mutex_lock(&out->lock);
+    while (!out->failed && out->next_chunk < out->chunk_count) {
+        size_t chunk = out->next_chunk++;
+        int slot = (int)(chunk % out->slots);
+
+        // Wait for the writer to free the slot
+        while (chunk >= out->written + out->slots && !out->failed) {
+            pthread_cond_wait(&out->cond, &out->lock);
+        }
+        if (out->failed) {
+            break;
+        }
+        pthread_mutex_unlock(&out->lock);
+
+        uint64_t size = chunk_end(out, chunk) - out->winners[out->chunk_starts[chunk]].out_offset;
+        bool ok = true;
+        if (size > out->capacities[slot]) {
+            char *grown = (char*)realloc(out->buffers[slot], size);
+            ok = grown != NULL;
+            if (ok) {
+                out->buffers[slot] = grown;
+                out->capacities[slot] = size;
+            }
+        }
+        ok = ok && merge_encode_chunk(out, chunk, out->buffers[slot], &scratch, &scratch_capacity);
+
+        pthread_mutex_lock(&out->lock);
+        if (!ok) {
+            out->failed = true;
+        }
+        out->ready[slot] = true;
+        pthread_cond_broadcast(&out->cond);
+    }
+    pthread_mutex_unlock(&out->lock);
+
+    free(scratch);
+    return NULL;
+}
+
+// Encode the winners with worker threads and write the chunks in order
+static bool merge_write_kv(int fd, merge_inputs_t *in, merge_entry_t *winners, size_t count, uint64_t kv_end) {
+    merge_output_t out;
+    memset(&out, 0, sizeof(merge_output_t));
+    out.in = in;
+    out.winners = winners;
+    out.kv_end = kv_end;
+
+    // Split the section into chunks of about BLF_MERGE_CHUNK bytes
+    out.chunk_starts = (size_t*)malloc((count + 1) * sizeof(size_t));
+    if (!out.chunk_starts) {
+        return false;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (out.chunk_count == 0 ||
+            winners[i].out_offset - winners[out.chunk_starts[out.chunk_count - 1]].out_offset >= BLF_MERGE_CHUNK) {
+            out.chunk_starts[out.chunk_count++] = i;
+        }
+    }
+    out.chunk_starts[out.chunk_count] = count;
+
+    int threads = merge_threads(out.chunk_count);
+    out.slots = 2 * threads;
+    pthread_mutex_init(&out.lock, NULL);
+    pthread_cond_init(&out.cond, NULL);
+
+    pthread_t workers[BLF_MERGE_MAX_THREADS];
+    int started = 0;
+    while (started < threads && pthread_create(&workers[started], NULL, merge_encode_worker, &out) == 0) {
+        started++;
+    }
+    if (started == 0) {
+        out.failed = true;
+    }
+
+    // Write the chunks in order as they become ready
+    pthread_mutex_lock(&out.lock);
+    for (size_t chunk = 0; chunk < out.chunk_count && !out.failed; chunk++) {
+        int slot = (int)(chunk % out.slots);
+        while (!out.ready[slot] && !out.failed) {
+            pthread_cond_wait(&out.cond, &out.lock);
+        }
+        if (out.failed) {
+            break;
+        }
+        pthread_mutex_unlock(&out.lock);
+
+        uint64_t size = chunk_end(&out, chunk) - winners[out.chunk_starts[chunk]].out_offset;
+        bool ok = write_full(fd, out.buffers[slot], size);
+
+        pthread_mutex_lock(&out.lock);
+        if (!ok) {
+            out.failed = true;
+        }
+        out.ready[slot] = false;
+        out.written++;
+        pthread_cond_broadcast(&out.cond);
+    }
+    bool ok = !out.failed;
+    out.failed = true;  // Stops idle workers
+    pthread_cond_broadcast(&out.cond);
+    pthread_mutex_unlock(&out.lock);
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    for (int i = 0; i < out.slots; i++) {
+        free(out.buffers[i]);
+    }
+    free(out.chunk_starts);
+    pthread_cond_destroy(&out.cond);
+    pthread_mutex_destroy(&out.lock);
+    return ok;
+}
+
+// Offer the values of a conflicting key to the callback
+static int merge_resolve(merge_inputs_t *in, const merge_entry_t *set, int count, const char *key,
+                         blf_merge_fn resolve, void *user) {
+    blf_merge_value_t *values = (blf_merge_value_t*)calloc(count, sizeof(blf_merge_value_t));
+    if (!values) {
+        return -2;
+    }
+
+    int winner = -2;
+    int loaded = 0;
+    for (; loaded < count; loaded++) {
+        const merge_entry_t *entry = &set[loaded];
+        void *data = malloc(entry->value_length ? entry->value_length : 1);
+        if (!data || !read_at(in->files[entry->input], entry->value_offset, data, entry->value_length)) {
+            free(data);
+            break;
+        }
+        values[loaded].input = (int)entry->input;
+        values[loaded].key = key;
+        values[loaded].key_length = entry->key_length;
+        values[loaded].data = data;
+        values[loaded].length = entry->value_length;
+        values[loaded].type = (blf_type_t)entry->ext.type;
+    }
+
+    if (loaded == count) {
+        winner = resolve(user, values, count);
+        if (winner >= count) {
+            winner = -1;
+        }
+    }
+
+    for (int i = 0; i < loaded; i++) {
+        free((void*)values[i].data);
+    }
+    free(values);
+    return winner;
+}
+
+// Merge the inputs into a new file: decode them in parallel into sorted
+// runs, merge the runs k-way, and lay out, encode and write the output a
+// batch of entries at a time
+bool blf_merge(const char *output, const char *const inputs[], int count,
+               blf_merge_fn resolve, void *user) {
+    if (!output || !inputs || count < 1) {
+        return false;
+    }
+
+    // Refuse to truncate an input
+    struct stat out_st;
+    if (stat(output, &out_st) == 0) {
+        for (int i = 0; i < count; i++) {
+            struct stat in_st;
+            if (inputs[i] && stat(inputs[i], &in_st) == 0 &&
+                in_st.st_dev == out_st.st_dev && in_st.st_ino == out_st.st_ino) {
+                return false;
+            }
+        }
+    }
+
+    merge_inputs_t in;
+    if (!merge_open(&in, inputs, count)) {
+        return false;
+    }
+
+    merge_iter_t it;
+    if (!merge_iter_init(&it, &in, false)) {
+        merge_close(&in);
+        return false;
+    }
+
+    // The header is written last, once the section sizes are known
+    blf_header_t header;
+    memset(&header, 0, sizeof(blf_header_t));
+    merge_entry_t *winners = (merge_entry_t*)malloc(BLF_MERGE_BATCH * sizeof(merge_entry_t));
+    int fd = winners ? open(output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : -1;
+    bool ok = fd >= 0 && write_full(fd, &header, sizeof(blf_header_t));
+
+    // The output offsets and hashes are known as the winners are picked, so
+    // the output's key index is built without rescanning it
+    blf_index_t *index = index_new(BLF_INDEX_MIN_BUCKETS);
+
+    // Pick a winner per key and lay out the output
+    size_t length = 0;
+    uint64_t offset = sizeof(blf_header_t);
+    const char *key;
+    int n = 0;
+
+    while (ok && (n = merge_next(&it, &key)) > 0) {
+        int winner = n - 1;
+        if (n > 1 && resolve) {
+            winner = merge_resolve(&in, it.set, n, key, resolve, user);
+            if (winner == -2) {
+                ok = false;
+                break;
+            }
+            if (winner < 0) {
+                continue;
+            }
+        }
+
+        winners[length] = it.set[winner];
+        winners[length].out_offset = offset;
+        offset += merge_entry_size(&winners[length], offset);
+        if (index && !index_insert(index, winners[length].hash, winners[length].out_offset)) {
+            index_destroy(index);
+            index = NULL;
+        }
+        if (++length == BLF_MERGE_BATCH) {
+            ok = merge_write_kv(fd, &in, winners, length, offset);
+            length = 0;
+        }
+    }
+    merge_iter_free(&it);
+    ok = ok && n == 0 && (length == 0 || merge_write_kv(fd, &in, winners, length, offset));
+    free(winners);
+
+    blf_file_t *raw = NULL;
+    for (int i = 0; i < count; i++) {
+        if (in.files[i]->header.raw_size > 0) {
+            raw = in.files[i];
+        }
+    }
+
+    header.magic = BLF_MAGIC;
+    header.version = BLF_VERSION;
+    header.kv_offset = sizeof(blf_header_t);
+    header.kv_size = offset - sizeof(blf_header_t);
+    header.raw_offset = raw ? align_up(offset, BLF_RAW_ALIGN) : offset;
+    header.raw_size = raw ? raw->header.raw_size : 0;
+
+    // The raw section is cloned where possible; the padding before it is
+    // left as a hole
+    if (ok && raw) {
+        ok = copy_range(fileno(raw->fp), raw->header.raw_offset, fd, header.raw_offset, header.raw_size);
+    }
+    ok = ok && lseek(fd, 0, SEEK_SET) == 0 && write_full(fd, &header, sizeof(blf_header_t));
+    if (fd >= 0 && close(fd) != 0) {
+        ok = false;
+    }
+    merge_close(&in);
+
+    // The index is persisted on close
+    blf_file_t *file = ok ? blf_open(output) : NULL;
+    if (file) {
+        file->index = index;
+        index = NULL;
+        blf_close(file);
+    } else {
+        ok = false;
+    }
+    if (index) {
+        index_destroy(index);
+    }
+    return ok;
+}
+
+// Compare the values of an entry present in both files
+static bool diff_values_equal(merge_inputs_t *in, const merge_entry_t *a, const merge_entry_t *b, bool *equal) {
+    *equal = a->value_length == b->value_length && a->ext.type == b->ext.type && a->ext.count == b->ext.count;
+    if (!*equal || a->value_length == 0) {
+        return true;
+    }
+
+    char *buf = (char*)malloc(2 * BLF_READER_SIZE);
+    if (!buf) {
+        return false;
+    }
+
+    bool ok = true;
+    for (uint64_t done = 0; ok && *equal && done < a->value_length; ) {
+        size_t chunk = a->value_length - done < BLF_READER_SIZE ? (size_t)(a->value_length - done) : BLF_READER_SIZE;
+        ok = read_at(in->files[a->input], a->value_offset + done, buf, chunk) &&
+             read_at(in->files[b->input], b->value_offset + done, buf + BLF_READER_SIZE, chunk);
+        *equal = ok && memcmp(buf, buf + BLF_READER_SIZE, chunk) == 0;
+        done += chunk;
+    }
+    free(buf);
+    return ok;
+}
+
+// Report keys that were added, removed or changed from a to b
+bool blf_diff(const char *a, const char *b, blf_diff_fn report, void *user) {
+    if (!a || !b || !report) {
+        return false;
+    }
+
+    const char *paths[2] = { a, b };
+    merge_inputs_t in;
+    if (!merge_open(&in, paths, 2)) {
+        return false;
+    }
+
+    merge_iter_t it;
+    if (!merge_iter_init(&it, &in, true)) {
+        merge_close(&in);
+        return false;
+    }
+
+    const char *key;
+    int n;
+    bool ok = true;
+    while (ok && (n = merge_next(&it, &key)) > 0) {
+        if (n == 1) {
+            report(user, key, it.set[0].key_length, it.set[0].input == 0 ? BLF_DIFF_REMOVED : BLF_DIFF_ADDED);
+            continue;
+        }
+
+        bool equal;
+        ok = diff_values_equal(&in, &it.set[0], &it.set[1], &equal);
+        if (ok && !equal) {
+            report(user, key, it.set[0].key_length, BLF_DIFF_CHANGED);
+        }
+    }
+
+    merge_iter_free(&it);
+    merge_close(&in);
+    return ok && n == 0;
+}
@@ -5,30 +5,130 @@
 #include <stdio.h>
 #include <stdbool.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #define BLF_MAGIC 0x42B1F000  // 'BLF\0'
-#define BLF_VERSION 1
+#define BLF_VERSION 4
+#define BLF_VERSION_MIN 1     // Oldest format version that can be opened
+#define BLF_VERSION_INDEX 3   // First version with the index fields in the header
+#define BLF_VERSION_FREE 4    // First version with free entries in the KV section
 
 // File header structure
 typedef struct {
-    uint32_t magic;      // Magic number for file identification
-    uint32_t version;    // File format version
-    uint64_t kv_offset;  // KV section offset
-    uint64_t kv_size;    // KV section size
-    uint64_t raw_offset; // Raw data section offset
-    uint64_t raw_size;   // Raw data section size
+    uint32_t magic;        // Magic number for file identification
+    uint32_t version;      // File format version
+    uint64_t kv_offset;    // KV section offset
+    uint64_t kv_size;      // KV section size
+    uint64_t raw_offset;   // Raw data section offset
+    uint64_t raw_size;     // Raw data section size
+    uint64_t index_offset; // Persisted key index offset (0 if absent or stale)
+    uint64_t index_size;   // Persisted key index size
 } blf_header_t;
 
+#define BLF_HEADER_V1_SIZE 40 // Header size of format versions 1 and 2
+#define BLF_RAW_ALIGN 4096    // Alignment of the raw section offset
+
 // KV entry header
 typedef struct {
-    uint32_t key_length;    // Length of key
+    uint32_t key_length;    // Length of key (low 24 bits) and entry flags
     uint32_t value_length;  // Length of value
 } blf_kv_entry_t;
 
+#define BLF_KV_KEY_MASK 0x00FFFFFF  // Key length bits of key_length
+#define BLF_KV_FLAG_EXT 0x40000000  // A blf_kv_ext_t follows the entry header
+#define BLF_KV_FLAG_FREE 0x80000000 // Released extent: no key, value_length
+                                    // covers the rest of the extent
+
+// Value types
+typedef enum {
+    BLF_TYPE_BYTES = 0,  // Untyped bytes
+    BLF_TYPE_U64 = 1,    // uint64_t
+    BLF_TYPE_F64 = 2,    // double
+    BLF_TYPE_I64 = 3,    // int64_t
+    BLF_TYPE_U32 = 4,    // uint32_t
+    BLF_TYPE_I32 = 5,    // int32_t
+    BLF_TYPE_F32 = 6     // float
+} blf_type_t;
+
+// Extended entry header (format version 2). The key is followed by `pad`
+// zero bytes so that the value starts at a file offset that is a multiple
+// of 1 << align_log2.
+typedef struct {
+    uint8_t type;        // blf_type_t
+    uint8_t align_log2;  // Value alignment
+    uint16_t pad;        // Padding between key and value
+    uint32_t count;      // Number of elements in the value
+} blf_kv_ext_t;
+
+// Persisted key index section: a blf_index_header_t followed by a power of
+// two number of buckets. A key's 64-bit hash selects a bucket by its low
+// bits and is probed linearly; each slot holds the high 32 bits as a
+// fingerprint (0 = empty, 1 = deleted), the low 32 bits and the entry offset.
+// The buckets are followed by the free-space map: free_count extents of the
+// KV section that hold only free entries.
+#define BLF_INDEX_MAGIC 0x42B1F1D1
+#define BLF_INDEX_SLOTS 16
+
+typedef struct {
+    uint32_t magic;          // BLF_INDEX_MAGIC
+    uint32_t slots;          // Slots per bucket
+    uint64_t bucket_count;
+    uint64_t count;          // Live entries
+    uint64_t tombstones;     // Deleted slots
+    uint64_t kv_offset;      // KV section the index describes
+    uint64_t kv_size;
+    uint64_t free_count;     // Free extents after the buckets
+} blf_index_header_t;
+
+typedef struct {
+    uint32_t fps[BLF_INDEX_SLOTS];      // Key hash fingerprints (high 32 bits)
+    uint32_t hash_lo[BLF_INDEX_SLOTS];  // Low 32 bits of the key hash
+    uint64_t offsets[BLF_INDEX_SLOTS];  // Entry offsets
+} blf_index_bucket_t;
+
+typedef struct {
+    uint64_t offset;
+    uint64_t size;
+} blf_free_extent_t;
+
+// In-memory key index, loaded from the persisted section or built from the
+// KV section on the first lookup
+typedef struct blf_index blf_index_t;
+
+// Opt-in per-handle value cache
+typedef struct blf_cache blf_cache_t;
+
+// Value cache counters
+typedef struct {
+    uint64_t hits;       // Lookups served from the cache
+    uint64_t misses;     // Lookups that went to the file
+    uint64_t evictions;  // Entries evicted to stay within the budget
+    uint64_t entries;    // Entries currently cached
+    uint64_t bytes;      // Bytes currently charged against the budget
+    uint64_t budget;     // Byte budget
+} blf_cache_stats_t;
+
+// Read-write memory mapping of the file (see blf_map)
+typedef struct blf_map blf_map_t;
+
+#define BLF_MAP_GROWTH (64 * 1024 * 1024)  // Default preallocation step
+
+// O_DIRECT state for raw transfers (see blf_direct_enable)
+typedef struct blf_direct blf_direct_t;
+
+#define BLF_DIRECT_BUFFER (4 * 1024 * 1024)  // Default bounce buffer size
+
 // BLF file handle
 typedef struct {
     FILE *fp;
     blf_header_t header;
     char *filename;
+    blf_index_t *index;
+    blf_cache_t *cache;
+    blf_map_t *map;
+    blf_direct_t *direct;
 } blf_file_t;
 
 // File operations
@@ -41,12 +141,238 @@ bool blf_put_kv(blf_file_t *file, const char *key, const void *value, uint32_t v
 bool blf_get_kv(blf_file_t *file, const char *key, void *value, uint32_t *value_length);
 bool blf_delete_kv(blf_file_t *file, const char *key);
 
+// The same operations with an explicit key length, for keys that are not
+// NUL-terminated
+bool blf_put_kv_n(blf_file_t *file, const char *key, uint32_t key_length,
+                  const void *value, uint32_t value_length);
+bool blf_get_kv_n(blf_file_t *file, const char *key, uint32_t key_length,
+                  void *value, uint32_t *value_length);
+bool blf_delete_kv_n(blf_file_t *file, const char *key, uint32_t key_length);
+
+// Point *value at a value inside the mapping instead of copying it; only
+// while the file is mapped (see blf_map). Like blf_get_array's pointer, it
+// stays valid until the next write through the handle.
+bool blf_get_kv_view(blf_file_t *file, const char *key, uint32_t key_length,
+                     const void **value, uint32_t *value_length);
+
+// Result of one key of blf_get_many
+typedef struct {
+    uint64_t offset;  // Value offset in the arena
+    uint32_t length;  // Value length
+    bool found;
+} blf_get_result_t;
+
+// Look up n keys at once, copying the values into one arena. *arena_size is
+// the arena capacity on input and the bytes used on output; if the arena is
+// too small, false is returned with *arena_size set to the size needed.
+bool blf_get_many(blf_file_t *file, const char *const keys[], size_t n,
+                  blf_get_result_t results[], void *arena, uint64_t *arena_size);
+
+// The same with an explicit length for each key
+bool blf_get_many_n(blf_file_t *file, const char *const keys[], const uint32_t key_lengths[], size_t n,
+                    blf_get_result_t results[], void *arena, uint64_t *arena_size);
+
+// Visit entries in file order, starting at *cursor (an offset into the KV
+// section; 0 is the start), until fn returns false. *cursor is left at the
+// first entry not visited, or BLF_SCAN_END once all were. fn must not call
+// back into the handle.
+#define BLF_SCAN_END UINT64_MAX
+
+typedef bool (*blf_scan_fn)(void *user, const char *key, uint32_t key_length,
+                            const void *value, uint32_t value_length);
+
+bool blf_scan(blf_file_t *file, uint64_t *cursor, blf_scan_fn fn, void *user);
+
+// Batched form of blf_scan: copy up to max_entries entries into one arena,
+// each key followed by its value, and set *count. *arena_size is the arena
+// capacity on input and the bytes used on output; if not even the first
+// entry fits, false is returned with *arena_size set to the size it needs.
+typedef struct {
+    uint64_t offset;        // Key offset in the arena; the value follows it
+    uint32_t key_length;
+    uint32_t value_length;
+} blf_scan_entry_t;
+
+bool blf_scan_batch(blf_file_t *file, uint64_t *cursor, blf_scan_entry_t entries[], size_t max_entries,
+                    size_t *count, void *arena, uint64_t *arena_size);
+
+// Free space. Deletes and length-changing puts release the old entry's
+// extent into a free-space map kept with the key index; puts reuse a fitting
+// extent before appending. blf_compact rewrites the file without free space.
+typedef struct {
+    uint64_t kv_size;         // Bytes in the KV section
+    uint64_t free_bytes;      // Bytes in free extents
+    uint64_t free_extents;    // Number of free extents
+    uint64_t largest_extent;  // Size of the largest free extent
+    double fragmentation;     // 1 - largest_extent / free_bytes (0 if none)
+} blf_free_stats_t;
+
+bool blf_free_stats(blf_file_t *file, blf_free_stats_t *stats);
+bool blf_compact(blf_file_t *file);
+
+// Deduplicated raw storage. blf_dedup_write splits a payload into
+// content-defined chunks (Gear rolling hash, 2-64 KiB, about 8 KiB on
+// average) and stores each distinct chunk once as a KV entry keyed by its
+// SHA-256; the version itself is stored as its list of chunks. Writing a
+// version that differs slightly from a stored one writes only the chunks
+// around the changes. Each chunk has a u64 count of the references to it;
+// overwriting or deleting a version drops its references and deletes the
+// chunks left without one. Keys starting with the prefixes below are
+// reserved.
+#define BLF_DEDUP_CHUNK_PREFIX "blf.chunk/"
+#define BLF_DEDUP_VERSION_PREFIX "blf.dedup/"
+#define BLF_DEDUP_REFS_PREFIX "blf.refs/"
+
+typedef struct {
+    uint64_t size;        // Bytes in the version
+    uint64_t chunks;      // Chunks in the version
+    uint64_t new_chunks;  // Chunks that were not stored yet
+    uint64_t new_bytes;   // Bytes written for them
+} blf_dedup_stats_t;
+
+bool blf_dedup_write(blf_file_t *file, const char *name, const void *data, uint64_t size,
+                     blf_dedup_stats_t *stats);
+bool blf_dedup_read(blf_file_t *file, const char *name, void *data, uint64_t *size);
+bool blf_dedup_delete(blf_file_t *file, const char *name);
+void blf_sha256(const void *data, size_t length, uint8_t digest[32]);
+
+// Typed fixed-width values, stored 8-byte aligned. blf_incr_u64 creates
+// a missing counter and updates an existing one with one positioned write.
+bool blf_put_u64(blf_file_t *file, const char *key, uint64_t value);
+bool blf_put_f64(blf_file_t *file, const char *key, double value);
+bool blf_get_u64(blf_file_t *file, const char *key, uint64_t *value);
+bool blf_get_f64(blf_file_t *file, const char *key, double *value);
+bool blf_incr_u64(blf_file_t *file, const char *key, uint64_t delta, uint64_t *result);
+
+// Typed array located in the file
+typedef struct {
+    blf_type_t type;
+    uint32_t count;      // Number of elements
+    uint32_t alignment;  // Alignment of the first element in the file
+    uint64_t offset;     // File offset of the first element
+    const void *data;    // First element in the mapping, or NULL if not mapped
+} blf_array_t;
+
+// Typed arrays, stored with the first element aligned to `alignment` bytes
+// (8, 16, 32 or 64; 0 means 8). While the file is mapped, blf_get_array
+// points into the mapping so the elements can be used in place; the pointer
+// stays valid until the next write through the handle.
+size_t blf_type_size(blf_type_t type);
+bool blf_put_array(blf_file_t *file, const char *key, blf_type_t type,
+                   const void *data, uint32_t count, uint32_t alignment);
+bool blf_get_array(blf_file_t *file, const char *key, blf_array_t *array);
+
+// Value cache. While enabled, the KV operations on the handle may be called
+// from multiple threads.
+bool blf_cache_enable(blf_file_t *file, uint64_t budget_bytes);
+void blf_cache_disable(blf_file_t *file);
+bool blf_cache_stats(blf_file_t *file, blf_cache_stats_t *stats);
+
 // Raw data operations
 bool blf_write_raw(blf_file_t *file, const void *data, uint64_t size);
 bool blf_read_raw(blf_file_t *file, void *data, uint64_t *size);
 
+// Segment of a scatter read; offset is relative to the raw section
+typedef struct {
+    uint64_t offset;
+    void *data;
+    uint64_t size;  // Bytes to read; set to the bytes read
+} blf_raw_iovec_t;
+
+// Expected access pattern for a range of the raw section
+typedef enum {
+    BLF_ADVICE_NORMAL = 0,
+    BLF_ADVICE_SEQUENTIAL,  // Read ahead aggressively
+    BLF_ADVICE_RANDOM,      // Do not read ahead
+    BLF_ADVICE_WILLNEED,    // Start reading the range in now
+    BLF_ADVICE_DONTNEED     // Drop the range from the page cache
+} blf_advice_t;
+
+// Ranged raw reads. Reads stop at the end of the raw section; *size (or
+// each segment's size) is set to the bytes actually read.
+bool blf_read_raw_at(blf_file_t *file, uint64_t offset, void *data, uint64_t *size);
+bool blf_readv_raw(blf_file_t *file, blf_raw_iovec_t *iov, int count);
+
+// Advise the kernel of the access pattern for a range of the raw section.
+// A length of 0 advises the rest of the raw section.
+bool blf_raw_advise(blf_file_t *file, uint64_t offset, uint64_t length, blf_advice_t advice);
+
+// In-place patch of the raw section; offset is relative to the raw section
+typedef struct {
+    uint64_t offset;
+    const void *data;
+    uint64_t size;
+} blf_raw_patch_t;
+
+// Direct I/O for large raw transfers. While enabled, blf_write_raw,
+// blf_read_raw and blf_read_raw_at calls of at least buffer_size bytes
+// bypass the page cache. Returns false, leaving the handle on buffered I/O,
+// when the file system rejects O_DIRECT.
+bool blf_direct_enable(blf_file_t *file, size_t buffer_size);
+void blf_direct_disable(blf_file_t *file);
+
+// Partial raw updates. Patches may extend the raw section but must not leave
+// a gap past its end or overlap each other. They are applied in offset order,
+// adjacent patches with one pwritev, and are durable on return: a mapped file
+// msyncs only the touched pages, others are fdatasync'ed, which also covers
+// a grown file size. The header is written after the data, and the handle's
+// header is left unchanged if a write fails.
+bool blf_write_raw_at(blf_file_t *file, uint64_t offset, const void *data, uint64_t size);
+bool blf_patch_raw(blf_file_t *file, const blf_raw_patch_t *patches, int count);
+
+// Memory-mapped mode. While mapped, writes are memory stores into a
+// preallocated mapping that grows in growth_step increments (0 selects
+// BLF_MAP_GROWTH), and only blf_commit() makes them durable.
+bool blf_map(blf_file_t *file, uint64_t growth_step);
+bool blf_unmap(blf_file_t *file);
+bool blf_commit(blf_file_t *file);
+
+// A value offered to a merge conflict callback
+typedef struct {
+    int input;            // Index of the input file
+    const char *key;
+    uint32_t key_length;
+    const void *data;
+    uint32_t length;
+    blf_type_t type;
+} blf_merge_value_t;
+
+// Picks the winner among the values of a key found in several inputs (given
+// in input order); returns its index, or -1 to leave the key out
+typedef int (*blf_merge_fn)(void *user, const blf_merge_value_t *values, int count);
+
+// Merge files into a new one. Keys found in several inputs are resolved by
+// resolve, or by the last input when it is NULL; the raw section is taken
+// from the last input that has one. The inputs are only read. Their entries
+// are sorted in runs spilled to temporary files and merged a block at a
+// time, so memory is bounded apart from the output's key index.
+bool blf_merge(const char *output, const char *const inputs[], int count,
+               blf_merge_fn resolve, void *user);
+
+typedef enum {
+    BLF_DIFF_ADDED,    // Only in the second file
+    BLF_DIFF_REMOVED,  // Only in the first file
+    BLF_DIFF_CHANGED   // Different type or value
+} blf_diff_t;
+
+typedef void (*blf_diff_fn)(void *user, const char *key, uint32_t key_length, blf_diff_t change);
+
+// Report the keys that differ between two files, in key hash order. Like
+// blf_merge, it reads the files read-only and in bounded memory.
+bool blf_diff(const char *a, const char *b, blf_diff_fn report, void *user);
+
+// Copy a file to a new path. On file systems with reflinks (btrfs, XFS) the
+// copy shares the source's extents until either file changes, so it costs
+// no data I/O; elsewhere the data is copied within the kernel. Flush or
+// commit changes made through an open handle first.
+bool blf_clone(const char *src, const char *dst);
+
 // Utility functions
 bool blf_flush(blf_file_t *file);
 bool blf_update_header(blf_file_t *file);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif // BLF_H
@@ -0,0 +1,319 @@
+#ifndef BLF_HPP
+#define BLF_HPP
+
+// Header-only C++17 interface to libblf. blf::File owns a handle and closes
+// it on destruction; keys are std::string_view and are passed with their
+// length, so they need no NUL-terminated copy. Failures are reported the way
+// the C API reports them, as false (or an empty optional), never by throwing.
+
+#include "blf.h"
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#if __cplusplus >= 202002L && __has_include(<span>)
+#include <span>
+#endif
+
+namespace blf {
+
+#if __cplusplus >= 202002L && __has_include(<span>)
+using bytes_view = std::span<const std::byte>;
+#else
+// Read-only byte range with the parts of std::span<const std::byte> used here
+class bytes_view {
+public:
+    constexpr bytes_view() noexcept = default;
+    constexpr bytes_view(const std::byte *data, std::size_t size) noexcept : data_(data), size_(size) {}
+
+    constexpr const std::byte *data() const noexcept { return data_; }
+    constexpr std::size_t size() const noexcept { return size_; }
+    constexpr bool empty() const noexcept { return size_ == 0; }
+    constexpr const std::byte *begin() const noexcept { return data_; }
+    constexpr const std::byte *end() const noexcept { return data_ + size_; }
+    constexpr const std::byte &operator[](std::size_t i) const noexcept { return data_[i]; }
+
+private:
+    const std::byte *data_ = nullptr;
+    std::size_t size_ = 0;
+};
+#endif
+
+inline bytes_view as_bytes(std::string_view s) noexcept {
+    return bytes_view(reinterpret_cast<const std::byte*>(s.data()), s.size());
+}
+
+inline std::string_view as_string(bytes_view b) noexcept {
+    return std::string_view(reinterpret_cast<const char*>(b.data()), b.size());
+}
+
+// A KV entry visited by iteration; both views are valid until the iterator
+// is advanced
+struct Entry {
+    std::string_view key;
+    bytes_view value;
+};
+
+// Input iterator over the KV entries in file order. Entries are copied in
+// batches by blf_scan_batch, so a step is a memory access except once per
+// batch. The handle must not be written to while iterating.
+class Iterator {
+public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = Entry;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const Entry*;
+    using reference = const Entry&;
+
+    static constexpr std::size_t batch_entries = 4096;
+    static constexpr std::size_t batch_bytes = 256 * 1024;
+
+    Iterator() noexcept = default;  // End of the entries
+
+    explicit Iterator(blf_file_t *file)
+        : file_(file), arena_(batch_bytes), entries_(batch_entries) {
+        fill();
+    }
+
+    // A copy points its entry into its own batch
+    Iterator(const Iterator &other)
+        : file_(other.file_), cursor_(other.cursor_), batch_(other.batch_), index_(other.index_),
+          count_(other.count_), arena_(other.arena_), entries_(other.entries_), failed_(other.failed_) {
+        if (file_) {
+            select();
+        }
+    }
+
+    Iterator &operator=(const Iterator &other) {
+        if (this != &other) {
+            *this = Iterator(other);
+        }
+        return *this;
+    }
+
+    Iterator(Iterator&&) noexcept = default;
+    Iterator &operator=(Iterator&&) noexcept = default;
+
+    reference operator*() const noexcept { return current_; }
+    pointer operator->() const noexcept { return &current_; }
+
+    Iterator &operator++() {
+        if (++index_ < count_) {
+            select();
+        } else {
+            fill();
+        }
+        return *this;
+    }
+
+    void operator++(int) { ++*this; }
+
+    // All end iterators are equal; others only to themselves
+    friend bool operator==(const Iterator &a, const Iterator &b) noexcept {
+        return a.file_ == b.file_ && (!a.file_ || (a.batch_ == b.batch_ && a.index_ == b.index_));
+    }
+    friend bool operator!=(const Iterator &a, const Iterator &b) noexcept { return !(a == b); }
+
+    // True if iteration stopped on a read error rather than the end
+    bool failed() const noexcept { return failed_; }
+
+private:
+    void fill() {
+        index_ = 0;
+        count_ = 0;
+        batch_++;
+        while (cursor_ != BLF_SCAN_END) {
+            uint64_t size = arena_.size();
+            if (blf_scan_batch(file_, &cursor_, entries_.data(), entries_.size(), &count_,
+                               arena_.data(), &size)) {
+                break;
+            }
+            // Grow for an entry larger than the arena; anything else is an error
+            if (size <= arena_.size()) {
+                failed_ = true;
+                break;
+            }
+            arena_.resize(size);
+        }
+        if (count_ == 0) {
+            file_ = nullptr;
+            return;
+        }
+        select();
+    }
+
+    void select() noexcept {
+        const blf_scan_entry_t &entry = entries_[index_];
+        const char *key = arena_.data() + entry.offset;
+        current_.key = std::string_view(key, entry.key_length);
+        current_.value = bytes_view(reinterpret_cast<const std::byte*>(key + entry.key_length), entry.value_length);
+    }
+
+    blf_file_t *file_ = nullptr;
+    uint64_t cursor_ = 0;
+    uint64_t batch_ = 0;
+    std::size_t index_ = 0;
+    std::size_t count_ = 0;
+    std::vector<char> arena_;
+    std::vector<blf_scan_entry_t> entries_;
+    Entry current_;
+    bool failed_ = false;
+};
+
+// Move-only owner of an open BLF file
+class File {
+public:
+    File() noexcept = default;
+
+    // Take ownership of a handle from blf_open or blf_create
+    explicit File(blf_file_t *file) noexcept : file_(file) {}
+
+    static File open(const char *path) { return File(blf_open(path)); }
+    static File open(const std::string &path) { return open(path.c_str()); }
+    static File create(const char *path) { return File(blf_create(path)); }
+    static File create(const std::string &path) { return create(path.c_str()); }
+
+    ~File() { close(); }
+
+    File(const File&) = delete;
+    File &operator=(const File&) = delete;
+
+    File(File &&other) noexcept : file_(std::exchange(other.file_, nullptr)) {}
+
+    File &operator=(File &&other) noexcept {
+        if (this != &other) {
+            close();
+            file_ = std::exchange(other.file_, nullptr);
+        }
+        return *this;
+    }
+
+    explicit operator bool() const noexcept { return file_ != nullptr; }
+
+    // The C handle, for the parts of the API not wrapped here
+    blf_file_t *handle() const noexcept { return file_; }
+
+    blf_file_t *release() noexcept { return std::exchange(file_, nullptr); }
+
+    void close() noexcept {
+        if (file_) {
+            blf_close(std::exchange(file_, nullptr));
+        }
+    }
+
+    bool put(std::string_view key, const void *value, std::size_t length) {
+        return fits(key) && length <= UINT32_MAX &&
+               blf_put_kv_n(file_, key.data(), static_cast<uint32_t>(key.size()),
+                            value ? value : "", static_cast<uint32_t>(length));
+    }
+
+    bool put(std::string_view key, bytes_view value) { return put(key, value.data(), value.size()); }
+    bool put(std::string_view key, std::string_view value) { return put(key, value.data(), value.size()); }
+
+    // Copy a value into buffer; *length is the capacity on input and the
+    // value length on output. As with blf_get_kv, false with a larger
+    // *length means the buffer was too small.
+    bool get(std::string_view key, void *buffer, uint32_t &length) const {
+        return fits(key) && blf_get_kv_n(file_, key.data(), static_cast<uint32_t>(key.size()), buffer, &length);
+    }
+
+    // Copy a value into value, reusing its capacity
+    bool get(std::string_view key, std::string &value) const {
+        value.resize(value.capacity());
+        for (;;) {
+            uint32_t length = static_cast<uint32_t>(value.size() < UINT32_MAX ? value.size() : UINT32_MAX);
+            if (get(key, value.empty() ? nullptr : &value[0], length)) {
+                value.resize(length);
+                return true;
+            }
+            if (length <= value.size()) {
+                value.clear();
+                return false;
+            }
+            value.resize(length);
+        }
+    }
+
+    std::optional<std::string> get(std::string_view key) const {
+        std::string value;
+        if (!get(key, value)) {
+            return std::nullopt;
+        }
+        return value;
+    }
+
+    // The value in place in the mapping, without a copy; empty if the key is
+    // missing or the file is not mapped. Valid until the next write.
+    std::optional<bytes_view> view(std::string_view key) const {
+        const void *value = nullptr;
+        uint32_t length = 0;
+        if (!fits(key) ||
+            !blf_get_kv_view(file_, key.data(), static_cast<uint32_t>(key.size()), &value, &length)) {
+            return std::nullopt;
+        }
+        return bytes_view(static_cast<const std::byte*>(value), length);
+    }
+
+    // Look up many keys at once with blf_get_many_n; values[i] is empty if
+    // keys[i] is missing. The values share one arena, grown until it fits.
+    bool get_many(const std::vector<std::string_view> &keys, std::vector<std::optional<std::string>> &values) const {
+        std::vector<const char*> data(keys.size());
+        std::vector<uint32_t> lengths(keys.size());
+        for (std::size_t i = 0; i < keys.size(); i++) {
+            if (!fits(keys[i])) {
+                return false;
+            }
+            data[i] = keys[i].data() ? keys[i].data() : "";
+            lengths[i] = static_cast<uint32_t>(keys[i].size());
+        }
+
+        std::vector<blf_get_result_t> results(keys.size());
+        std::vector<char> arena;
+        uint64_t arena_size = 0;
+        while (!blf_get_many_n(file_, data.data(), lengths.data(), keys.size(), results.data(),
+                               arena.empty() ? nullptr : arena.data(), &arena_size)) {
+            if (arena_size <= arena.size()) {
+                return false;
+            }
+            arena.resize(arena_size);
+        }
+
+        values.assign(keys.size(), std::nullopt);
+        for (std::size_t i = 0; i < keys.size(); i++) {
+            if (results[i].found) {
+                values[i].emplace(arena.data() + results[i].offset, results[i].length);
+            }
+        }
+        return true;
+    }
+
+    bool erase(std::string_view key) {
+        return fits(key) && blf_delete_kv_n(file_, key.data(), static_cast<uint32_t>(key.size()));
+    }
+
+    bool map(uint64_t growth_step = 0) { return blf_map(file_, growth_step); }
+    bool unmap() { return blf_unmap(file_); }
+    bool mapped() const noexcept { return file_ && file_->map; }
+    bool commit() { return blf_commit(file_); }
+    bool flush() { return blf_flush(file_); }
+
+    // Range-for over the KV entries: for (const blf::Entry &entry : file)
+    Iterator begin() const { return file_ ? Iterator(file_) : Iterator(); }
+    Iterator end() const noexcept { return Iterator(); }
+
+private:
+    bool fits(std::string_view key) const noexcept {
+        return file_ && key.size() <= BLF_KV_KEY_MASK;
+    }
+
+    blf_file_t *file_ = nullptr;
+};
+
+}  // namespace blf
+
+#endif // BLF_HPP
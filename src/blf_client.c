@@ -0,0 +1,349 @@
+// Needed for sockets under -std=c99
+#define _POSIX_C_SOURCE 200809L
+
+#include "blf_net.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+struct blf_client {
+    int fd;
+    uint32_t next_id;
+    uint32_t pending;  // Requests without a received response
+    char *out;         // Queued requests
+    size_t out_length;
+    size_t out_capacity;
+    char *in;          // Received bytes; consumed up to in_start
+    size_t in_start;
+    size_t in_length;
+    size_t in_capacity;
+};
+
+static bool grow(char **data, size_t *capacity, size_t needed) {
+    if (needed <= *capacity) {
+        return true;
+    }
+    size_t new_capacity = *capacity ? *capacity : 64 * 1024;
+    while (new_capacity < needed) {
+        new_capacity *= 2;
+    }
+    char *grown = (char*)realloc(*data, new_capacity);
+    if (!grown) {
+        return false;
+    }
+    *data = grown;
+    *capacity = new_capacity;
+    return true;
+}
+
+// Connect to a server started with blf_serve
+blf_client_t *blf_client_connect(const char *socket_path) {
+    struct sockaddr_un addr;
+    if (!socket_path || strlen(socket_path) >= sizeof(addr.sun_path)) {
+        return NULL;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    blf_client_t *client = (blf_client_t*)calloc(1, sizeof(blf_client_t));
+    if (!client) {
+        return NULL;
+    }
+    client->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (client->fd < 0 || connect(client->fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        if (client->fd >= 0) close(client->fd);
+        free(client);
+        return NULL;
+    }
+    client->next_id = 1;
+    return client;
+}
+
+void blf_client_close(blf_client_t *client) {
+    if (!client) {
+        return;
+    }
+    close(client->fd);
+    free(client->out);
+    free(client->in);
+    free(client);
+}
+
+// Queue a request whose payload is up to three parts
+static bool queue(blf_client_t *client, blf_net_op_t op,
+                  const void *a, size_t a_length, const void *b, size_t b_length,
+                  const void *c, size_t c_length) {
+    size_t length = a_length + b_length + c_length;
+    if (length > BLF_NET_MAX_FRAME ||
+        !grow(&client->out, &client->out_capacity, client->out_length + sizeof(blf_net_request_t) + length)) {
+        return false;
+    }
+
+    blf_net_request_t header;
+    memset(&header, 0, sizeof(header));
+    header.length = (uint32_t)length;
+    header.id = client->next_id++;
+    header.op = (uint8_t)op;
+
+    char *p = client->out + client->out_length;
+    memcpy(p, &header, sizeof(header));
+    p += sizeof(header);
+    if (a_length) { memcpy(p, a, a_length); p += a_length; }
+    if (b_length) { memcpy(p, b, b_length); p += b_length; }
+    if (c_length) { memcpy(p, c, c_length); }
+
+    client->out_length += sizeof(header) + length;
+    client->pending++;
+    return true;
+}
+
+bool blf_client_send_get(blf_client_t *client, const char *key) {
+    if (!client || !key) {
+        return false;
+    }
+    return queue(client, BLF_NET_GET, key, strlen(key), NULL, 0, NULL, 0);
+}
+
+bool blf_client_send_put(blf_client_t *client, const char *key, const void *value, uint32_t value_length) {
+    if (!client || !key || (!value && value_length > 0)) {
+        return false;
+    }
+    uint32_t key_length = (uint32_t)strlen(key);
+    return queue(client, BLF_NET_PUT, &key_length, sizeof(uint32_t), key, key_length, value, value_length);
+}
+
+bool blf_client_send_delete(blf_client_t *client, const char *key) {
+    if (!client || !key) {
+        return false;
+    }
+    return queue(client, BLF_NET_DELETE, key, strlen(key), NULL, 0, NULL, 0);
+}
+
+// Send everything queued
+static bool flush(blf_client_t *client) {
+    size_t sent = 0;
+    while (sent < client->out_length) {
+        ssize_t n = send(client->fd, client->out + sent, client->out_length - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        sent += (size_t)n;
+    }
+    client->out_length = 0;
+    return true;
+}
+
+// Send queued requests, then wait for the next response
+bool blf_client_recv(blf_client_t *client, blf_reply_t *reply) {
+    if (!client || !reply || client->pending == 0 || !flush(client)) {
+        return false;
+    }
+
+    // The previous reply is no longer referenced
+    if (client->in_start > 0) {
+        memmove(client->in, client->in + client->in_start, client->in_length - client->in_start);
+        client->in_length -= client->in_start;
+        client->in_start = 0;
+    }
+
+    size_t needed = sizeof(blf_net_response_t);
+    for (;;) {
+        if (client->in_length >= sizeof(blf_net_response_t)) {
+            blf_net_response_t header;
+            memcpy(&header, client->in, sizeof(header));
+            if (header.length > BLF_NET_MAX_FRAME) {
+                return false;
+            }
+            needed = sizeof(header) + header.length;
+            if (client->in_length >= needed) {
+                reply->id = header.id;
+                reply->status = (blf_net_status_t)header.status;
+                reply->data = client->in + sizeof(header);
+                reply->length = header.length;
+                client->in_start = needed;
+                client->pending--;
+                return true;
+            }
+        }
+
+        if (!grow(&client->in, &client->in_capacity, needed)) {
+            return false;
+        }
+        ssize_t n = recv(client->fd, client->in + client->in_length, client->in_capacity - client->in_length, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        client->in_length += (size_t)n;
+    }
+}
+
+// Receive the response of the only request in flight
+static bool call(blf_client_t *client, blf_reply_t *reply) {
+    return client->pending == 1 && blf_client_recv(client, reply);
+}
+
+// The blocking helpers below must not be mixed with queued requests that
+// are still waiting for their responses
+
+bool blf_client_get(blf_client_t *client, const char *key, void *value, uint32_t *value_length) {
+    blf_reply_t reply;
+    if (!value_length || (!value && *value_length > 0) || client == NULL || client->pending > 0 ||
+        !blf_client_send_get(client, key) || !call(client, &reply) || reply.status != BLF_NET_OK) {
+        return false;
+    }
+
+    bool fits = reply.length <= *value_length;
+    if (fits && reply.length > 0) {
+        memcpy(value, reply.data, reply.length);
+    }
+    *value_length = reply.length;
+    return fits;
+}
+
+bool blf_client_put(blf_client_t *client, const char *key, const void *value, uint32_t value_length) {
+    blf_reply_t reply;
+    return client && client->pending == 0 && blf_client_send_put(client, key, value, value_length) &&
+           call(client, &reply) && reply.status == BLF_NET_OK;
+}
+
+bool blf_client_delete(blf_client_t *client, const char *key) {
+    blf_reply_t reply;
+    return client && client->pending == 0 && blf_client_send_delete(client, key) &&
+           call(client, &reply) && reply.status == BLF_NET_OK;
+}
+
+// Look up several keys in one round trip; same arena contract as blf_get_many
+bool blf_client_get_many(blf_client_t *client, const char *const keys[], size_t n,
+                         blf_get_result_t results[], void *arena, uint64_t *arena_size) {
+    if (!client || client->pending > 0 || (n > 0 && (!keys || !results)) || n > UINT32_MAX ||
+        !arena_size || (!arena && *arena_size > 0)) {
+        return false;
+    }
+
+    size_t length = 0;
+    for (size_t i = 0; i < n; i++) {
+        length += sizeof(uint32_t) + strlen(keys[i]);
+    }
+    char *payload = (char*)malloc(length ? length : 1);
+    if (!payload) {
+        return false;
+    }
+    char *p = payload;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t key_length = (uint32_t)strlen(keys[i]);
+        memcpy(p, &key_length, sizeof(uint32_t));
+        memcpy(p + sizeof(uint32_t), keys[i], key_length);
+        p += sizeof(uint32_t) + key_length;
+    }
+    uint32_t count = (uint32_t)n;
+    bool queued = queue(client, BLF_NET_GET_MANY, &count, sizeof(uint32_t), payload, length, NULL, 0);
+    free(payload);
+
+    blf_reply_t reply;
+    if (!queued || !call(client, &reply) || reply.status != BLF_NET_OK) {
+        return false;
+    }
+
+    // Values are packed into the arena in key order
+    const char *data = (const char*)reply.data;
+    size_t pos = 0;
+    uint64_t used = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t value_length;
+        if (reply.length - pos < 1 + sizeof(uint32_t)) {
+            return false;
+        }
+        results[i].found = data[pos] != 0;
+        memcpy(&value_length, data + pos + 1, sizeof(uint32_t));
+        pos += 1 + sizeof(uint32_t);
+        if (value_length > reply.length - pos) {
+            return false;
+        }
+        results[i].offset = used;
+        results[i].length = value_length;
+        if (used + value_length <= *arena_size && value_length > 0) {
+            memcpy((char*)arena + used, data + pos, value_length);
+        }
+        used += value_length;
+        pos += value_length;
+    }
+
+    bool fits = used <= *arena_size;
+    *arena_size = used;
+    return fits;
+}
+
+// Fetch up to limit entries whose keys start with prefix (0 means the
+// server default), resuming at *cursor; *cursor becomes BLF_SCAN_END at the
+// end of the file. If fn returns false the rest of this batch is skipped;
+// *cursor still moves past it.
+bool blf_client_scan(blf_client_t *client, const char *prefix, uint64_t *cursor, uint32_t limit,
+                     blf_scan_fn fn, void *user) {
+    if (!client || client->pending > 0 || !cursor || !fn) {
+        return false;
+    }
+    if (!prefix) {
+        prefix = "";
+    }
+
+    blf_reply_t reply;
+    if (!queue(client, BLF_NET_SCAN, cursor, sizeof(uint64_t), &limit, sizeof(uint32_t), prefix, strlen(prefix)) ||
+        !call(client, &reply) || reply.status != BLF_NET_OK || reply.length < sizeof(uint64_t)) {
+        return false;
+    }
+
+    const char *data = (const char*)reply.data;
+    size_t pos = sizeof(uint64_t);
+    while (pos < reply.length) {
+        uint32_t key_length;
+        uint32_t value_length;
+        if (reply.length - pos < 2 * sizeof(uint32_t)) {
+            return false;
+        }
+        memcpy(&key_length, data + pos, sizeof(uint32_t));
+        memcpy(&value_length, data + pos + sizeof(uint32_t), sizeof(uint32_t));
+        pos += 2 * sizeof(uint32_t);
+        if ((uint64_t)key_length + value_length > reply.length - pos) {
+            return false;
+        }
+        if (!fn(user, data + pos, key_length, data + pos + key_length, value_length)) {
+            break;
+        }
+        pos += key_length + value_length;
+    }
+
+    memcpy(cursor, data, sizeof(uint64_t));
+    return true;
+}
+
+// Read raw bytes at offset; *size is updated to the bytes returned
+bool blf_client_read_raw(blf_client_t *client, uint64_t offset, void *data, uint64_t *size) {
+    if (!client || client->pending > 0 || !data || !size) {
+        return false;
+    }
+
+    uint64_t request[2] = {offset, *size};
+    blf_reply_t reply;
+    if (!queue(client, BLF_NET_RAW, request, sizeof(request), NULL, 0, NULL, 0) ||
+        !call(client, &reply) || reply.status != BLF_NET_OK || reply.length > *size) {
+        return false;
+    }
+
+    memcpy(data, reply.data, reply.length);
+    *size = reply.length;
+    return true;
+}
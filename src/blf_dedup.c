@@ -0,0 +1,478 @@
+// Needed for sysconf under -std=c99
+#define _POSIX_C_SOURCE 200809L
+
+#include "blf.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+// Deduplicated raw storage on top of the KV section. A version is split into
+// content-defined chunks with a Gear rolling hash (FastCDC normalized
+// chunking); each chunk is stored once as a KV entry keyed by its SHA-256,
+// and the version itself is a KV entry holding its list of chunk references.
+// A u64 counter per chunk holds the number of references to it from all
+// versions, so a chunk is deleted with its last reference.
+#define BLF_CDC_MIN (2 * 1024)
+#define BLF_CDC_AVG (8 * 1024)
+#define BLF_CDC_MAX (64 * 1024)
+#define BLF_CDC_MASK_S 0xFFFE000000000000ULL  // 15 bits, before the average size
+#define BLF_CDC_MASK_L 0xFFE0000000000000ULL  // 11 bits, after it
+
+#define BLF_DEDUP_MAX_THREADS 8
+#define BLF_DEDUP_KEY_MAX (sizeof(BLF_DEDUP_VERSION_PREFIX) + 256)
+
+// Chunk reference in a version's chunk list
+typedef struct {
+    uint8_t hash[32];  // SHA-256 of the chunk
+    uint32_t length;
+    uint32_t reserved;
+} chunk_ref_t;
+
+// SHA-256 (FIPS 180-4)
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(uint32_t state[8], const uint8_t block[64]) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 |
+               (uint32_t)block[i * 4 + 2] << 8 | (uint32_t)block[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+// SHA-256 digest of a buffer
+void blf_sha256(const void *data, size_t length, uint8_t digest[32]) {
+    uint32_t state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    const uint8_t *p = (const uint8_t*)data;
+    size_t left = length;
+    while (left >= 64) {
+        sha256_block(state, p);
+        p += 64;
+        left -= 64;
+    }
+
+    // Final blocks: the rest, a 1 bit, zeros and the bit length
+    uint8_t block[128];
+    memset(block, 0, sizeof(block));
+    if (left > 0) {
+        memcpy(block, p, left);
+    }
+    block[left] = 0x80;
+    size_t blocks = left < 56 ? 1 : 2;
+    uint64_t bits = (uint64_t)length * 8;
+    for (int i = 0; i < 8; i++) {
+        block[blocks * 64 - 1 - i] = (uint8_t)(bits >> (i * 8));
+    }
+    for (size_t i = 0; i < blocks; i++) {
+        sha256_block(state, block + i * 64);
+    }
+
+    for (int i = 0; i < 8; i++) {
+        digest[i * 4] = (uint8_t)(state[i] >> 24);
+        digest[i * 4 + 1] = (uint8_t)(state[i] >> 16);
+        digest[i * 4 + 2] = (uint8_t)(state[i] >> 8);
+        digest[i * 4 + 3] = (uint8_t)state[i];
+    }
+}
+
+// Gear table: 256 fixed pseudo-random values, so that chunk boundaries are
+// the same in every process
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+static void gear_init(void) {
+    uint64_t x = 0x42B1F000CDC00001ULL;
+    for (int i = 0; i < 256; i++) {
+        // splitmix64
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+// Length of the next chunk. Boundaries are where the rolling hash has its
+// masked bits clear; the stricter mask before the average size and the
+// looser one after it keep chunk sizes close to the average.
+static size_t cdc_cut(const uint8_t *p, size_t n) {
+    if (n <= BLF_CDC_MIN) {
+        return n;
+    }
+    size_t normal = n < BLF_CDC_AVG ? n : BLF_CDC_AVG;
+    size_t max = n < BLF_CDC_MAX ? n : BLF_CDC_MAX;
+
+    uint64_t h = 0;
+    size_t i = BLF_CDC_MIN;
+    for (; i < normal; i++) {
+        h = (h << 1) + gear[p[i]];
+        if (!(h & BLF_CDC_MASK_S)) {
+            return i + 1;
+        }
+    }
+    for (; i < max; i++) {
+        h = (h << 1) + gear[p[i]];
+        if (!(h & BLF_CDC_MASK_L)) {
+            return i + 1;
+        }
+    }
+    return max;
+}
+
+typedef struct {
+    const uint8_t *data;
+    const uint64_t *offsets;  // Chunk start offsets
+    chunk_ref_t *refs;
+    size_t first;             // Chunks this worker hashes
+    size_t last;
+} hash_task_t;
+
+static void *hash_worker(void *arg) {
+    hash_task_t *task = (hash_task_t*)arg;
+    for (size_t i = task->first; i < task->last; i++) {
+        blf_sha256(task->data + task->offsets[i], task->refs[i].length, task->refs[i].hash);
+    }
+    return NULL;
+}
+
+// Hash the chunks on up to one thread per core
+static void hash_chunks(const uint8_t *data, const uint64_t *offsets, chunk_ref_t *refs, size_t count,
+                        uint64_t size) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t threads = cores > 1 ? (size_t)cores : 1;
+    if (threads > BLF_DEDUP_MAX_THREADS) {
+        threads = BLF_DEDUP_MAX_THREADS;
+    }
+    if (threads > count / 16) {
+        threads = count / 16 > 1 ? count / 16 : 1;
+    }
+
+    // Ranges of about equal bytes
+    hash_task_t tasks[BLF_DEDUP_MAX_THREADS];
+    pthread_t handles[BLF_DEDUP_MAX_THREADS];
+    bool started[BLF_DEDUP_MAX_THREADS];
+    size_t next = 0;
+    for (size_t t = 0; t < threads; t++) {
+        uint64_t target = size * (t + 1) / threads;
+        size_t last = next;
+        while (last < count && (t + 1 == threads || offsets[last] < target)) {
+            last++;
+        }
+        tasks[t].data = data;
+        tasks[t].offsets = offsets;
+        tasks[t].refs = refs;
+        tasks[t].first = next;
+        tasks[t].last = last;
+        next = last;
+        started[t] = t > 0 && pthread_create(&handles[t], NULL, hash_worker, &tasks[t]) == 0;
+    }
+
+    hash_worker(&tasks[0]);
+    for (size_t t = 1; t < threads; t++) {
+        if (started[t]) {
+            pthread_join(handles[t], NULL);
+        } else {
+            hash_worker(&tasks[t]);
+        }
+    }
+}
+
+// Key of a chunk's data or counter: the prefix and the hash in hex
+static void hash_key(char *key, const char *prefix, const uint8_t hash[32]) {
+    static const char hex[] = "0123456789abcdef";
+    size_t length = strlen(prefix);
+    memcpy(key, prefix, length);
+    for (int i = 0; i < 32; i++) {
+        key[length + i * 2] = hex[hash[i] >> 4];
+        key[length + i * 2 + 1] = hex[hash[i] & 15];
+    }
+    key[length + 64] = '\0';
+}
+
+static void chunk_key(char *key, const uint8_t hash[32]) {
+    hash_key(key, BLF_DEDUP_CHUNK_PREFIX, hash);
+}
+
+static bool version_key(char *key, const char *name) {
+    size_t length = strlen(name);
+    if (length > BLF_DEDUP_KEY_MAX - sizeof(BLF_DEDUP_VERSION_PREFIX)) {
+        return false;
+    }
+    memcpy(key, BLF_DEDUP_VERSION_PREFIX, sizeof(BLF_DEDUP_VERSION_PREFIX) - 1);
+    memcpy(key + sizeof(BLF_DEDUP_VERSION_PREFIX) - 1, name, length + 1);
+    return true;
+}
+
+// Whether a key exists, without reading its value
+static bool key_exists(blf_file_t *file, const char *key) {
+    char byte;
+    uint32_t length = 0;
+    return blf_get_kv(file, key, &byte, &length) || length > 0;
+}
+
+// Load a version's chunk list
+static bool load_refs(blf_file_t *file, const char *name, chunk_ref_t **refs, size_t *count) {
+    char key[BLF_DEDUP_KEY_MAX];
+    if (!version_key(key, name)) {
+        return false;
+    }
+
+    // A zero-length probe succeeds only for an empty version and otherwise
+    // reports the length of the list, if there is one
+    char byte;
+    uint32_t length = 0;
+    if (!blf_get_kv(file, key, &byte, &length) && length == 0) {
+        return false;
+    }
+
+    *refs = (chunk_ref_t*)malloc(length ? length : 1);
+    if (!*refs) {
+        return false;
+    }
+    if (length > 0 && !blf_get_kv(file, key, *refs, &length)) {
+        free(*refs);
+        return false;
+    }
+    *count = length / sizeof(chunk_ref_t);
+    return true;
+}
+
+static int compare_ref(const void *a, const void *b) {
+    return memcmp(((const chunk_ref_t*)a)->hash, ((const chunk_ref_t*)b)->hash, 32);
+}
+
+// Number of refs from i on with the same hash as refs[i], in a sorted list
+static size_t run_length(const chunk_ref_t *refs, size_t count, size_t i) {
+    size_t n = 1;
+    while (i + n < count && compare_ref(&refs[i], &refs[i + n]) == 0) {
+        n++;
+    }
+    return n;
+}
+
+// Move the reference counts from one sorted chunk list to another, touching
+// only the chunks whose number of occurrences differs. The add pass raises
+// the counts that grow and the drop pass lowers those that shrink, deleting
+// a chunk that loses its last reference along with its counter.
+static bool update_refs(blf_file_t *file, const chunk_ref_t *old_refs, size_t old_count,
+                        const chunk_ref_t *new_refs, size_t new_count, bool add) {
+    char chunk[sizeof(BLF_DEDUP_CHUNK_PREFIX) + 64];
+    char counter[sizeof(BLF_DEDUP_REFS_PREFIX) + 64];
+    bool ok = true;
+    size_t i = 0, j = 0;
+    while (ok && (i < old_count || j < new_count)) {
+        int order = i == old_count ? 1 : j == new_count ? -1 : compare_ref(&old_refs[i], &new_refs[j]);
+        size_t old_n = order <= 0 ? run_length(old_refs, old_count, i) : 0;
+        size_t new_n = order >= 0 ? run_length(new_refs, new_count, j) : 0;
+        const uint8_t *hash = order <= 0 ? old_refs[i].hash : new_refs[j].hash;
+        i += old_n;
+        j += new_n;
+        if (add ? new_n <= old_n : old_n <= new_n) {
+            continue;
+        }
+
+        hash_key(counter, BLF_DEDUP_REFS_PREFIX, hash);
+        uint64_t uses;
+        if (add) {
+            ok = blf_incr_u64(file, counter, new_n - old_n, NULL);
+        } else if (!blf_get_u64(file, counter, &uses)) {
+            continue;  // Not counted: keep the chunk
+        } else if (uses > old_n - new_n) {
+            ok = blf_put_u64(file, counter, uses - (old_n - new_n));
+        } else {
+            chunk_key(chunk, hash);
+            ok = blf_delete_kv(file, chunk) && blf_delete_kv(file, counter);
+        }
+    }
+    return ok;
+}
+
+// Store a version of a payload, writing only the chunks not stored yet
+bool blf_dedup_write(blf_file_t *file, const char *name, const void *data, uint64_t size,
+                     blf_dedup_stats_t *stats) {
+    char key[BLF_DEDUP_KEY_MAX];
+    if (!file || !file->fp || !name || (!data && size > 0) || !version_key(key, name)) {
+        return false;
+    }
+    pthread_once(&gear_once, gear_init);
+
+    // Split into chunks; the list is the version's value, so it must fit
+    const uint8_t *bytes = (const uint8_t*)data;
+    size_t capacity = (size_t)(size / BLF_CDC_AVG) + 16;
+    chunk_ref_t *refs = (chunk_ref_t*)malloc(capacity * sizeof(chunk_ref_t));
+    uint64_t *offsets = (uint64_t*)malloc(capacity * sizeof(uint64_t));
+    size_t count = 0;
+    bool ok = refs && offsets;
+    for (uint64_t pos = 0; ok && pos < size; ) {
+        if (count == capacity) {
+            capacity *= 2;
+            chunk_ref_t *grown_refs = (chunk_ref_t*)realloc(refs, capacity * sizeof(chunk_ref_t));
+            uint64_t *grown_offsets = grown_refs ? (uint64_t*)realloc(offsets, capacity * sizeof(uint64_t)) : NULL;
+            if (grown_refs) refs = grown_refs;
+            if (grown_offsets) offsets = grown_offsets;
+            ok = grown_refs && grown_offsets;
+            if (!ok) break;
+        }
+        uint64_t left = size - pos;
+        size_t length = cdc_cut(bytes + pos, left < BLF_CDC_MAX ? (size_t)left : BLF_CDC_MAX);
+        offsets[count] = pos;
+        refs[count].length = (uint32_t)length;
+        refs[count].reserved = 0;
+        count++;
+        pos += length;
+    }
+    if (ok && (uint64_t)count * sizeof(chunk_ref_t) > UINT32_MAX) {
+        ok = false;
+    }
+
+    blf_dedup_stats_t local;
+    memset(&local, 0, sizeof(local));
+    local.size = size;
+    local.chunks = count;
+
+    if (ok) {
+        hash_chunks(bytes, offsets, refs, count, size);
+    }
+
+    // Store the chunks that are new; a chunk repeated within the version is
+    // found by the lookup after its first put
+    char chunk[sizeof(BLF_DEDUP_CHUNK_PREFIX) + 64];
+    for (size_t i = 0; ok && i < count; i++) {
+        chunk_key(chunk, refs[i].hash);
+        if (key_exists(file, chunk)) {
+            continue;
+        }
+        ok = blf_put_kv(file, chunk, bytes + offsets[i], refs[i].length);
+        local.new_chunks++;
+        local.new_bytes += refs[i].length;
+    }
+
+    // The chunk list goes last, so a version never names missing chunks.
+    // Counts that grow are raised before the list is stored and counts that
+    // shrink are lowered after it, so a chunk both versions use is kept and
+    // an edit touches only the counters of the chunks it changed.
+    chunk_ref_t *old_refs = NULL;
+    size_t old_count = 0;
+    if (ok && !load_refs(file, name, &old_refs, &old_count)) {
+        old_refs = NULL;
+        old_count = 0;
+    }
+    chunk_ref_t *sorted = ok ? (chunk_ref_t*)malloc((count ? count : 1) * sizeof(chunk_ref_t)) : NULL;
+    ok = ok && sorted;
+    if (ok) {
+        memcpy(sorted, refs, count * sizeof(chunk_ref_t));
+        qsort(sorted, count, sizeof(chunk_ref_t), compare_ref);
+        if (old_count > 0) {
+            qsort(old_refs, old_count, sizeof(chunk_ref_t), compare_ref);
+        }
+        ok = update_refs(file, old_refs, old_count, sorted, count, true) &&
+             blf_put_kv(file, key, count ? (const void*)refs : (const void*)"", (uint32_t)(count * sizeof(chunk_ref_t))) &&
+             update_refs(file, old_refs, old_count, sorted, count, false);
+    }
+
+    free(sorted);
+    free(old_refs);
+    free(refs);
+    free(offsets);
+    if (ok && stats) {
+        *stats = local;
+    }
+    return ok;
+}
+
+// Read a version back. *size is the buffer size on input and the version
+// size on output; if the buffer is too small, false is returned with *size
+// set to the size needed.
+bool blf_dedup_read(blf_file_t *file, const char *name, void *data, uint64_t *size) {
+    if (!file || !file->fp || !name || !size || (!data && *size > 0)) {
+        return false;
+    }
+
+    chunk_ref_t *refs;
+    size_t count;
+    if (!load_refs(file, name, &refs, &count)) {
+        return false;
+    }
+
+    uint64_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        total += refs[i].length;
+    }
+    if (total > *size) {
+        free(refs);
+        *size = total;
+        return false;
+    }
+
+    char chunk[sizeof(BLF_DEDUP_CHUNK_PREFIX) + 64];
+    uint64_t pos = 0;
+    bool ok = true;
+    for (size_t i = 0; ok && i < count; i++) {
+        uint32_t length = refs[i].length;
+        chunk_key(chunk, refs[i].hash);
+        ok = blf_get_kv(file, chunk, (char*)data + pos, &length) && length == refs[i].length;
+        pos += length;
+    }
+
+    free(refs);
+    if (ok) {
+        *size = total;
+    }
+    return ok;
+}
+
+// Delete a version and the chunks that no other version uses
+bool blf_dedup_delete(blf_file_t *file, const char *name) {
+    char key[BLF_DEDUP_KEY_MAX];
+    if (!file || !file->fp || !name || !version_key(key, name)) {
+        return false;
+    }
+
+    chunk_ref_t *refs;
+    size_t count;
+    if (!load_refs(file, name, &refs, &count)) {
+        return true;
+    }
+
+    if (count > 0) {
+        qsort(refs, count, sizeof(chunk_ref_t), compare_ref);
+    }
+    bool ok = blf_delete_kv(file, key) && update_refs(file, refs, count, NULL, 0, false);
+    free(refs);
+    return ok;
+}
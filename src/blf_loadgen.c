@@ -0,0 +1,247 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "blf_net.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+// Load generator for blf_serve: each thread opens its own connection and
+// keeps `pipeline` requests in flight, mixing gets and puts over a key space.
+typedef struct {
+    const char *socket_path;
+    int clients;
+    long requests;     // Per client
+    int pipeline;
+    long keys;
+    uint32_t value_size;
+    int write_percent;
+    bool preload;
+} options_t;
+
+typedef struct {
+    const options_t *options;
+    int index;
+    double *latencies;  // Seconds, one per request
+    long completed;
+    long errors;
+    bool failed;
+} worker_t;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Small xorshift generator, one state per thread
+static uint64_t next_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+// Receive count responses; returns false if the connection failed
+static bool drain(blf_client_t *client, int count, worker_t *worker, double start) {
+    for (int i = 0; i < count; i++) {
+        blf_reply_t reply;
+        if (!blf_client_recv(client, &reply)) {
+            return false;
+        }
+        if (reply.status != BLF_NET_OK && reply.status != BLF_NET_NOT_FOUND) {
+            worker->errors++;
+        }
+        if (worker->latencies) {
+            worker->latencies[worker->completed] = now_seconds() - start;
+        }
+        worker->completed++;
+    }
+    return true;
+}
+
+static void *run_worker(void *arg) {
+    worker_t *worker = (worker_t*)arg;
+    const options_t *options = worker->options;
+    blf_client_t *client = blf_client_connect(options->socket_path);
+    char *value = (char*)malloc(options->value_size ? options->value_size : 1);
+    if (!client || !value) {
+        worker->failed = true;
+        blf_client_close(client);
+        free(value);
+        return NULL;
+    }
+    memset(value, 'v', options->value_size);
+
+    uint64_t state = 0x9e3779b97f4a7c15ULL * (uint64_t)(worker->index + 1);
+    char key[32];
+    long sent = 0;
+    while (sent < options->requests) {
+        int batch = options->pipeline;
+        if (batch > options->requests - sent) {
+            batch = (int)(options->requests - sent);
+        }
+
+        double start = now_seconds();
+        for (int i = 0; i < batch; i++) {
+            snprintf(key, sizeof(key), "key%08ld", (long)(next_random(&state) % (uint64_t)options->keys));
+            bool queued = (int)(next_random(&state) % 100) < options->write_percent
+                ? blf_client_send_put(client, key, value, options->value_size)
+                : blf_client_send_get(client, key);
+            if (!queued) {
+                worker->failed = true;
+                break;
+            }
+        }
+        if (worker->failed || !drain(client, batch, worker, start)) {
+            worker->failed = true;
+            break;
+        }
+        sent += batch;
+    }
+
+    blf_client_close(client);
+    free(value);
+    return NULL;
+}
+
+// Put every key once so that gets hit
+static bool preload(const options_t *options) {
+    blf_client_t *client = blf_client_connect(options->socket_path);
+    char *value = (char*)malloc(options->value_size ? options->value_size : 1);
+    bool ok = client && value;
+    if (ok) {
+        memset(value, 'v', options->value_size);
+    }
+
+    char key[32];
+    worker_t worker;
+    memset(&worker, 0, sizeof(worker));
+    for (long i = 0; ok && i < options->keys; ) {
+        int batch = 0;
+        for (; batch < 256 && i < options->keys; batch++, i++) {
+            snprintf(key, sizeof(key), "key%08ld", i);
+            ok = ok && blf_client_send_put(client, key, value, options->value_size);
+        }
+        ok = ok && drain(client, batch, &worker, 0);
+    }
+
+    blf_client_close(client);
+    free(value);
+    return ok && worker.errors == 0;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void print_usage(const char *program) {
+    printf("Usage: %s --socket <path> [options]\n", program);
+    printf("  --clients <n>      Connections, one thread each (default 4)\n");
+    printf("  --requests <n>     Requests per connection (default 100000)\n");
+    printf("  --pipeline <n>     Requests in flight per connection (default 32)\n");
+    printf("  --keys <n>         Size of the key space (default 10000)\n");
+    printf("  --value-size <n>   Bytes per put (default 100)\n");
+    printf("  --write-ratio <n>  Percentage of puts (default 10)\n");
+    printf("  --preload          Put every key before the run\n");
+}
+
+int main(int argc, char *argv[]) {
+    options_t options = {NULL, 4, 100000, 32, 10000, 100, 10, false};
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--socket") == 0 && has_value) {
+            options.socket_path = argv[++i];
+        } else if (strcmp(argv[i], "--clients") == 0 && has_value) {
+            options.clients = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--requests") == 0 && has_value) {
+            options.requests = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--pipeline") == 0 && has_value) {
+            options.pipeline = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--keys") == 0 && has_value) {
+            options.keys = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--value-size") == 0 && has_value) {
+            options.value_size = (uint32_t)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--write-ratio") == 0 && has_value) {
+            options.write_percent = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--preload") == 0) {
+            options.preload = true;
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!options.socket_path || options.clients < 1 || options.requests < 1 ||
+        options.pipeline < 1 || options.keys < 1) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (options.preload && !preload(&options)) {
+        fprintf(stderr, "Error: Failed to preload keys\n");
+        return 1;
+    }
+
+    worker_t *workers = (worker_t*)calloc(options.clients, sizeof(worker_t));
+    pthread_t *threads = (pthread_t*)calloc(options.clients, sizeof(pthread_t));
+    if (!workers || !threads) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return 1;
+    }
+
+    double start = now_seconds();
+    for (int i = 0; i < options.clients; i++) {
+        workers[i].options = &options;
+        workers[i].index = i;
+        workers[i].latencies = (double*)malloc(options.requests * sizeof(double));
+        pthread_create(&threads[i], NULL, run_worker, &workers[i]);
+    }
+    for (int i = 0; i < options.clients; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now_seconds() - start;
+
+    long completed = 0;
+    long errors = 0;
+    bool failed = false;
+    for (int i = 0; i < options.clients; i++) {
+        completed += workers[i].completed;
+        errors += workers[i].errors;
+        failed = failed || workers[i].failed;
+    }
+
+    double *latencies = (double*)malloc((completed ? completed : 1) * sizeof(double));
+    long n = 0;
+    for (int i = 0; i < options.clients; i++) {
+        if (workers[i].latencies && latencies) {
+            memcpy(latencies + n, workers[i].latencies, workers[i].completed * sizeof(double));
+            n += workers[i].completed;
+        }
+        free(workers[i].latencies);
+    }
+
+    printf("%ld requests in %.2f s: %.0f ops/s (%d clients, pipeline %d, %d%% writes)\n",
+           completed, elapsed, completed / elapsed, options.clients, options.pipeline, options.write_percent);
+    if (n > 0) {
+        qsort(latencies, n, sizeof(double), compare_double);
+        printf("latency p50 %.1f us, p99 %.1f us, max %.1f us\n",
+               latencies[n / 2] * 1e6, latencies[n * 99 / 100] * 1e6, latencies[n - 1] * 1e6);
+    }
+    if (errors > 0) {
+        printf("%ld requests failed\n", errors);
+    }
+
+    free(latencies);
+    free(threads);
+    free(workers);
+    if (failed) {
+        fprintf(stderr, "Error: Connection to %s failed\n", options.socket_path);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,117 @@
+#ifndef BLF_NET_H
+#define BLF_NET_H
+
+#include "blf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Binary protocol over a Unix stream socket. Every request and response is
+// a fixed header followed by `length` payload bytes. Integers are in the
+// host's byte order: both ends of a Unix socket run on the same machine.
+// Requests may be pipelined: responses come back in request order, with the
+// request's id.
+//
+// Request payloads:
+//   GET       key
+//   PUT       u32 key_length, key, value
+//   DELETE    key
+//   GET_MANY  u32 count, then count x (u32 key_length, key)
+//   SCAN      u64 cursor, u32 limit, key prefix
+//   RAW       u64 offset, u64 length
+//
+// Response payloads (status BLF_NET_OK):
+//   GET       value
+//   GET_MANY  count x (u8 found, u32 value_length, value)
+//   SCAN      u64 next cursor, then entries of (u32 key_length,
+//             u32 value_length, key, value)
+//   RAW       raw bytes (clamped to the raw section)
+//
+// No response payload exceeds BLF_NET_MAX_FRAME. A GET or GET_MANY whose
+// values would is answered with BLF_NET_ERROR; a SCAN page ends before an
+// entry that does not fit, and fails only on a matching entry that fits no
+// frame.
+#define BLF_NET_MAX_FRAME (64 * 1024 * 1024)  // Largest accepted payload
+
+typedef enum {
+    BLF_NET_GET = 1,
+    BLF_NET_PUT = 2,
+    BLF_NET_DELETE = 3,
+    BLF_NET_GET_MANY = 4,
+    BLF_NET_SCAN = 5,
+    BLF_NET_RAW = 6
+} blf_net_op_t;
+
+typedef enum {
+    BLF_NET_OK = 0,
+    BLF_NET_NOT_FOUND = 1,
+    BLF_NET_BAD_REQUEST = 2,
+    BLF_NET_ERROR = 3
+} blf_net_status_t;
+
+typedef struct {
+    uint32_t length;  // Payload bytes
+    uint32_t id;      // Echoed in the response
+    uint8_t op;       // blf_net_op_t
+    uint8_t reserved[3];
+} blf_net_request_t;
+
+typedef struct {
+    uint32_t length;  // Payload bytes
+    uint32_t id;      // Id of the request
+    uint8_t status;   // blf_net_status_t
+    uint8_t reserved[3];
+} blf_net_response_t;
+
+// Server. Requests are executed in arrival order; the writes handled in one
+// event loop iteration are committed together (with sync set) before any of
+// their responses is sent. A connection is not read while it has more than
+// a few MB of unsent responses. The socket path may replace a stale socket
+// but no other file. Lookups go through the value cache, which the server
+// enables unless the handle already has one. Returns when *stop becomes
+// non-zero.
+typedef struct {
+    const char *socket_path;
+    bool sync;             // blf_commit() each batch of writes
+    volatile int *stop;    // Checked at least every 100 ms
+    uint64_t cache_bytes;  // Value cache budget; 0 for the default (64 MB)
+} blf_serve_options_t;
+
+bool blf_serve(blf_file_t *file, const blf_serve_options_t *options);
+
+// Client. Each request function queues a request; blf_client_recv sends
+// whatever is queued and returns the next response, so several requests can
+// be in flight. The blocking helpers send one request and wait for its
+// response. A client must not be shared between threads.
+typedef struct blf_client blf_client_t;
+
+typedef struct {
+    uint32_t id;
+    blf_net_status_t status;
+    const void *data;  // Payload, valid until the next receive
+    uint32_t length;
+} blf_reply_t;
+
+blf_client_t *blf_client_connect(const char *socket_path);
+void blf_client_close(blf_client_t *client);
+
+bool blf_client_send_get(blf_client_t *client, const char *key);
+bool blf_client_send_put(blf_client_t *client, const char *key, const void *value, uint32_t value_length);
+bool blf_client_send_delete(blf_client_t *client, const char *key);
+bool blf_client_recv(blf_client_t *client, blf_reply_t *reply);
+
+bool blf_client_get(blf_client_t *client, const char *key, void *value, uint32_t *value_length);
+bool blf_client_put(blf_client_t *client, const char *key, const void *value, uint32_t value_length);
+bool blf_client_delete(blf_client_t *client, const char *key);
+bool blf_client_get_many(blf_client_t *client, const char *const keys[], size_t n,
+                         blf_get_result_t results[], void *arena, uint64_t *arena_size);
+bool blf_client_scan(blf_client_t *client, const char *prefix, uint64_t *cursor, uint32_t limit,
+                     blf_scan_fn fn, void *user);
+bool blf_client_read_raw(blf_client_t *client, uint64_t offset, void *data, uint64_t *size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BLF_NET_H
@@ -0,0 +1,666 @@
+// Needed for accept4 and MSG_NOSIGNAL
+#define _GNU_SOURCE
+
+#include "blf_net.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define BLF_SERVE_MAX_EVENTS 64
+#define BLF_SERVE_READ_SIZE (64 * 1024)
+#define BLF_SERVE_SCAN_BYTES (4 * 1024 * 1024)  // Largest scan response
+#define BLF_SERVE_SCAN_LIMIT 1000               // Entries per scan by default
+#define BLF_SERVE_SCAN_BATCH 64                 // Entries per blf_scan_batch call
+#define BLF_SERVE_SCAN_ARENA (256 * 1024)       // Scan arena, grown for larger entries
+#define BLF_SERVE_OUT_LIMIT (4 * 1024 * 1024)   // Unsent bytes before a connection stops being read
+#define BLF_SERVE_CACHE_BYTES (64 * 1024 * 1024)  // Default value cache budget
+
+// Growable byte buffer; bytes before start are consumed
+typedef struct {
+    char *data;
+    size_t start;
+    size_t length;
+    size_t capacity;
+} buffer_t;
+
+typedef struct {
+    int fd;
+    buffer_t in;
+    buffer_t out;
+    uint32_t events;  // Registered epoll events
+    bool blocked;     // Requests wait until the output drains below BLF_SERVE_OUT_LIMIT
+    bool eof;         // The peer closed its side; closed once the responses are sent
+    bool closed;      // Freed at the end of the loop iteration
+} conn_t;
+
+typedef struct {
+    blf_file_t *file;
+    const blf_serve_options_t *options;
+    int epoll_fd;
+    conn_t **conns;
+    size_t conn_count;
+    size_t conn_capacity;
+    bool dirty;        // Writes not committed yet
+} server_t;
+
+// Make room for extra bytes after the buffer's data
+static bool buffer_reserve(buffer_t *b, size_t extra) {
+    if (b->start > 0 && b->length + extra > b->capacity) {
+        memmove(b->data, b->data + b->start, b->length - b->start);
+        b->length -= b->start;
+        b->start = 0;
+    }
+    if (b->length + extra <= b->capacity) {
+        return true;
+    }
+
+    size_t capacity = b->capacity ? b->capacity : BLF_SERVE_READ_SIZE;
+    while (capacity < b->length + extra) {
+        capacity *= 2;
+    }
+    char *data = (char*)realloc(b->data, capacity);
+    if (!data) {
+        return false;
+    }
+    b->data = data;
+    b->capacity = capacity;
+    return true;
+}
+
+static bool buffer_append(buffer_t *b, const void *data, size_t length) {
+    if (!buffer_reserve(b, length)) {
+        return false;
+    }
+    memcpy(b->data + b->length, data, length);
+    b->length += length;
+    return true;
+}
+
+// Start a response; returns the offset of its header from the output
+// buffer's start, which stays valid when buffer_reserve compacts the buffer
+static bool response_begin(conn_t *conn, uint32_t id, size_t *begin) {
+    blf_net_response_t header;
+    memset(&header, 0, sizeof(header));
+    header.id = id;
+    *begin = conn->out.length - conn->out.start;
+    return buffer_append(&conn->out, &header, sizeof(header));
+}
+
+// Finish a response: fill in the status and the payload length. The
+// handlers keep payloads within BLF_NET_MAX_FRAME; one that is not is
+// replaced by an error rather than sent with a truncated length.
+static void response_end(conn_t *conn, size_t begin, blf_net_status_t status) {
+    blf_net_response_t *header = (blf_net_response_t*)(conn->out.data + conn->out.start + begin);
+    if (conn->out.length - conn->out.start - begin - sizeof(blf_net_response_t) > BLF_NET_MAX_FRAME) {
+        status = BLF_NET_ERROR;
+    }
+    if (status != BLF_NET_OK) {
+        conn->out.length = conn->out.start + begin + sizeof(blf_net_response_t);
+    }
+    header->status = (uint8_t)status;
+    header->length = (uint32_t)(conn->out.length - conn->out.start - begin - sizeof(blf_net_response_t));
+}
+
+// Keys are used in place in the request, without a NUL-terminated copy. A
+// value too large for a response frame is an error.
+static blf_net_status_t handle_get(server_t *server, conn_t *conn, const char *payload, uint32_t length) {
+    uint32_t capacity = 4096;
+    for (;;) {
+        if (!buffer_reserve(&conn->out, capacity)) {
+            return BLF_NET_ERROR;
+        }
+        uint32_t value_length = capacity;
+        if (blf_get_kv_n(server->file, payload, length, conn->out.data + conn->out.length, &value_length)) {
+            conn->out.length += value_length;
+            return BLF_NET_OK;
+        }
+        if (value_length <= capacity) {
+            return BLF_NET_NOT_FOUND;
+        }
+        if (value_length > BLF_NET_MAX_FRAME) {
+            return BLF_NET_ERROR;
+        }
+        capacity = value_length;
+    }
+}
+
+static blf_net_status_t handle_put(server_t *server, const char *payload, uint32_t length) {
+    uint32_t key_length;
+    if (length < sizeof(uint32_t)) {
+        return BLF_NET_BAD_REQUEST;
+    }
+    memcpy(&key_length, payload, sizeof(uint32_t));
+    if (key_length > length - sizeof(uint32_t)) {
+        return BLF_NET_BAD_REQUEST;
+    }
+
+    const char *key = payload + sizeof(uint32_t);
+    const char *value = payload + sizeof(uint32_t) + key_length;
+    uint32_t value_length = length - sizeof(uint32_t) - key_length;
+    server->dirty = true;
+    return blf_put_kv_n(server->file, key, key_length, value, value_length) ? BLF_NET_OK : BLF_NET_ERROR;
+}
+
+static blf_net_status_t handle_delete(server_t *server, const char *payload, uint32_t length) {
+    server->dirty = true;
+    return blf_delete_kv_n(server->file, payload, length) ? BLF_NET_OK : BLF_NET_ERROR;
+}
+
+static blf_net_status_t handle_get_many(server_t *server, conn_t *conn, const char *payload, uint32_t length) {
+    uint32_t count;
+    if (length < sizeof(uint32_t)) {
+        return BLF_NET_BAD_REQUEST;
+    }
+    memcpy(&count, payload, sizeof(uint32_t));
+    if (count > length / sizeof(uint32_t)) {
+        return BLF_NET_BAD_REQUEST;
+    }
+
+    // The keys are looked up in place, with their lengths
+    const char **keys = (const char**)malloc((count ? count : 1) * sizeof(char*));
+    uint32_t *key_lengths = (uint32_t*)malloc((count ? count : 1) * sizeof(uint32_t));
+    blf_get_result_t *results = (blf_get_result_t*)malloc((count ? count : 1) * sizeof(blf_get_result_t));
+    blf_net_status_t status = keys && key_lengths && results ? BLF_NET_OK : BLF_NET_ERROR;
+
+    size_t pos = sizeof(uint32_t);
+    for (uint32_t i = 0; status == BLF_NET_OK && i < count; i++) {
+        if (length - pos < sizeof(uint32_t)) {
+            status = BLF_NET_BAD_REQUEST;
+            break;
+        }
+        memcpy(&key_lengths[i], payload + pos, sizeof(uint32_t));
+        pos += sizeof(uint32_t);
+        if (key_lengths[i] > length - pos || key_lengths[i] > BLF_KV_KEY_MASK) {
+            status = BLF_NET_BAD_REQUEST;
+            break;
+        }
+        keys[i] = payload + pos;
+        pos += key_lengths[i];
+    }
+
+    // Values go to an arena sized by a first attempt
+    char *arena = NULL;
+    uint64_t arena_size = 0;
+    if (status == BLF_NET_OK && !blf_get_many_n(server->file, keys, key_lengths, count, results, NULL, &arena_size)) {
+        // Each result takes a found byte and a length besides its value
+        if (arena_size + (uint64_t)count * (1 + sizeof(uint32_t)) > BLF_NET_MAX_FRAME) {
+            status = BLF_NET_ERROR;
+        }
+    }
+    if (status == BLF_NET_OK && arena_size > 0) {
+        arena = (char*)malloc(arena_size);
+        if (!arena || !blf_get_many_n(server->file, keys, key_lengths, count, results, arena, &arena_size)) {
+            status = BLF_NET_ERROR;
+        }
+    }
+
+    for (uint32_t i = 0; status == BLF_NET_OK && i < count; i++) {
+        uint8_t found = results[i].found;
+        uint32_t value_length = found ? results[i].length : 0;
+        if (!buffer_append(&conn->out, &found, 1) ||
+            !buffer_append(&conn->out, &value_length, sizeof(uint32_t)) ||
+            (value_length > 0 && !buffer_append(&conn->out, arena + results[i].offset, value_length))) {
+            status = BLF_NET_ERROR;
+        }
+    }
+
+    free(arena);
+    free(results);
+    free(key_lengths);
+    free(keys);
+    return status;
+}
+
+static bool has_prefix(const char *key, uint32_t key_length, const char *prefix, uint32_t prefix_length) {
+    return key_length >= prefix_length && memcmp(key, prefix, prefix_length) == 0;
+}
+
+typedef struct {
+    const char *prefix;
+    uint32_t prefix_length;
+    bool matched;
+} scan_probe_t;
+
+// Visit a single entry, noting whether its key has the prefix
+static bool probe_entry(void *user, const char *key, uint32_t key_length, const void *value, uint32_t value_length) {
+    scan_probe_t *probe = (scan_probe_t*)user;
+    (void)value;
+    (void)value_length;
+    probe->matched = has_prefix(key, key_length, probe->prefix, probe->prefix_length);
+    return false;
+}
+
+// Entries are copied in batches that fit the rest of the response frame.
+// The page ends before an entry that does not fit, and the cursor returned
+// points at it; a matching entry too large for any frame is an error.
+static blf_net_status_t handle_scan(server_t *server, conn_t *conn, const char *payload, uint32_t length) {
+    uint64_t cursor;
+    uint32_t limit;
+    if (length < sizeof(uint64_t) + sizeof(uint32_t)) {
+        return BLF_NET_BAD_REQUEST;
+    }
+    memcpy(&cursor, payload, sizeof(uint64_t));
+    memcpy(&limit, payload + sizeof(uint64_t), sizeof(uint32_t));
+    const char *prefix = payload + sizeof(uint64_t) + sizeof(uint32_t);
+    uint32_t prefix_length = length - sizeof(uint64_t) - sizeof(uint32_t);
+    uint32_t remaining = limit ? limit : BLF_SERVE_SCAN_LIMIT;
+
+    // The next cursor leads the payload and is filled in after the scan
+    size_t payload_start = conn->out.length - conn->out.start;
+    if (!buffer_append(&conn->out, &cursor, sizeof(uint64_t))) {
+        return BLF_NET_ERROR;
+    }
+    uint64_t used = sizeof(uint64_t);  // Payload bytes so far
+    const uint64_t overhead = 2 * sizeof(uint32_t);  // Lengths before each entry
+
+    blf_scan_entry_t entries[BLF_SERVE_SCAN_BATCH];
+    uint64_t arena_capacity = BLF_SERVE_SCAN_ARENA;
+    char *arena = (char*)malloc(arena_capacity);
+    blf_net_status_t status = arena ? BLF_NET_OK : BLF_NET_ERROR;
+    while (status == BLF_NET_OK && remaining > 0 && cursor != BLF_SCAN_END && used < BLF_SERVE_SCAN_BYTES) {
+        size_t max_entries = remaining < BLF_SERVE_SCAN_BATCH ? remaining : BLF_SERVE_SCAN_BATCH;
+        uint64_t budget = BLF_NET_MAX_FRAME - used;
+        if (budget < max_entries * overhead + 1) {
+            break;
+        }
+        uint64_t arena_size = budget - max_entries * overhead;
+        arena_size = arena_size < arena_capacity ? arena_size : arena_capacity;
+        uint64_t offered = arena_size;
+        size_t count = 0;
+        if (!blf_scan_batch(server->file, &cursor, entries, max_entries, &count, arena, &arena_size)) {
+            if (arena_size <= offered) {
+                status = BLF_NET_BAD_REQUEST;
+            } else if (arena_size + overhead <= budget) {
+                // A single large entry: grow the arena and take it alone
+                char *grown = (char*)realloc(arena, arena_size);
+                if (!grown) {
+                    status = BLF_NET_ERROR;
+                    break;
+                }
+                arena = grown;
+                arena_capacity = arena_size;
+                if (!blf_scan_batch(server->file, &cursor, entries, 1, &count, arena, &arena_size)) {
+                    status = BLF_NET_BAD_REQUEST;
+                }
+            } else if (used > sizeof(uint64_t)) {
+                break;  // Left for the next page
+            } else {
+                // Too large for any frame: skip it unless it matches
+                scan_probe_t probe = { prefix, prefix_length, false };
+                if (!blf_scan(server->file, &cursor, probe_entry, &probe)) {
+                    status = BLF_NET_BAD_REQUEST;
+                } else if (probe.matched) {
+                    status = BLF_NET_ERROR;
+                }
+                continue;
+            }
+        }
+
+        for (size_t i = 0; status == BLF_NET_OK && i < count; i++) {
+            const char *key = arena + entries[i].offset;
+            if (!has_prefix(key, entries[i].key_length, prefix, prefix_length)) {
+                continue;
+            }
+            if (!buffer_append(&conn->out, &entries[i].key_length, sizeof(uint32_t)) ||
+                !buffer_append(&conn->out, &entries[i].value_length, sizeof(uint32_t)) ||
+                !buffer_append(&conn->out, key, (size_t)entries[i].key_length + entries[i].value_length)) {
+                status = BLF_NET_ERROR;
+            }
+            used += overhead + entries[i].key_length + entries[i].value_length;
+            remaining--;
+        }
+    }
+
+    free(arena);
+    if (status == BLF_NET_OK) {
+        memcpy(conn->out.data + conn->out.start + payload_start, &cursor, sizeof(uint64_t));
+    }
+    return status;
+}
+
+static blf_net_status_t handle_raw(server_t *server, conn_t *conn, const char *payload, uint32_t length) {
+    uint64_t offset;
+    uint64_t size;
+    if (length != 2 * sizeof(uint64_t)) {
+        return BLF_NET_BAD_REQUEST;
+    }
+    memcpy(&offset, payload, sizeof(uint64_t));
+    memcpy(&size, payload + sizeof(uint64_t), sizeof(uint64_t));
+    if (size > BLF_NET_MAX_FRAME) {
+        size = BLF_NET_MAX_FRAME;
+    }
+
+    if (!buffer_reserve(&conn->out, (size_t)size)) {
+        return BLF_NET_ERROR;
+    }
+    if (size > 0 && !blf_read_raw_at(server->file, offset, conn->out.data + conn->out.length, &size)) {
+        return BLF_NET_BAD_REQUEST;
+    }
+    conn->out.length += (size_t)size;
+    return BLF_NET_OK;
+}
+
+// Execute one request, appending its response to the output buffer
+static bool handle_request(server_t *server, conn_t *conn, const blf_net_request_t *request, const char *payload) {
+    size_t begin;
+    if (!response_begin(conn, request->id, &begin)) {
+        return false;
+    }
+
+    blf_net_status_t status;
+    switch (request->op) {
+    case BLF_NET_GET:      status = handle_get(server, conn, payload, request->length); break;
+    case BLF_NET_PUT:      status = handle_put(server, payload, request->length); break;
+    case BLF_NET_DELETE:   status = handle_delete(server, payload, request->length); break;
+    case BLF_NET_GET_MANY: status = handle_get_many(server, conn, payload, request->length); break;
+    case BLF_NET_SCAN:     status = handle_scan(server, conn, payload, request->length); break;
+    case BLF_NET_RAW:      status = handle_raw(server, conn, payload, request->length); break;
+    default:               status = BLF_NET_BAD_REQUEST; break;
+    }
+
+    response_end(conn, begin, status);
+    return true;
+}
+
+static void conn_close(server_t *server, conn_t *conn) {
+    if (!conn->closed) {
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+        close(conn->fd);
+        conn->closed = true;
+    }
+}
+
+static size_t out_pending(const conn_t *conn) {
+    return conn->out.length - conn->out.start;
+}
+
+// Register interest in input only while the connection may be read, and in
+// output while responses are queued
+static void conn_update_events(server_t *server, conn_t *conn) {
+    if (conn->closed) {
+        return;
+    }
+    uint32_t events = (conn->eof || conn->blocked ? 0 : EPOLLIN) | (out_pending(conn) > 0 ? EPOLLOUT : 0);
+    if (events != conn->events) {
+        struct epoll_event event;
+        event.events = events;
+        event.data.ptr = conn;
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+        conn->events = events;
+    }
+}
+
+// Execute the complete requests in the input buffer until the output
+// buffer passes its bound
+static bool conn_execute(server_t *server, conn_t *conn) {
+    while (out_pending(conn) < BLF_SERVE_OUT_LIMIT &&
+           conn->in.length - conn->in.start >= sizeof(blf_net_request_t)) {
+        blf_net_request_t request;
+        memcpy(&request, conn->in.data + conn->in.start, sizeof(blf_net_request_t));
+        if (request.length > BLF_NET_MAX_FRAME) {
+            return false;
+        }
+        if (conn->in.length - conn->in.start < sizeof(blf_net_request_t) + request.length) {
+            break;
+        }
+
+        const char *payload = conn->in.data + conn->in.start + sizeof(blf_net_request_t);
+        if (!handle_request(server, conn, &request, payload)) {
+            return false;
+        }
+        conn->in.start += sizeof(blf_net_request_t) + request.length;
+    }
+
+    if (conn->in.start == conn->in.length) {
+        conn->in.start = conn->in.length = 0;
+    }
+    return true;
+}
+
+// Execute buffered requests and read more while the output stays below its
+// bound. Requests already received when the peer closes its side still run.
+static void conn_read(server_t *server, conn_t *conn) {
+    for (;;) {
+        if (!conn_execute(server, conn)) {
+            conn_close(server, conn);
+            return;
+        }
+        conn->blocked = out_pending(conn) >= BLF_SERVE_OUT_LIMIT;
+        if (conn->blocked || conn->eof) {
+            break;
+        }
+
+        if (!buffer_reserve(&conn->in, BLF_SERVE_READ_SIZE)) {
+            conn_close(server, conn);
+            return;
+        }
+        ssize_t n = read(conn->fd, conn->in.data + conn->in.length, conn->in.capacity - conn->in.length);
+        if (n > 0) {
+            conn->in.length += (size_t)n;
+        } else if (n == 0) {
+            conn->eof = true;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else if (errno != EINTR) {
+            conn_close(server, conn);
+            return;
+        }
+    }
+    conn_update_events(server, conn);
+}
+
+// Send queued responses, waiting for EPOLLOUT if the socket is full
+static void conn_flush(server_t *server, conn_t *conn) {
+    while (!conn->closed && conn->out.start < conn->out.length) {
+        ssize_t n = send(conn->fd, conn->out.data + conn->out.start, conn->out.length - conn->out.start, MSG_NOSIGNAL);
+        if (n > 0) {
+            conn->out.start += (size_t)n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            conn_close(server, conn);
+            return;
+        }
+    }
+    if (conn->closed) {
+        return;
+    }
+
+    if (out_pending(conn) == 0) {
+        conn->out.start = conn->out.length = 0;
+        // A trailing partial request can never complete
+        if (conn->eof && !conn->blocked) {
+            conn_close(server, conn);
+            return;
+        }
+    }
+    conn_update_events(server, conn);
+}
+
+// True if a blocked connection's output has drained enough to resume it
+static bool conn_resumable(const conn_t *conn) {
+    return !conn->closed && conn->blocked && out_pending(conn) < BLF_SERVE_OUT_LIMIT;
+}
+
+static void server_accept(server_t *server, int listen_fd) {
+    for (;;) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+
+        if (server->conn_count == server->conn_capacity) {
+            size_t capacity = server->conn_capacity ? server->conn_capacity * 2 : 16;
+            conn_t **conns = (conn_t**)realloc(server->conns, capacity * sizeof(conn_t*));
+            if (!conns) {
+                close(fd);
+                continue;
+            }
+            server->conns = conns;
+            server->conn_capacity = capacity;
+        }
+
+        conn_t *conn = (conn_t*)calloc(1, sizeof(conn_t));
+        if (!conn) {
+            close(fd);
+            continue;
+        }
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = conn;
+        if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+            free(conn);
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->events = EPOLLIN;
+        server->conns[server->conn_count++] = conn;
+    }
+}
+
+// Free the connections closed during this iteration
+static void server_sweep(server_t *server) {
+    for (size_t i = 0; i < server->conn_count; ) {
+        conn_t *conn = server->conns[i];
+        if (!conn->closed) {
+            i++;
+            continue;
+        }
+        free(conn->in.data);
+        free(conn->out.data);
+        free(conn);
+        server->conns[i] = server->conns[--server->conn_count];
+    }
+}
+
+static int listen_unix(const char *path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    // Replace a stale socket, but never another kind of file
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode) || unlink(path) != 0) {
+            return -1;
+        }
+    } else if (errno != ENOENT) {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 128) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Serve the file over a Unix socket until *stop is set
+bool blf_serve(blf_file_t *file, const blf_serve_options_t *options) {
+    if (!file || !options || !options->socket_path || !options->stop) {
+        return false;
+    }
+
+    server_t server;
+    memset(&server, 0, sizeof(server));
+    server.file = file;
+    server.options = options;
+
+    int listen_fd = listen_unix(options->socket_path);
+    if (listen_fd < 0) {
+        return false;
+    }
+    // Repeated lookups are served from the value cache; a cache the caller
+    // enabled is kept as it is
+    bool own_cache = !file->cache &&
+                     blf_cache_enable(file, options->cache_bytes ? options->cache_bytes : BLF_SERVE_CACHE_BYTES);
+    server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (server.epoll_fd < 0 || epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) != 0) {
+        if (server.epoll_fd >= 0) close(server.epoll_fd);
+        close(listen_fd);
+        unlink(options->socket_path);
+        if (own_cache) blf_cache_disable(file);
+        return false;
+    }
+
+    bool ok = true;
+    struct epoll_event events[BLF_SERVE_MAX_EVENTS];
+    while (!*options->stop) {
+        // Do not sleep while a blocked connection can make progress
+        int timeout = 100;
+        for (size_t i = 0; i < server.conn_count; i++) {
+            if (conn_resumable(server.conns[i])) {
+                timeout = 0;
+                break;
+            }
+        }
+        int n = epoll_wait(server.epoll_fd, events, BLF_SERVE_MAX_EVENTS, timeout);
+        if (n < 0 && errno != EINTR) {
+            ok = false;
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            conn_t *conn = (conn_t*)events[i].data.ptr;
+            if (!conn) {
+                server_accept(&server, listen_fd);
+            } else if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                conn_read(&server, conn);
+            }
+        }
+        for (size_t i = 0; i < server.conn_count; i++) {
+            if (conn_resumable(server.conns[i])) {
+                conn_read(&server, server.conns[i]);
+            }
+        }
+
+        // Group commit: the writes of this iteration become durable before
+        // any response is sent
+        if (server.dirty && options->sync && !blf_commit(file)) {
+            ok = false;
+            break;
+        }
+        server.dirty = false;
+
+        for (size_t i = 0; i < server.conn_count; i++) {
+            conn_flush(&server, server.conns[i]);
+        }
+        server_sweep(&server);
+    }
+
+    for (size_t i = 0; i < server.conn_count; i++) {
+        conn_close(&server, server.conns[i]);
+    }
+    server_sweep(&server);
+    if (server.dirty && options->sync) {
+        blf_commit(file);
+    }
+
+    free(server.conns);
+    close(server.epoll_fd);
+    close(listen_fd);
+    unlink(options->socket_path);
+    if (own_cache) {
+        blf_cache_disable(file);
+    }
+    return ok;
+}
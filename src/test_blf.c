@@ -1,7 +1,17 @@
 #include "blf.h"
+#include "blf_net.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
 void test_basic_operations() {
     // Create a new file
@@ -80,9 +90,1587 @@ void test_basic_operations() {
     blf_close(file);
 }
 
+void test_many_keys() {
+    blf_file_t *file = blf_create("/tmp/test_many.blf");
+    assert(file != NULL);
+
+    char key[32];
+    char value[32];
+    for (int i = 0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "key-%d", i);
+        snprintf(value, sizeof(value), "value-%d", i);
+        assert(blf_put_kv(file, key, value, strlen(value)));
+    }
+
+    // KV entries appended after raw data must not clobber it
+    const char *raw_data = "raw data written between puts";
+    assert(blf_write_raw(file, raw_data, strlen(raw_data)));
+    assert(blf_put_kv(file, "late", "entry", 5));
+
+    // The gap before the raw section grows with the KV section, so appends
+    // move the raw data only a few times
+    int moves = 0;
+    for (int i = 1000; i < 3000; i++) {
+        uint64_t raw_offset = file->header.raw_offset;
+        snprintf(key, sizeof(key), "key-%d", i);
+        snprintf(value, sizeof(value), "value-%d", i);
+        assert(blf_put_kv(file, key, value, strlen(value)));
+        moves += file->header.raw_offset != raw_offset;
+    }
+    assert(moves > 0 && moves <= 4);
+
+    blf_close(file);
+
+    file = blf_open("/tmp/test_many.blf");
+    assert(file != NULL);
+
+    char buffer[64];
+    uint32_t len;
+    for (int i = 0; i < 3000; i++) {
+        snprintf(key, sizeof(key), "key-%d", i);
+        snprintf(value, sizeof(value), "value-%d", i);
+        len = sizeof(buffer);
+        assert(blf_get_kv(file, key, buffer, &len));
+        assert(len == strlen(value) && memcmp(buffer, value, len) == 0);
+    }
+
+    len = sizeof(buffer);
+    assert(blf_get_kv(file, "late", buffer, &len));
+    assert(len == 5 && memcmp(buffer, "entry", 5) == 0);
+
+    len = sizeof(buffer);
+    assert(blf_get_kv(file, "key-3000", buffer, &len) == false);
+
+    uint64_t raw_len = sizeof(buffer);
+    assert(blf_read_raw(file, buffer, &raw_len));
+    assert(raw_len == strlen(raw_data) && memcmp(buffer, raw_data, raw_len) == 0);
+
+    blf_close(file);
+    printf("Many keys test passed\n");
+}
+
+static void *cache_reader(void *arg) {
+    blf_file_t *file = (blf_file_t*)arg;
+    char key[32];
+    char value[32];
+    char buffer[64];
+
+    for (int round = 0; round < 50; round++) {
+        for (int i = 0; i < 100; i++) {
+            snprintf(key, sizeof(key), "key-%d", i);
+            snprintf(value, sizeof(value), "value-%d", i);
+            uint32_t len = sizeof(buffer);
+            assert(blf_get_kv(file, key, buffer, &len));
+            assert(len == strlen(value) && memcmp(buffer, value, len) == 0);
+        }
+    }
+    return NULL;
+}
+
+void test_value_cache() {
+    blf_file_t *file = blf_create("/tmp/test_cache.blf");
+    assert(file != NULL);
+    assert(blf_cache_enable(file, 64 * 1024));
+
+    char key[32];
+    char value[32];
+    for (int i = 0; i < 100; i++) {
+        snprintf(key, sizeof(key), "key-%d", i);
+        snprintf(value, sizeof(value), "value-%d", i);
+        assert(blf_put_kv(file, key, value, strlen(value)));
+    }
+
+    char buffer[64];
+    uint32_t len = sizeof(buffer);
+    assert(blf_get_kv(file, "key-7", buffer, &len));
+    len = sizeof(buffer);
+    assert(blf_get_kv(file, "key-7", buffer, &len));
+    assert(len == 7 && memcmp(buffer, "value-7", 7) == 0);
+
+    blf_cache_stats_t stats;
+    assert(blf_cache_stats(file, &stats));
+    assert(stats.misses == 1 && stats.hits == 1 && stats.entries == 1);
+
+    // A too-small buffer reports the size on a hit as well
+    len = 2;
+    assert(blf_get_kv(file, "key-7", buffer, &len) == false);
+    assert(len == 7);
+
+    // Puts and deletes invalidate
+    assert(blf_put_kv(file, "key-7", "changed value", 13));
+    len = sizeof(buffer);
+    assert(blf_get_kv(file, "key-7", buffer, &len));
+    assert(len == 13 && memcmp(buffer, "changed value", 13) == 0);
+
+    assert(blf_delete_kv(file, "key-7"));
+    len = sizeof(buffer);
+    assert(blf_get_kv(file, "key-7", buffer, &len) == false);
+    assert(blf_put_kv(file, "key-7", "value-7", 7));
+
+    pthread_t threads[4];
+    for (int i = 0; i < 4; i++) {
+        assert(pthread_create(&threads[i], NULL, cache_reader, file) == 0);
+    }
+    for (int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    assert(blf_cache_stats(file, &stats));
+    assert(stats.hits > stats.misses);
+    assert(stats.bytes <= stats.budget);
+    blf_cache_disable(file);
+
+    // A tiny budget forces evictions
+    assert(blf_cache_enable(file, 16 * 256));
+    for (int i = 0; i < 100; i++) {
+        snprintf(key, sizeof(key), "key-%d", i);
+        len = sizeof(buffer);
+        assert(blf_get_kv(file, key, buffer, &len));
+    }
+    assert(blf_cache_stats(file, &stats));
+    assert(stats.evictions > 0 && stats.bytes <= stats.budget);
+
+    blf_close(file);
+    printf("Value cache test passed\n");
+}
+
+void test_typed_values() {
+    blf_file_t *file = blf_create("/tmp/test_typed.blf");
+    assert(file != NULL);
+
+    assert(blf_put_kv(file, "k", "odd-length", 10));
+    assert(blf_put_u64(file, "requests", 41));
+    assert(blf_put_f64(file, "load", 0.75));
+
+    uint64_t count;
+    assert(blf_incr_u64(file, "requests", 1, &count));
+    assert(count == 42);
+
+    // Incrementing an existing counter does not touch the header
+    uint64_t kv_size = file->header.kv_size;
+    for (int i = 0; i < 1000; i++) {
+        assert(blf_incr_u64(file, "requests", 1, NULL));
+    }
+    assert(file->header.kv_size == kv_size);
+
+    // Missing counters are created
+    assert(blf_incr_u64(file, "errors", 3, &count));
+    assert(count == 3);
+
+    double load;
+    assert(blf_get_f64(file, "load", &load));
+    assert(load == 0.75);
+    assert(blf_get_u64(file, "load", &count) == false);
+    assert(blf_incr_u64(file, "load", 1, NULL) == false);
+
+    // Typed values stay aligned when other entries are deleted
+    assert(blf_delete_kv(file, "k"));
+    blf_close(file);
+
+    file = blf_open("/tmp/test_typed.blf");
+    assert(file != NULL);
+    assert(file->header.version == BLF_VERSION);
+
+    assert(blf_get_u64(file, "requests", &count));
+    assert(count == 1042);
+    assert(blf_incr_u64(file, "errors", 1, &count));
+    assert(count == 4);
+
+    // Typed values read as plain 8-byte values
+    char buffer[16];
+    uint32_t len = sizeof(buffer);
+    assert(blf_get_kv(file, "requests", buffer, &len));
+    assert(len == 8 && memcmp(buffer, &(uint64_t){1042}, 8) == 0);
+
+    // Plain puts replace a typed value
+    assert(blf_put_kv(file, "requests", "12345678", 8));
+    assert(blf_get_u64(file, "requests", &count) == false);
+
+    // Keys too long for the entry's key length bits are rejected, not truncated
+    char *long_key = (char*)malloc(BLF_KV_KEY_MASK + 2);
+    assert(long_key != NULL);
+    memset(long_key, 'k', BLF_KV_KEY_MASK + 1);
+    long_key[BLF_KV_KEY_MASK + 1] = '\0';
+    kv_size = file->header.kv_size;
+    assert(!blf_put_u64(file, long_key, 1));
+    assert(!blf_incr_u64(file, long_key, 1, NULL));
+    assert(!blf_put_array(file, long_key, BLF_TYPE_U64, &count, 1, 0));
+    assert(!blf_get_u64(file, long_key, &count));
+    assert(file->header.kv_size == kv_size);
+    free(long_key);
+
+    blf_close(file);
+    printf("Typed values test passed\n");
+}
+
+void test_mapped_mode() {
+    blf_file_t *file = blf_create("/tmp/test_mapped.blf");
+    assert(file != NULL);
+    assert(blf_map(file, 64 * 1024));
+
+    char key[32];
+    char value[32];
+    for (int i = 0; i < 5000; i++) {
+        snprintf(key, sizeof(key), "key-%d", i);
+        snprintf(value, sizeof(value), "value-%d", i);
+        assert(blf_put_kv(file, key, value, strlen(value)));
+    }
+
+    const char *raw_data = "mapped raw data";
+    assert(blf_write_raw(file, raw_data, strlen(raw_data)));
+    assert(blf_put_u64(file, "counter", 0));
+    for (int i = 0; i < 100; i++) {
+        assert(blf_incr_u64(file, "counter", 1, NULL));
+    }
+    assert(blf_commit(file));
+
+    // Deleting rewrites the file and remaps it
+    assert(blf_delete_kv(file, "key-0"));
+    assert(file->map != NULL);
+    assert(blf_put_kv(file, "key-5000", "value-5000", 10));
+    assert(blf_commit(file));
+
+    blf_close(file);
+
+    file = blf_open("/tmp/test_mapped.blf");
+    assert(file != NULL);
+
+    // Preallocated space is trimmed on close, leaving the persisted index last
+    struct stat st;
+    assert(stat("/tmp/test_mapped.blf", &st) == 0);
+    assert(file->header.index_offset != 0);
+    assert((uint64_t)st.st_size == file->header.index_offset + file->header.index_size);
+
+    char buffer[64];
+    uint32_t len = sizeof(buffer);
+    assert(blf_get_kv(file, "key-0", buffer, &len) == false);
+    for (int i = 1; i <= 5000; i++) {
+        snprintf(key, sizeof(key), "key-%d", i);
+        snprintf(value, sizeof(value), "value-%d", i);
+        len = sizeof(buffer);
+        assert(blf_get_kv(file, key, buffer, &len));
+        assert(len == strlen(value) && memcmp(buffer, value, len) == 0);
+    }
+
+    uint64_t count;
+    assert(blf_get_u64(file, "counter", &count));
+    assert(count == 100);
+
+    uint64_t raw_len = sizeof(buffer);
+    assert(blf_read_raw(file, buffer, &raw_len));
+    assert(raw_len == strlen(raw_data) && memcmp(buffer, raw_data, raw_len) == 0);
+
+    blf_close(file);
+    printf("Mapped mode test passed\n");
+}
+
+void test_persistent_index() {
+    // A new file has no index until one is persisted
+    blf_file_t *file = blf_create("/tmp/test_index.blf");
+    assert(file != NULL);
+    blf_close(file);
+    file = blf_open("/tmp/test_index.blf");
+    assert(file != NULL);
+    assert(file->header.index_offset == 0 && file->header.index_size == 0);
+    blf_close(file);
+
+    file = blf_create("/tmp/test_index.blf");
+    assert(file != NULL);
+
+    char key[32];
+    char value[32];
+    for (int i = 0; i < 2000; i++) {
+        snprintf(key, sizeof(key), "key-%d", i);
+        snprintf(value, sizeof(value), "value-%d", i);
+        assert(blf_put_kv(file, key, value, strlen(value)));
+    }
+    assert(blf_write_raw(file, "raw", 3));
+    blf_close(file);
+
+    // The index is written on close and used on open
+    file = blf_open("/tmp/test_index.blf");
+    assert(file != NULL);
+    assert(file->header.index_offset >= file->header.raw_offset + file->header.raw_size);
+
+    char buffer[64];
+    uint32_t len;
+    for (int i = 0; i < 2000; i++) {
+        snprintf(key, sizeof(key), "key-%d", i);
+        snprintf(value, sizeof(value), "value-%d", i);
+        len = sizeof(buffer);
+        assert(blf_get_kv(file, key, buffer, &len));
+        assert(len == strlen(value) && memcmp(buffer, value, len) == 0);
+    }
+    len = sizeof(buffer);
+    assert(blf_get_kv(file, "missing", buffer, &len) == false);
+
+    // New keys invalidate the persisted index on disk until the file is
+    // closed or unmapped; commits do not rewrite it
+    assert(blf_put_kv(file, "added", "after open", 10));
+    assert(file->header.index_offset == 0);
+
+    FILE *copy = fopen("/tmp/test_index_copy.blf", "wb");
+    FILE *orig = fopen("/tmp/test_index.blf", "rb");
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), orig)) > 0) {
+        fwrite(buffer, 1, n, copy);
+    }
+    fclose(orig);
+    fclose(copy);
+
+    assert(blf_commit(file));
+    assert(file->header.index_offset == 0);
+    assert(blf_map(file, 0));
+    assert(blf_put_kv(file, "mapped", "then unmapped", 13));
+    assert(blf_commit(file));
+    assert(file->header.index_offset == 0);
+    assert(blf_unmap(file));
+    assert(file->header.index_offset != 0);
+    blf_close(file);
+
+    // A copy taken while the index was stale rebuilds it
+    file = blf_open("/tmp/test_index_copy.blf");
+    assert(file != NULL);
+    assert(file->header.index_offset == 0);
+    len = sizeof(buffer);
+    assert(blf_get_kv(file, "added", buffer, &len));
+    assert(len == 10 && memcmp(buffer, "after open", 10) == 0);
+    blf_close(file);
+
+    file = blf_open("/tmp/test_index.blf");
+    len = sizeof(buffer);
+    assert(blf_get_kv(file, "added", buffer, &len));
+    uint64_t raw_len = sizeof(buffer);
+    assert(blf_read_raw(file, buffer, &raw_len));
+    assert(raw_len == 3 && memcmp(buffer, "raw", 3) == 0);
+    blf_close(file);
+
+    printf("Persistent index test passed\n");
+}
+
+void test_legacy_header() {
+    // Version 2 files have a 40-byte header
+    FILE *fp = fopen("/tmp/test_legacy.blf", "wb");
+    blf_header_t header = { BLF_MAGIC, 2, BLF_HEADER_V1_SIZE, 0, BLF_HEADER_V1_SIZE, 0, 0, 0 };
+    blf_kv_entry_t entry = { 3, 5 };
+    header.kv_size = sizeof(entry) + 3 + 5;
+    header.raw_offset += header.kv_size;
+    fwrite(&header, BLF_HEADER_V1_SIZE, 1, fp);
+    fwrite(&entry, sizeof(entry), 1, fp);
+    fwrite("abcvalue", 1, 8, fp);
+    fclose(fp);
+
+    blf_file_t *file = blf_open("/tmp/test_legacy.blf");
+    assert(file != NULL);
+
+    char buffer[16];
+    uint32_t len = sizeof(buffer);
+    assert(blf_get_kv(file, "abc", buffer, &len));
+    assert(len == 5 && memcmp(buffer, "value", 5) == 0);
+    assert(blf_put_kv(file, "def", "more", 4));
+    blf_close(file);
+
+    // No index is persisted for the short header
+    file = blf_open("/tmp/test_legacy.blf");
+    assert(file->header.version == 2 && file->header.index_offset == 0);
+    len = sizeof(buffer);
+    assert(blf_get_kv(file, "def", buffer, &len));
+
+    // Rewriting the file upgrades it
+    assert(blf_delete_kv(file, "abc"));
+    assert(file->header.version == BLF_VERSION);
+    blf_close(file);
+
+    file = blf_open("/tmp/test_legacy.blf");
+    assert(file->header.index_offset != 0);
+    len = sizeof(buffer);
+    assert(blf_get_kv(file, "def", buffer, &len));
+    assert(len == 4 && memcmp(buffer, "more", 4) == 0);
+    blf_close(file);
+
+    printf("Legacy header test passed\n");
+}
+
+void test_ranged_raw_reads() {
+    blf_file_t *file = blf_create("/tmp/test_raw_range.blf");
+    assert(file != NULL);
+    assert(blf_put_kv(file, "key", "value", 5));
+
+    static unsigned char raw[1 << 20];
+    for (size_t i = 0; i < sizeof(raw); i++) {
+        raw[i] = (unsigned char)(i * 7 + (i >> 12));
+    }
+    assert(blf_write_raw(file, raw, sizeof(raw)));
+
+    // A window in the middle
+    unsigned char window[65536];
+    uint64_t size = sizeof(window);
+    assert(blf_read_raw_at(file, 300000, window, &size));
+    assert(size == sizeof(window) && memcmp(window, raw + 300000, size) == 0);
+
+    // Reads stop at the end of the section
+    size = sizeof(window);
+    assert(blf_read_raw_at(file, sizeof(raw) - 100, window, &size));
+    assert(size == 100 && memcmp(window, raw + sizeof(raw) - 100, 100) == 0);
+    size = 1;
+    assert(blf_read_raw_at(file, sizeof(raw) + 1, window, &size) == false);
+
+    // Contiguous and scattered segments
+    unsigned char a[100], b[200], c[300], d[50];
+    blf_raw_iovec_t iov[4] = {
+        { 1000, a, sizeof(a) },
+        { 1100, b, sizeof(b) },
+        { 500000, c, sizeof(c) },
+        { sizeof(raw) - 20, d, sizeof(d) },
+    };
+    assert(blf_readv_raw(file, iov, 4));
+    assert(memcmp(a, raw + 1000, sizeof(a)) == 0);
+    assert(memcmp(b, raw + 1100, sizeof(b)) == 0);
+    assert(memcmp(c, raw + 500000, sizeof(c)) == 0);
+    assert(iov[3].size == 20 && memcmp(d, raw + sizeof(raw) - 20, 20) == 0);
+
+    assert(blf_raw_advise(file, 0, 0, BLF_ADVICE_SEQUENTIAL));
+    assert(blf_raw_advise(file, 4096, 65536, BLF_ADVICE_RANDOM));
+    assert(blf_raw_advise(file, 0, 65536, BLF_ADVICE_WILLNEED));
+
+    // The same through a mapping
+    assert(blf_map(file, 0));
+    size = sizeof(window);
+    assert(blf_read_raw_at(file, 123456, window, &size));
+    assert(size == sizeof(window) && memcmp(window, raw + 123456, size) == 0);
+    iov[0].size = sizeof(a);
+    iov[1].size = sizeof(b);
+    assert(blf_readv_raw(file, iov, 2));
+    assert(memcmp(b, raw + 1100, sizeof(b)) == 0);
+    assert(blf_raw_advise(file, 0, 0, BLF_ADVICE_RANDOM));
+
+    blf_close(file);
+    printf("Ranged raw read test passed\n");
+}
+
+void test_raw_patches() {
+    blf_file_t *file = blf_create("/tmp/test_raw_patch.blf");
+    assert(file != NULL);
+    assert(blf_put_kv(file, "key", "value", 5));
+
+    static unsigned char raw[256 * 1024];
+    static unsigned char check[sizeof(raw) + 100];
+    memset(raw, 'a', sizeof(raw));
+    assert(blf_write_raw(file, raw, sizeof(raw)));
+
+    // Unsorted, partly adjacent patches plus one that extends the section
+    blf_raw_patch_t patches[] = {
+        { 200000, "CCCC", 4 },
+        { 10, "BB", 2 },
+        { 8, "AA", 2 },
+        { sizeof(raw) - 2, "ZZZZZZ", 6 },
+        { 12, "DD", 2 },
+    };
+    assert(blf_patch_raw(file, patches, 5));
+    assert(file->header.raw_size == sizeof(raw) + 4);
+    memcpy(raw + 8, "AABBDD", 6);
+    memcpy(raw + 200000, "CCCC", 4);
+
+    assert(blf_write_raw_at(file, 4096, "single", 6));
+    memcpy(raw + 4096, "single", 6);
+
+    // Overlaps and gaps are rejected without writing anything
+    blf_raw_patch_t overlap[] = { { 100, "xxxx", 4 }, { 102, "yy", 2 } };
+    assert(blf_patch_raw(file, overlap, 2) == false);
+    assert(blf_write_raw_at(file, sizeof(raw) + 10, "gap", 3) == false);
+
+    blf_close(file);
+
+    file = blf_open("/tmp/test_raw_patch.blf");
+    assert(file != NULL);
+    uint64_t size = sizeof(check);
+    assert(blf_read_raw(file, check, &size));
+    assert(size == sizeof(raw) + 4);
+    assert(memcmp(check, raw, sizeof(raw) - 2) == 0);
+    assert(memcmp(check + sizeof(raw) - 2, "ZZZZZZ", 6) == 0);
+
+    // The same through a mapping
+    assert(blf_map(file, 0));
+    assert(blf_write_raw_at(file, 65536, "mapped", 6));
+    assert(blf_write_raw_at(file, size, "tail", 4));
+    blf_close(file);
+
+    file = blf_open("/tmp/test_raw_patch.blf");
+    assert(file != NULL);
+    char value[16];
+    uint32_t value_len = sizeof(value);
+    assert(blf_get_kv(file, "key", value, &value_len) && value_len == 5);
+    size = 6;
+    assert(blf_read_raw_at(file, 65536, check, &size) && memcmp(check, "mapped", 6) == 0);
+    size = 16;
+    assert(blf_read_raw_at(file, sizeof(raw) + 4, check, &size) && size == 4);
+    assert(memcmp(check, "tail", 4) == 0);
+    blf_close(file);
+
+    // A patch that cannot be written leaves the handle's header as it was
+    file = blf_create("/tmp/test_raw_patch.blf");
+    assert(file != NULL);
+    assert(blf_put_kv(file, "key", "value", 5));
+    uint64_t raw_offset = file->header.raw_offset;
+    struct rlimit limit;
+    assert(getrlimit(RLIMIT_FSIZE, &limit) == 0);
+    struct rlimit lowered = limit;
+    lowered.rlim_cur = 2 * BLF_RAW_ALIGN;
+    signal(SIGXFSZ, SIG_IGN);
+    assert(setrlimit(RLIMIT_FSIZE, &lowered) == 0);
+    assert(blf_write_raw_at(file, 0, raw, sizeof(raw)) == false);
+    assert(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+    signal(SIGXFSZ, SIG_DFL);
+    assert(file->header.raw_offset == raw_offset && file->header.raw_size == 0);
+    assert(blf_write_raw_at(file, 0, "after", 5));
+    assert(file->header.raw_size == 5);
+    blf_close(file);
+
+    printf("Raw patch test passed\n");
+}
+
+void test_direct_io() {
+    blf_file_t *file = blf_create("/tmp/test_direct.blf");
+    assert(file != NULL);
+    assert(blf_put_kv(file, "key", "value", 5));
+
+    // Transfers work whether or not the file system accepts O_DIRECT
+    bool direct = blf_direct_enable(file, 64 * 1024);
+    assert(blf_direct_enable(file, 0) == false);
+
+    size_t raw_size = 1024 * 1024 + 123;
+    char *buffer = (char*)malloc(raw_size + 1 + BLF_RAW_ALIGN);
+    assert(buffer != NULL);
+    char *raw = buffer + (BLF_RAW_ALIGN - (uintptr_t)buffer % BLF_RAW_ALIGN) % BLF_RAW_ALIGN;
+    for (size_t i = 0; i < raw_size + 1; i++) {
+        raw[i] = (char)(i * 13 + (i >> 10));
+    }
+
+    // Aligned source: straight from the caller's memory
+    assert(blf_write_raw(file, raw, raw_size));
+    assert(file->header.raw_offset % BLF_RAW_ALIGN == 0);
+
+    char *check = (char*)malloc(raw_size + 1);
+    uint64_t size = raw_size;
+    assert(blf_read_raw(file, check + 1, &size));
+    assert(size == raw_size && memcmp(check + 1, raw, raw_size) == 0);
+
+    // Unaligned source: through the bounce buffers
+    assert(blf_write_raw(file, raw + 1, raw_size));
+    size = raw_size;
+    assert(blf_read_raw(file, check, &size));
+    assert(size == raw_size && memcmp(check, raw + 1, raw_size) == 0);
+
+    size = 300000;
+    assert(blf_read_raw_at(file, 777, check, &size));
+    assert(size == 300000 && memcmp(check, raw + 778, size) == 0);
+
+    // Appending KV entries shifts the raw section to the next aligned offset
+    char value[4000];
+    memset(value, 'v', sizeof(value));
+    assert(blf_put_kv(file, "big", value, sizeof(value)));
+    assert(file->header.raw_offset % BLF_RAW_ALIGN == 0);
+    blf_direct_disable(file);
+
+    size = raw_size;
+    assert(blf_read_raw(file, check, &size));
+    assert(memcmp(check, raw + 1, raw_size) == 0);
+    blf_close(file);
+
+    file = blf_open("/tmp/test_direct.blf");
+    assert(file != NULL);
+    assert(blf_direct_enable(file, 64 * 1024) == direct);
+    size = raw_size;
+    assert(blf_read_raw(file, check, &size));
+    assert(memcmp(check, raw + 1, raw_size) == 0);
+    uint32_t value_len = sizeof(value);
+    assert(blf_get_kv(file, "big", value, &value_len) && value_len == sizeof(value));
+    blf_close(file);
+
+    free(check);
+    free(buffer);
+    printf("Direct I/O test passed (%s)\n", direct ? "O_DIRECT" : "buffered fallback");
+}
+
+// Check blf_get_many results against blf_get_kv
+static void check_get_many(blf_file_t *file, const char *const *keys, size_t n) {
+    blf_get_result_t results[16];
+    static char arena[256 * 1024];
+    static char value[128 * 1024];
+
+    // Too small an arena reports the size needed
+    uint64_t arena_size = 16;
+    assert(blf_get_many(file, keys, n, results, arena, &arena_size) == false);
+    assert(arena_size > 16 && arena_size <= sizeof(arena));
+
+    arena_size = sizeof(arena);
+    assert(blf_get_many(file, keys, n, results, arena, &arena_size));
+    uint64_t used = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t value_len = sizeof(value);
+        bool found = blf_get_kv(file, keys[i], value, &value_len);
+        assert(results[i].found == found);
+        if (found) {
+            assert(results[i].length == value_len);
+            assert(memcmp(arena + results[i].offset, value, value_len) == 0);
+            if (results[i].offset + value_len > used) {
+                used = results[i].offset + value_len;
+            }
+        }
+    }
+    assert(arena_size == used);
+}
+
+void test_get_many() {
+    blf_file_t *file = blf_create("/tmp/test_get_many.blf");
+    assert(file != NULL);
+
+    char key[32];
+    char value[256];
+    for (int i = 0; i < 2000; i++) {
+        sprintf(key, "key%d", i);
+        int len = sprintf(value, "value%d-", i);
+        memset(value + len, 'a' + i % 26, i % 200);
+        assert(blf_put_kv(file, key, value, len + i % 200));
+    }
+    static char big[100 * 1024];
+    memset(big, 'b', sizeof(big));
+    assert(blf_put_kv(file, "big", big, sizeof(big)));
+    assert(blf_put_u64(file, "counter", 42));
+    assert(blf_put_kv(file, "empty", "", 0));
+
+    // Missing and duplicate keys, entries in different windows
+    const char *keys[] = {
+        "key1999", "key0", "missing", "big", "key7", "key1000", "counter",
+        "key0", "empty", "key1001", "also-missing", "key500",
+    };
+    size_t n = sizeof(keys) / sizeof(keys[0]);
+    check_get_many(file, keys, n);
+    blf_close(file);
+
+    // Persisted index
+    file = blf_open("/tmp/test_get_many.blf");
+    assert(file != NULL);
+    check_get_many(file, keys, n);
+
+    blf_get_result_t results[16];
+    char arena[64];
+    uint64_t arena_size = sizeof(arena);
+    const char *first[] = { "key0" };
+    assert(blf_get_many(file, first, 1, results, arena, &arena_size));
+    assert(results[0].found && arena_size == results[0].length);
+    arena_size = 0;
+    assert(blf_get_many(file, first, 0, results, NULL, &arena_size) && arena_size == 0);
+
+    // Explicit lengths: a key may contain NUL or be a prefix of another
+    assert(blf_put_kv_n(file, "key0\0b", 6, "nul", 3));
+    const char *sliced[] = { "key0\0b", "key0\0b", "key10" };
+    uint32_t lengths[] = { 6, 4, 4 };
+    arena_size = sizeof(arena);
+    assert(blf_get_many_n(file, sliced, lengths, 3, results, arena, &arena_size));
+    assert(results[0].found && results[0].length == 3 && memcmp(arena + results[0].offset, "nul", 3) == 0);
+    assert(results[1].found && results[1].length == 7 && results[2].found && results[2].length == 8);
+    assert(memcmp(arena + results[1].offset, "value0-", 7) == 0 && memcmp(arena + results[2].offset, "value1-", 7) == 0);
+    blf_close(file);
+
+    // Without an index: one sequential pass
+    file = blf_open("/tmp/test_get_many.blf");
+    assert(file != NULL);
+    file->header.index_offset = 0;
+    check_get_many(file, keys, n);
+    blf_close(file);
+
+    printf("Multi-get test passed\n");
+}
+
+void test_typed_arrays() {
+    blf_file_t *file = blf_create("/tmp/test_arrays.blf");
+    assert(file != NULL);
+    assert(blf_put_kv(file, "k", "v", 1));
+
+    float floats[1000];
+    uint64_t ids[33];
+    int32_t deltas[7];
+    for (int i = 0; i < 1000; i++) floats[i] = i * 0.5f;
+    for (int i = 0; i < 33; i++) ids[i] = (uint64_t)i << 40;
+    for (int i = 0; i < 7; i++) deltas[i] = -i;
+
+    assert(blf_put_array(file, "floats", BLF_TYPE_F32, floats, 1000, 64));
+    assert(blf_put_array(file, "ids", BLF_TYPE_U64, ids, 33, 16));
+    assert(blf_put_array(file, "deltas", BLF_TYPE_I32, deltas, 7, 0));
+    assert(blf_put_array(file, "bad", BLF_TYPE_F32, floats, 4, 4) == false);
+    assert(blf_put_array(file, "bad", BLF_TYPE_F32, floats, 4, 24) == false);
+    assert(blf_put_array(file, "bad", BLF_TYPE_F32, floats, 4, 128) == false);
+    assert(blf_put_array(file, "bad", BLF_TYPE_BYTES, floats, 4, 8) == false);
+
+    blf_array_t array;
+    assert(blf_get_array(file, "floats", &array));
+    assert(array.type == BLF_TYPE_F32 && array.count == 1000 && array.alignment == 64);
+    assert(array.offset % 64 == 0 && array.data == NULL);
+    assert(blf_get_array(file, "ids", &array) && array.offset % 16 == 0 && array.count == 33);
+    assert(blf_get_array(file, "deltas", &array) && array.offset % 8 == 0 && array.count == 7);
+    assert(blf_get_array(file, "k", &array) == false);
+
+    // Typed scalars are arrays of one
+    assert(blf_put_u64(file, "counter", 5));
+    assert(blf_get_array(file, "counter", &array) && array.type == BLF_TYPE_U64 && array.count == 1);
+
+    // The raw bytes are readable as a plain value
+    static float check[1000];
+    uint32_t value_len = sizeof(check);
+    assert(blf_get_kv(file, "floats", check, &value_len));
+    assert(value_len == sizeof(floats) && memcmp(check, floats, sizeof(floats)) == 0);
+
+    // A same-sized update with a stronger alignment moves the entry
+    assert(blf_put_array(file, "deltas", BLF_TYPE_I32, deltas, 7, 64));
+    assert(blf_get_array(file, "deltas", &array) && array.alignment == 64 && array.offset % 64 == 0);
+
+    // A shorter array is stored in place and its element count is updated
+    assert(blf_put_array(file, "shrink", BLF_TYPE_U64, ids, 4, 0));
+    assert(blf_get_array(file, "shrink", &array) && array.count == 4);
+    uint64_t shrink_offset = array.offset;
+    assert(blf_put_array(file, "shrink", BLF_TYPE_U64, ids + 1, 2, 0));
+    assert(blf_get_array(file, "shrink", &array));
+    assert(array.offset == shrink_offset && array.count == 2 && array.type == BLF_TYPE_U64);
+    uint64_t shrunk[4];
+    value_len = sizeof(shrunk);
+    assert(blf_get_kv(file, "shrink", shrunk, &value_len));
+    assert(value_len == 2 * sizeof(uint64_t) && shrunk[0] == ids[1] && shrunk[1] == ids[2]);
+
+    // Deleting rewrites the file; values keep their alignment
+    assert(blf_delete_kv(file, "k"));
+    assert(blf_get_array(file, "floats", &array) && array.offset % 64 == 0);
+    blf_close(file);
+
+    // Zero-copy access through a mapping
+    file = blf_open("/tmp/test_arrays.blf");
+    assert(file != NULL);
+    assert(blf_map(file, 0));
+    assert(blf_get_array(file, "shrink", &array) && array.count == 2);
+    assert(blf_get_array(file, "floats", &array));
+    assert(array.data != NULL && (uintptr_t)array.data % 64 == 0);
+    const float *mapped = (const float*)array.data;
+    float sum = 0;
+    for (uint32_t i = 0; i < array.count; i++) {
+        sum += mapped[i];
+    }
+    assert(sum == 249750.0f);
+    assert(blf_get_array(file, "ids", &array) && (uintptr_t)array.data % 16 == 0);
+    assert(((const uint64_t*)array.data)[32] == (uint64_t)32 << 40);
+    blf_close(file);
+
+    printf("Typed array test passed\n");
+}
+
+// Keep the value of the first input and drop "drop"
+static int merge_first_wins(void *user, const blf_merge_value_t *values, int count) {
+    int *calls = (int*)user;
+    (*calls)++;
+    assert(count >= 2 && values[0].input < values[1].input);
+    return strcmp(values[0].key, "drop") == 0 ? -1 : 0;
+}
+
+typedef struct {
+    int added;
+    int removed;
+    int changed;
+    char last_changed[32];
+} diff_counts_t;
+
+static void count_diff(void *user, const char *key, uint32_t key_length, blf_diff_t change) {
+    diff_counts_t *counts = (diff_counts_t*)user;
+    assert(strlen(key) == key_length);
+    if (change == BLF_DIFF_ADDED) counts->added++;
+    if (change == BLF_DIFF_REMOVED) counts->removed++;
+    if (change == BLF_DIFF_CHANGED) {
+        counts->changed++;
+        snprintf(counts->last_changed, sizeof(counts->last_changed), "%s", key);
+    }
+}
+
+void test_merge_and_diff() {
+    const char *inputs[] = { "/tmp/test_merge_a.blf", "/tmp/test_merge_b.blf", "/tmp/test_merge_c.blf" };
+    char key[32];
+    char value[64];
+
+    // Each input has its own keys plus shared ones with per-input values
+    for (int f = 0; f < 3; f++) {
+        blf_file_t *file = blf_create(inputs[f]);
+        assert(file != NULL);
+        for (int i = 0; i < 3000; i++) {
+            sprintf(key, "w%d.%d", f, i);
+            int len = sprintf(value, "v%d-%d", f, i);
+            assert(blf_put_kv(file, key, value, len));
+        }
+        for (int i = 0; i < 100; i++) {
+            sprintf(key, "shared%d", i);
+            int len = sprintf(value, "from %d", f);
+            assert(blf_put_kv(file, key, value, len));
+        }
+        assert(blf_put_kv(file, "drop", "x", 1));
+
+        // Large values spread the output over several encoding chunks
+        static char big[1024 * 1024];
+        for (int i = 0; i < 3; i++) {
+            sprintf(key, "big%d.%d", f, i);
+            memset(big, 'a' + f * 3 + i, sizeof(big));
+            assert(blf_put_kv(file, key, big, sizeof(big)));
+        }
+        double weights[3] = { f, f + 1, f + 2 };
+        assert(blf_put_array(file, "weights", BLF_TYPE_F64, weights, 3, 64));
+        if (f < 2) {
+            char raw[32];
+            int len = sprintf(raw, "raw of %d", f);
+            assert(blf_write_raw(file, raw, len));
+        }
+        blf_close(file);
+    }
+
+    // Last wins by default
+    assert(blf_merge("/tmp/test_merged.blf", inputs, 3, NULL, NULL));
+    blf_file_t *file = blf_open("/tmp/test_merged.blf");
+    assert(file != NULL);
+    assert(file->header.index_offset != 0);
+    uint32_t value_len = sizeof(value);
+    assert(blf_get_kv(file, "w1.2999", value, &value_len));
+    assert(value_len == 7 && memcmp(value, "v1-2999", 7) == 0);
+    value_len = sizeof(value);
+    assert(blf_get_kv(file, "shared42", value, &value_len));
+    assert(value_len == 6 && memcmp(value, "from 2", 6) == 0);
+    assert(blf_get_kv(file, "drop", value, &value_len));
+
+    static char big[1024 * 1024];
+    for (int f = 0; f < 3; f++) {
+        for (int i = 0; i < 3; i++) {
+            sprintf(key, "big%d.%d", f, i);
+            value_len = sizeof(big);
+            assert(blf_get_kv(file, key, big, &value_len) && value_len == sizeof(big));
+            assert(big[0] == 'a' + f * 3 + i && big[sizeof(big) - 1] == 'a' + f * 3 + i);
+        }
+    }
+
+    blf_array_t array;
+    assert(blf_get_array(file, "weights", &array));
+    assert(array.count == 3 && array.alignment == 64 && array.offset % 64 == 0);
+    double weights[3];
+    value_len = sizeof(weights);
+    assert(blf_get_kv(file, "weights", weights, &value_len) && weights[0] == 2);
+
+    char raw[32];
+    uint64_t raw_size = sizeof(raw);
+    assert(blf_read_raw(file, raw, &raw_size));
+    assert(raw_size == 8 && memcmp(raw, "raw of 1", 8) == 0);
+    blf_close(file);
+
+    // Callback resolution
+    int calls = 0;
+    assert(blf_merge("/tmp/test_merged.blf", inputs, 3, merge_first_wins, &calls));
+    assert(calls == 102);
+    file = blf_open("/tmp/test_merged.blf");
+    assert(file != NULL);
+    value_len = sizeof(value);
+    assert(blf_get_kv(file, "shared7", value, &value_len));
+    assert(value_len == 6 && memcmp(value, "from 0", 6) == 0);
+    value_len = sizeof(value);
+    assert(blf_get_kv(file, "drop", value, &value_len) == false);
+    value_len = sizeof(value);
+    assert(blf_get_kv(file, "w2.0", value, &value_len));
+    blf_close(file);
+
+    // An input cannot be the output
+    assert(blf_merge(inputs[0], inputs, 3, NULL, NULL) == false);
+
+    // Inputs are only read: one with a stale index does not get it written
+    file = blf_open(inputs[1]);
+    assert(blf_put_kv(file, "stale", "index", 5));
+    assert(blf_commit(file));
+    struct stat before, after;
+    assert(stat(inputs[1], &before) == 0);
+    assert(blf_merge("/tmp/test_merged_stale.blf", inputs, 3, NULL, NULL));
+    assert(stat(inputs[1], &after) == 0);
+    assert(after.st_size == before.st_size);
+    blf_file_t *reopened = blf_open(inputs[1]);
+    assert(reopened->header.index_offset == 0);
+    blf_close(reopened);
+    blf_close(file);
+    remove("/tmp/test_merged_stale.blf");
+
+    // Diff of the merge against one input
+    diff_counts_t counts;
+    memset(&counts, 0, sizeof(counts));
+    assert(blf_diff(inputs[0], "/tmp/test_merged.blf", count_diff, &counts));
+    assert(counts.added == 6006 && counts.removed == 1 && counts.changed == 0);
+
+    file = blf_open("/tmp/test_merged.blf");
+    assert(blf_put_kv(file, "shared3", "changed", 7));
+    blf_close(file);
+    memset(&counts, 0, sizeof(counts));
+    assert(blf_diff(inputs[0], "/tmp/test_merged.blf", count_diff, &counts));
+    assert(counts.changed == 1 && strcmp(counts.last_changed, "shared3") == 0);
+
+    printf("Merge and diff test passed\n");
+}
+
+static bool count_entry(void *user, const char *key, uint32_t key_length, const void *value, uint32_t value_length) {
+    (void)key;
+    (void)key_length;
+    (void)value;
+    (void)value_length;
+    (*(int*)user)++;
+    return true;
+}
+
+void test_free_space() {
+    blf_file_t *file = blf_create("/tmp/test_free.blf");
+    assert(file != NULL);
+
+    char key[32];
+    char value[256];
+    memset(value, 'a', sizeof(value));
+    for (int i = 0; i < 100; i++) {
+        sprintf(key, "key%03d", i);
+        assert(blf_put_kv(file, key, value, 100));
+    }
+    assert(blf_write_raw(file, "raw", 3));
+    uint64_t kv_size = file->header.kv_size;
+    uint64_t entry = kv_size / 100;
+
+    // Shrinking updates land in the holes left by earlier ones
+    for (int i = 0; i < 100; i += 2) {
+        sprintf(key, "key%03d", i);
+        memset(value, 'b' + i % 20, 40);
+        assert(blf_put_kv(file, key, value, 40));
+    }
+    assert(file->header.kv_size <= kv_size + entry);
+
+    blf_free_stats_t stats;
+    assert(blf_free_stats(file, &stats));
+    assert(stats.kv_size == file->header.kv_size);
+    assert(stats.free_extents > 0 && stats.free_bytes > 0);
+    assert(stats.largest_extent <= stats.free_bytes);
+    assert(stats.fragmentation >= 0 && stats.fragmentation < 1);
+
+    // Deletes release the extent without moving anything
+    uint64_t raw_offset = file->header.raw_offset;
+    assert(blf_delete_kv(file, "key001"));
+    assert(blf_delete_kv(file, "key003"));
+    assert(file->header.raw_offset == raw_offset);
+    blf_free_stats_t after;
+    assert(blf_free_stats(file, &after));
+    assert(after.free_bytes > stats.free_bytes);
+
+    // A typed array placed in a hole keeps its alignment
+    float weights[4] = { 1.5f };
+    assert(blf_put_array(file, "weights", BLF_TYPE_F32, weights, 4, 64));
+    blf_array_t array;
+    assert(blf_get_array(file, "weights", &array));
+    assert(array.offset % 64 == 0);
+    blf_close(file);
+
+    // The free-space map is persisted with the index
+    file = blf_open("/tmp/test_free.blf");
+    assert(file != NULL && file->header.version == BLF_VERSION);
+    assert(file->header.index_offset != 0);
+    blf_free_stats_t reopened;
+    assert(blf_free_stats(file, &reopened));
+    assert(reopened.free_bytes < after.free_bytes);
+    assert(reopened.free_extents > 0);
+
+    uint32_t value_len;
+    for (int i = 0; i < 100; i++) {
+        sprintf(key, "key%03d", i);
+        value_len = sizeof(value);
+        bool found = blf_get_kv(file, key, value, &value_len);
+        if (i == 1 || i == 3) {
+            assert(!found);
+        } else if (i % 2 == 0) {
+            assert(found && value_len == 40 && value[0] == 'b' + i % 20);
+        } else {
+            assert(found && value_len == 100 && value[0] == 'a');
+        }
+    }
+
+    // Scans and rebuilt indexes skip free entries
+    int seen = 0;
+    uint64_t cursor = 0;
+    assert(blf_scan(file, &cursor, count_entry, &seen));
+    assert(seen == 99);
+
+    // Batched scans resume at the cursor and stop where the arena is full
+    blf_scan_entry_t entries[10];
+    char arena[1024];
+    size_t count;
+    uint64_t arena_size = 20;
+    seen = 0;
+    cursor = 0;
+    assert(!blf_scan_batch(file, &cursor, entries, 10, &count, arena, &arena_size));
+    assert(count == 0 && (arena_size == 46 || arena_size == 106) && cursor == 0);
+    while (cursor != BLF_SCAN_END) {
+        arena_size = sizeof(arena);
+        assert(blf_scan_batch(file, &cursor, entries, 10, &count, arena, &arena_size));
+        assert(count <= 10 && arena_size <= sizeof(arena));
+        for (size_t i = 0; i < count; i++) {
+            const char *entry_key = arena + entries[i].offset;
+            if (entries[i].key_length == 7) {
+                assert(memcmp(entry_key, "weights", 7) == 0 && entries[i].value_length == 16);
+                continue;
+            }
+            assert(entries[i].key_length == 6 && memcmp(entry_key, "key", 3) == 0);
+            assert(entries[i].value_length == 40 || entries[i].value_length == 100);
+            assert(entry_key[6] == (entries[i].value_length == 100 ? 'a' : 'b' + atoi(entry_key + 3) % 20));
+        }
+        seen += (int)count;
+    }
+    assert(seen == 99);
+    assert(blf_put_kv(file, "key050", "x", 1));
+    blf_close(file);
+    file = blf_open("/tmp/test_free.blf");
+    assert(blf_free_stats(file, &stats));
+    blf_close(file);
+
+    file = blf_open("/tmp/test_free.blf");
+    file->header.index_offset = 0;
+    blf_free_stats_t rebuilt;
+    assert(blf_free_stats(file, &rebuilt));
+    assert(rebuilt.free_bytes == stats.free_bytes && rebuilt.free_extents == stats.free_extents);
+    value_len = sizeof(value);
+    assert(blf_get_kv(file, "key050", value, &value_len) && value_len == 1);
+
+    // Compaction drops the free space
+    assert(blf_compact(file));
+    assert(blf_free_stats(file, &stats));
+    assert(stats.free_bytes == 0 && stats.free_extents == 0);
+    value_len = sizeof(value);
+    assert(blf_get_kv(file, "key098", value, &value_len) && value_len == 40);
+    uint64_t raw_len = sizeof(value);
+    assert(blf_read_raw(file, value, &raw_len));
+    assert(raw_len == 3 && memcmp(value, "raw", 3) == 0);
+
+    // A released extent merges with the free extents on both sides
+    for (int i = 0; i < 5; i++) {
+        sprintf(key, "merge%d", i);
+        assert(blf_put_kv(file, key, value, 100));
+    }
+    assert(blf_delete_kv(file, "merge1"));
+    assert(blf_delete_kv(file, "merge3"));
+    assert(blf_free_stats(file, &stats) && stats.free_extents == 2);
+    assert(blf_delete_kv(file, "merge2"));
+    assert(blf_free_stats(file, &stats) && stats.free_extents == 1);
+    assert(stats.largest_extent == stats.free_bytes);
+    blf_close(file);
+
+    file = blf_open("/tmp/test_free.blf");
+    file->header.index_offset = 0;
+    assert(blf_free_stats(file, &rebuilt));
+    assert(rebuilt.free_extents == 1 && rebuilt.free_bytes == stats.free_bytes);
+    blf_close(file);
+
+    printf("Free space test passed\n");
+}
+
+// Check the raw section against the pattern it was written with
+static void check_raw(blf_file_t *file, uint64_t raw_size) {
+    uint64_t size = raw_size;
+    char *raw = (char*)malloc(size);
+    assert(blf_read_raw(file, raw, &size) && size == raw_size);
+    for (uint64_t i = 0; i < size; i++) {
+        assert(raw[i] == (char)(i * 31 + i / 4096));
+    }
+    free(raw);
+}
+
+void test_clone() {
+    const char *path = "/tmp/test_clone.blf";
+    const char *copy = "/tmp/test_clone_copy.blf";
+    uint64_t raw_size = 5 * BLF_RAW_ALIGN + 123;
+    char *raw = (char*)malloc(raw_size);
+    for (uint64_t i = 0; i < raw_size; i++) {
+        raw[i] = (char)(i * 31 + i / 4096);
+    }
+
+    blf_file_t *file = blf_create(path);
+    assert(file != NULL);
+    assert(blf_put_kv(file, "first", "1", 1));
+    assert(blf_write_raw(file, raw, raw_size));
+
+    // The KV section grows past the raw section, which moves in pieces
+    char key[32];
+    char value[200];
+    memset(value, 'k', sizeof(value));
+    for (int i = 0; i < 100; i++) {
+        sprintf(key, "key%03d", i);
+        assert(blf_put_kv(file, key, value, sizeof(value)));
+    }
+    assert(file->header.raw_offset > 4 * BLF_RAW_ALIGN);
+    check_raw(file, raw_size);
+    blf_close(file);
+
+    assert(blf_clone(path, copy));
+    assert(!blf_clone(path, path));
+    assert(!blf_clone("/tmp/test_clone_missing.blf", "/tmp/test_clone_unused.blf"));
+
+    // The clone is independent of the original
+    file = blf_open(copy);
+    assert(file != NULL);
+    check_raw(file, raw_size);
+    uint32_t length = sizeof(value);
+    assert(blf_get_kv(file, "key042", value, &length) && length == sizeof(value));
+    assert(blf_put_kv(file, "first", "clone", 5));
+    blf_close(file);
+
+    file = blf_open(path);
+    char small[8];
+    length = sizeof(small);
+    assert(blf_get_kv(file, "first", small, &length) && length == 1 && small[0] == '1');
+    check_raw(file, raw_size);
+
+    // Compaction clones the raw section to its new offset
+    for (int i = 0; i < 100; i += 2) {
+        sprintf(key, "key%03d", i);
+        assert(blf_delete_kv(file, key));
+    }
+    uint64_t kv_size = file->header.kv_size;
+    assert(blf_compact(file));
+    assert(file->header.kv_size < kv_size && file->header.raw_offset % BLF_RAW_ALIGN == 0);
+    check_raw(file, raw_size);
+    length = sizeof(value);
+    assert(blf_get_kv(file, "key043", value, &length) && length == sizeof(value));
+    assert(!blf_get_kv(file, "key042", value, &length));
+    blf_close(file);
+
+    file = blf_open(path);
+    check_raw(file, raw_size);
+    blf_close(file);
+
+    free(raw);
+    remove(copy);
+    printf("Clone test passed\n");
+}
+
+void test_key_lengths() {
+    blf_file_t *file = blf_create("/tmp/test_key_lengths.blf");
+    assert(file != NULL);
+
+    // Keys are taken by length from a larger buffer, without a NUL
+    const char *buffer = "alpha.beta.gamma";
+    assert(blf_put_kv_n(file, buffer, 5, "1", 1));
+    assert(blf_put_kv_n(file, buffer, 10, "22", 2));
+    assert(blf_put_kv_n(file, "a\0b", 3, "nul", 3));
+
+    char value[16];
+    uint32_t length = sizeof(value);
+    assert(blf_get_kv(file, "alpha", value, &length) && length == 1 && value[0] == '1');
+    length = sizeof(value);
+    assert(blf_get_kv_n(file, buffer, 10, value, &length) && length == 2 && memcmp(value, "22", 2) == 0);
+    length = sizeof(value);
+    assert(blf_get_kv_n(file, "a\0b", 3, value, &length) && length == 3 && memcmp(value, "nul", 3) == 0);
+    length = sizeof(value);
+    assert(!blf_get_kv(file, "a", value, &length));
+
+    // Views point into the mapping, and only exist while mapped
+    const void *view = NULL;
+    assert(!blf_get_kv_view(file, buffer, 10, &view, &length));
+    assert(blf_map(file, 0));
+    assert(blf_get_kv_view(file, buffer, 10, &view, &length) && length == 2 && memcmp(view, "22", 2) == 0);
+    assert(!blf_get_kv_view(file, buffer, 7, &view, &length));
+    assert(blf_commit(file));
+    assert(blf_unmap(file));
+
+    assert(blf_delete_kv_n(file, buffer, 5));
+    length = sizeof(value);
+    assert(!blf_get_kv(file, "alpha", value, &length));
+    length = sizeof(value);
+    assert(blf_get_kv(file, "alpha.beta", value, &length) && length == 2);
+    blf_close(file);
+    printf("Key length test passed\n");
+}
+
+// Sum the chunk reference counters
+static bool sum_refs(void *user, const char *key, uint32_t key_length, const void *value, uint32_t value_length) {
+    uint64_t uses;
+    if (key_length > strlen(BLF_DEDUP_REFS_PREFIX) && memcmp(key, BLF_DEDUP_REFS_PREFIX, strlen(BLF_DEDUP_REFS_PREFIX)) == 0 &&
+        value_length == sizeof(uses)) {
+        memcpy(&uses, value, sizeof(uses));
+        *(uint64_t*)user += uses;
+    }
+    return true;
+}
+
+static uint64_t total_refs(blf_file_t *file) {
+    uint64_t total = 0;
+    uint64_t cursor = 0;
+    assert(blf_scan(file, &cursor, sum_refs, &total));
+    return total;
+}
+
+void test_dedup() {
+    // SHA-256 test vectors
+    uint8_t digest[32];
+    blf_sha256("abc", 3, digest);
+    assert(digest[0] == 0xba && digest[1] == 0x78 && digest[30] == 0x15 && digest[31] == 0xad);
+    blf_sha256("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 56, digest);
+    assert(digest[0] == 0x24 && digest[1] == 0x8d && digest[31] == 0xc1);
+
+    blf_file_t *file = blf_create("/tmp/test_dedup.blf");
+    assert(file != NULL);
+
+    size_t size = 1024 * 1024;
+    char *v1 = (char*)malloc(size);
+    char *v2 = (char*)malloc(size + 10);
+    char *out = (char*)malloc(size + 10);
+    uint64_t x = 88172645463325252ULL;
+    for (size_t i = 0; i < size; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        v1[i] = (char)x;
+    }
+
+    blf_dedup_stats_t stats;
+    assert(blf_dedup_write(file, "model", v1, size, &stats));
+    assert(stats.size == size && stats.chunks > 64 && stats.chunks < 512);
+    assert(stats.new_bytes == size);
+    uint64_t v1_chunks = stats.chunks;
+
+    // An edit and an insertion only store the chunks around them
+    memcpy(v2, v1, 300000);
+    memcpy(v2 + 300010, v1 + 300000, size - 300000);
+    memcpy(v2 + 300000, "0123456789", 10);
+    v2[700000] ^= 1;
+    assert(blf_dedup_write(file, "model.v2", v2, size + 10, &stats));
+    assert(stats.new_chunks >= 1 && stats.new_chunks <= 6);
+    assert(stats.new_bytes < size / 8);
+    uint64_t v2_chunks = stats.chunks;
+
+    // The same payload again writes nothing but its chunk list
+    assert(blf_dedup_write(file, "model.copy", v1, size, &stats));
+    assert(stats.new_chunks == 0 && stats.new_bytes == 0);
+    assert(total_refs(file) == 2 * v1_chunks + v2_chunks);
+
+    // Overwrites move the counts by the difference between the versions
+    assert(blf_dedup_write(file, "model.copy", v2, size + 10, &stats));
+    assert(total_refs(file) == v1_chunks + 2 * v2_chunks);
+    assert(blf_dedup_write(file, "model.copy", v1, size, &stats));
+    assert(total_refs(file) == 2 * v1_chunks + v2_chunks);
+
+    // A repeated block is one chunk referenced many times; dropping some of
+    // the repeats lowers its counts without deleting it
+    for (int i = 0; i < 8; i++) {
+        memcpy(out + (size_t)i * (size / 8), v1, size / 8);
+    }
+    assert(blf_dedup_write(file, "repeat", out, size, &stats));
+    uint64_t repeat_chunks = stats.chunks;
+    assert(blf_dedup_write(file, "repeat", out, size / 2, &stats));
+    assert(stats.new_chunks == 0 && stats.chunks < repeat_chunks);
+    assert(total_refs(file) == 2 * v1_chunks + v2_chunks + stats.chunks);
+    uint64_t out_size = size / 2;
+    assert(blf_dedup_read(file, "repeat", out + size / 2, &out_size));
+    assert(out_size == size / 2 && memcmp(out + size / 2, out, size / 2) == 0);
+    assert(blf_dedup_delete(file, "repeat"));
+    assert(total_refs(file) == 2 * v1_chunks + v2_chunks);
+
+    out_size = 16;
+    assert(blf_dedup_read(file, "model", out, &out_size) == false && out_size == size);
+    out_size = size + 10;
+    assert(blf_dedup_read(file, "model", out, &out_size));
+    assert(out_size == size && memcmp(out, v1, size) == 0);
+    out_size = size + 10;
+    assert(blf_dedup_read(file, "model.v2", out, &out_size));
+    assert(out_size == size + 10 && memcmp(out, v2, size + 10) == 0);
+    assert(blf_dedup_read(file, "missing", out, &out_size) == false);
+
+    // Deleting a version keeps the chunks other versions share
+    blf_free_stats_t before;
+    assert(blf_free_stats(file, &before));
+    assert(blf_dedup_delete(file, "model"));
+    assert(blf_dedup_read(file, "model", out, &out_size) == false);
+    out_size = size;
+    assert(blf_dedup_read(file, "model.copy", out, &out_size));
+    assert(memcmp(out, v1, size) == 0);
+    assert(blf_dedup_delete(file, "model.copy"));
+    blf_free_stats_t after;
+    assert(blf_free_stats(file, &after));
+    assert(after.free_bytes > before.free_bytes);
+    blf_close(file);
+
+    file = blf_open("/tmp/test_dedup.blf");
+    out_size = size + 10;
+    assert(blf_dedup_read(file, "model.v2", out, &out_size));
+    assert(out_size == size + 10 && memcmp(out, v2, size + 10) == 0);
+    assert(blf_dedup_write(file, "empty", v1, 0, &stats) && stats.chunks == 0);
+    out_size = 0;
+    assert(blf_dedup_read(file, "empty", NULL, &out_size) && out_size == 0);
+
+    // Overwriting a version releases the chunks only the old one used, so
+    // repeated overwrites with new content keep the live bytes flat
+    blf_free_stats_t flat;
+    uint64_t live = 0;
+    for (int round = 0; round < 6; round++) {
+        for (size_t i = 0; i < size; i++) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            v1[i] = (char)x;
+        }
+        assert(blf_dedup_write(file, "checkpoint", v1, size, &stats) && stats.new_bytes == size);
+        assert(blf_free_stats(file, &flat));
+        if (round == 0) {
+            live = flat.kv_size - flat.free_bytes;
+        }
+        assert(flat.kv_size - flat.free_bytes <= live + live / 16);
+    }
+    out_size = size;
+    assert(blf_dedup_read(file, "checkpoint", out, &out_size) && memcmp(out, v1, size) == 0);
+
+    // A chunk shared with the replaced version survives the overwrite
+    assert(blf_dedup_write(file, "checkpoint.copy", v1, size, &stats) && stats.new_chunks == 0);
+    assert(blf_dedup_write(file, "checkpoint", v2, size + 10, &stats));
+    out_size = size;
+    assert(blf_dedup_read(file, "checkpoint.copy", out, &out_size) && memcmp(out, v1, size) == 0);
+    assert(blf_dedup_delete(file, "checkpoint.copy"));
+    assert(blf_dedup_delete(file, "checkpoint"));
+    out_size = size + 10;
+    assert(blf_dedup_read(file, "model.v2", out, &out_size) && memcmp(out, v2, size + 10) == 0);
+    assert(blf_dedup_delete(file, "model.v2"));
+    assert(blf_dedup_delete(file, "empty"));
+
+    // With every version gone, no chunk or counter is left
+    int left = 0;
+    uint64_t cursor = 0;
+    assert(blf_scan(file, &cursor, count_entry, &left));
+    assert(left == 0);
+    blf_close(file);
+
+    free(v1);
+    free(v2);
+    free(out);
+    printf("Dedup test passed\n");
+}
+
+typedef struct {
+    blf_file_t *file;
+    volatile int stop;
+    bool ok;
+} serve_args_t;
+
+static void *serve_thread(void *arg) {
+    serve_args_t *args = (serve_args_t*)arg;
+    blf_serve_options_t options = { "/tmp/test_blf.sock", true, &args->stop, 0 };
+    args->ok = blf_serve(args->file, &options);
+    return NULL;
+}
+
+static bool collect_scan(void *user, const char *key, uint32_t key_length, const void *value, uint32_t value_length) {
+    int *seen = (int*)user;
+    assert(key_length > 4 && memcmp(key, "scan", 4) == 0);
+    assert(value_length == 1 && *(const char*)value == 's');
+    (*seen)++;
+    return true;
+}
+
+// Connect without the client library, to control when each side is closed
+static int raw_connect(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(fd >= 0);
+    assert(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+    return fd;
+}
+
+static void read_exactly(int fd, void *data, size_t length) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = read(fd, (char*)data + done, length - done);
+        assert(n > 0);
+        done += (size_t)n;
+    }
+}
+
+void test_server() {
+    blf_file_t *file = blf_create("/tmp/test_server.blf");
+    assert(file != NULL);
+    assert(blf_write_raw(file, "0123456789", 10));
+    char *huge = (char*)calloc(1, BLF_NET_MAX_FRAME + 1);
+    assert(huge && blf_put_kv(file, "huge", huge, BLF_NET_MAX_FRAME + 1));
+    assert(blf_put_kv_n(file, "nul\0key", 7, "embedded", 8));
+    free(huge);
+
+    // A path that is not a socket is left alone
+    remove("/tmp/test_blf.sock");
+    FILE *plain = fopen("/tmp/test_blf.sock", "w");
+    assert(plain != NULL);
+    fclose(plain);
+    volatile int never = 0;
+    blf_serve_options_t refused = { "/tmp/test_blf.sock", true, &never, 0 };
+    assert(blf_serve(file, &refused) == false);
+    struct stat st;
+    assert(stat("/tmp/test_blf.sock", &st) == 0 && S_ISREG(st.st_mode));
+    remove("/tmp/test_blf.sock");
+
+    serve_args_t args = { file, 0, false };
+    pthread_t thread;
+    assert(pthread_create(&thread, NULL, serve_thread, &args) == 0);
+    blf_client_t *client = NULL;
+    while (!(client = blf_client_connect("/tmp/test_blf.sock"))) {
+        sched_yield();
+    }
+
+    // Blocking round trips
+    char value[64];
+    uint32_t value_len = sizeof(value);
+    assert(blf_client_put(client, "name", "server", 6));
+    assert(blf_client_get(client, "name", value, &value_len));
+    assert(value_len == 6 && memcmp(value, "server", 6) == 0);
+    value_len = 2;
+    assert(blf_client_get(client, "name", value, &value_len) == false && value_len == 6);
+    value_len = sizeof(value);
+    assert(blf_client_get(client, "missing", value, &value_len) == false);
+    assert(blf_client_delete(client, "name"));
+    value_len = sizeof(value);
+    assert(blf_client_get(client, "name", value, &value_len) == false);
+
+    // Pipelined requests come back in order
+    char key[32];
+    for (int i = 0; i < 500; i++) {
+        sprintf(key, "scan%d", i);
+        assert(blf_client_send_put(client, key, "s", 1));
+    }
+    assert(blf_client_send_get(client, "scan7"));
+    blf_reply_t reply;
+    for (uint32_t i = 0; i < 500; i++) {
+        assert(blf_client_recv(client, &reply));
+        assert(reply.id == i + 7 && reply.status == BLF_NET_OK);
+    }
+    assert(blf_client_recv(client, &reply));
+    assert(reply.status == BLF_NET_OK && reply.length == 1 && *(const char*)reply.data == 's');
+    assert(blf_client_recv(client, &reply) == false);
+
+    // Batched lookups
+    assert(blf_client_put(client, "other", "value", 5));
+    const char *keys[3] = { "scan1", "nope", "other" };
+    blf_get_result_t results[3];
+    uint64_t arena_size = 0;
+    assert(blf_client_get_many(client, keys, 3, results, NULL, &arena_size) == false);
+    assert(arena_size == 6);
+    assert(blf_client_get_many(client, keys, 3, results, value, &arena_size));
+    assert(results[0].found && !results[1].found && results[2].found);
+    assert(memcmp(value + results[2].offset, "value", 5) == 0);
+
+    // Prefix scan in pages
+    int seen = 0;
+    uint64_t cursor = 0;
+    int pages = 0;
+    while (cursor != BLF_SCAN_END) {
+        assert(blf_client_scan(client, "scan", &cursor, 128, collect_scan, &seen));
+        pages++;
+    }
+    assert(seen == 500 && pages == 4);
+
+    // Replies never exceed the frame limit, and the connection stays in
+    // step after one is refused. Scans skip the oversized entry unless it
+    // matches.
+    value_len = sizeof(value);
+    assert(blf_client_get(client, "huge", value, &value_len) == false);
+    const char *with_huge[2] = { "huge", "other" };
+    arena_size = 0;
+    assert(blf_client_get_many(client, with_huge, 2, results, NULL, &arena_size) == false && arena_size == 0);
+    cursor = 0;
+    assert(blf_client_scan(client, "huge", &cursor, 0, collect_scan, &seen) == false);
+    value_len = sizeof(value);
+    assert(blf_client_get(client, "other", value, &value_len) && value_len == 5);
+
+    // Batched keys keep their lengths, so an embedded NUL is part of the key
+    int nul_fd = raw_connect("/tmp/test_blf.sock");
+    char payload[4 + 4 + 7 + 4 + 3];
+    uint32_t field = 2;
+    memcpy(payload, &field, 4);
+    field = 7;
+    memcpy(payload + 4, &field, 4);
+    memcpy(payload + 8, "nul\0key", 7);
+    field = 3;
+    memcpy(payload + 15, &field, 4);
+    memcpy(payload + 19, "nul", 3);
+    blf_net_request_t request;
+    memset(&request, 0, sizeof(request));
+    request.length = sizeof(payload);
+    request.op = BLF_NET_GET_MANY;
+    assert(write(nul_fd, &request, sizeof(request)) == sizeof(request));
+    assert(write(nul_fd, payload, sizeof(payload)) == sizeof(payload));
+    blf_net_response_t response;
+    read_exactly(nul_fd, &response, sizeof(response));
+    assert(response.status == BLF_NET_OK && response.length == 2 * 5 + 8);
+    read_exactly(nul_fd, payload, response.length);
+    memcpy(&field, payload + 1, 4);
+    assert(payload[0] == 1 && field == 8 && memcmp(payload + 5, "embedded", 8) == 0);
+    memcpy(&field, payload + 14, 4);
+    assert(payload[13] == 0 && field == 0);
+    close(nul_fd);
+
+    // Raw window, clamped to the section
+    uint64_t raw_size = 8;
+    assert(blf_client_read_raw(client, 4, value, &raw_size));
+    assert(raw_size == 6 && memcmp(value, "456789", 6) == 0);
+
+    // Requests sent before the client closes its side all get responses,
+    // even when they are not read until then and exceed the output bound
+    char *big = (char*)calloc(1, 64 * 1024);
+    assert(big && blf_client_put(client, "big", big, 64 * 1024));
+    int fd = raw_connect("/tmp/test_blf.sock");
+    for (uint32_t i = 0; i < 200; i++) {
+        memset(&request, 0, sizeof(request));
+        request.length = 3;
+        request.id = i;
+        request.op = BLF_NET_GET;
+        assert(write(fd, &request, sizeof(request)) == sizeof(request));
+        assert(write(fd, "big", 3) == 3);
+    }
+    assert(shutdown(fd, SHUT_WR) == 0);
+    for (uint32_t i = 0; i < 200; i++) {
+        read_exactly(fd, &response, sizeof(response));
+        assert(response.id == i && response.status == BLF_NET_OK && response.length == 64 * 1024);
+        read_exactly(fd, big, response.length);
+    }
+    assert(read(fd, value, 1) == 0);
+    close(fd);
+    free(big);
+
+    blf_client_close(client);
+    args.stop = 1;
+    pthread_join(thread, NULL);
+    assert(args.ok);
+    blf_close(file);
+
+    file = blf_open("/tmp/test_server.blf");
+    value_len = sizeof(value);
+    assert(blf_get_kv(file, "scan499", value, &value_len) && value_len == 1);
+    blf_close(file);
+
+    printf("Server test passed\n");
+}
+
 int main() {
     printf("Testing BLF file format...\n");
     test_basic_operations();
+    test_many_keys();
+    test_value_cache();
+    test_typed_values();
+    test_mapped_mode();
+    test_persistent_index();
+    test_legacy_header();
+    test_ranged_raw_reads();
+    test_raw_patches();
+    test_direct_io();
+    test_get_many();
+    test_typed_arrays();
+    test_merge_and_diff();
+    test_server();
+    test_free_space();
+    test_dedup();
+    test_clone();
+    test_key_lengths();
     printf("All tests passed!\n");
     return 0;
 }
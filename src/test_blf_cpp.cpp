@@ -0,0 +1,127 @@
+#include "blf.hpp"
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <type_traits>
+
+static_assert(!std::is_copy_constructible_v<blf::File>, "File is move-only");
+static_assert(std::is_nothrow_move_constructible_v<blf::File>, "File moves without throwing");
+
+void test_file_handle() {
+    blf::File file = blf::File::create("/tmp/test_cpp.blf");
+    assert(file);
+
+    // Keys are views into a larger string
+    std::string text = "alpha beta gamma";
+    std::string_view alpha = std::string_view(text).substr(0, 5);
+    std::string_view beta = std::string_view(text).substr(6, 4);
+    assert(file.put(alpha, "first"));
+    assert(file.put(beta, blf::as_bytes("second")));
+    assert(file.put(std::string_view("nul\0key", 7), "embedded"));
+
+    std::string value;
+    assert(file.get(alpha, value) && value == "first");
+    assert(file.get(beta, value) && value == "second");
+    assert(file.get(std::string_view("nul\0key", 7)) == std::optional<std::string>("embedded"));
+    assert(!file.get("nul"));
+    assert(!file.get("missing", value) && value.empty());
+
+    // Batches keep each key's length too
+    std::vector<std::optional<std::string>> values;
+    assert(file.get_many({alpha, std::string_view("nul\0key", 7), "nul", beta, alpha}, values));
+    assert(values.size() == 5 && values[0] == "first" && values[1] == "embedded" && !values[2]);
+    assert(values[3] == "second" && values[4] == "first");
+    assert(file.get_many({}, values) && values.empty());
+
+    // A buffer that is too small reports the length needed
+    char small[2];
+    uint32_t length = sizeof(small);
+    assert(!file.get(beta, small, length) && length == 6);
+
+    // Moving transfers ownership; the moved-from handle is empty
+    blf::File moved = std::move(file);
+    assert(!file && moved);
+    assert(!file.put("key", "value"));
+    file = std::move(moved);
+    assert(file.erase(alpha));
+    assert(!file.get(alpha));
+    file.close();
+    assert(!file);
+
+    file = blf::File::open(std::string("/tmp/test_cpp.blf"));
+    assert(file.get(beta, value) && value == "second");
+    assert(!blf::File::open("/tmp/test_cpp_missing.blf"));
+    printf("C++ file handle test passed\n");
+}
+
+void test_mapped_views() {
+    blf::File file = blf::File::create("/tmp/test_cpp_map.blf");
+    assert(file.put("weights", "0123456789"));
+    assert(!file.view("weights"));
+
+    assert(file.map() && file.mapped());
+    std::optional<blf::bytes_view> view = file.view("weights");
+    assert(view && view->size() == 10);
+    assert(blf::as_string(*view) == "0123456789");
+    // Views of the same value point at the same mapped bytes
+    assert(file.view("weights")->data() == view->data());
+    assert(!file.view("missing"));
+
+    // Written through the mapping, so the next view sees the new value
+    assert(file.put("weights", "abcdefghij"));
+    assert(blf::as_string(*file.view("weights")) == "abcdefghij");
+    assert(file.commit());
+    assert(file.unmap() && !file.mapped());
+    printf("C++ mapped view test passed\n");
+}
+
+void test_iteration() {
+    blf::File file = blf::File::create("/tmp/test_cpp_iter.blf");
+    std::map<std::string, std::string> expected;
+    char key[32];
+    std::string value;
+
+    // More entries and bytes than one batch, with some deleted
+    for (int i = 0; i < 3000; i++) {
+        snprintf(key, sizeof(key), "key%05d", i);
+        value.assign(static_cast<size_t>(i % 300), static_cast<char>('a' + i % 26));
+        assert(file.put(key, value));
+        expected[key] = value;
+    }
+    for (int i = 0; i < 3000; i += 7) {
+        snprintf(key, sizeof(key), "key%05d", i);
+        assert(file.erase(key));
+        expected.erase(key);
+    }
+    assert(file.put("key00001", "resized past its old extent"));
+    expected["key00001"] = "resized past its old extent";
+
+    std::map<std::string, std::string> seen;
+    for (const blf::Entry &entry : file) {
+        assert(seen.count(std::string(entry.key)) == 0);
+        seen[std::string(entry.key)] = std::string(blf::as_string(entry.value));
+    }
+    assert(seen == expected);
+
+    // A copied iterator keeps its own entry
+    blf::Iterator it = file.begin();
+    blf::Iterator copy = it;
+    ++it;
+    assert(copy->key != it->key && copy != it);
+    assert(!copy.failed());
+
+    blf::File empty = blf::File::create("/tmp/test_cpp_empty.blf");
+    assert(empty.begin() == empty.end());
+    printf("C++ iteration test passed\n");
+}
+
+int main() {
+    printf("Testing BLF C++ interface...\n");
+    test_file_handle();
+    test_mapped_views();
+    test_iteration();
+    printf("All C++ tests passed!\n");
+    return 0;
+}